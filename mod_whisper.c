@@ -33,6 +33,13 @@
 
 #include "mod_whisper.h"
 #include "websock_glue.h"
+#include "whisper_tap.h"
+#include "whisper_mux.h"
+#include "whisper_stage.h"
+#include "whisper_local.h"
+#include <math.h>
+#include <time.h>
+#include <malloc.h>
 #include <httpd.h>
 #include <http_config.h>
 #include <http_protocol.h>
@@ -132,606 +139,3793 @@ module AP_MODULE_DECLARE_DATA whisper_module = {
 	whisper_register_hooks    // 注册钩子
 };
 
-/* ASR interface */ 
+/* Grammar cache */
 
-static void whisper_reset_vad(whisper_t *context)
+static char *whisper_grammar_hash(const char *data, switch_size_t len, switch_memory_pool_t *pool)
 {
-	if (context->vad) {
-		switch_vad_reset(context->vad);
-	}
-	context->flags = 0;
-	context->result_text = "";
-	context->result_confidence = 87.3;
-	switch_set_flag(context, ASRFLAG_READY);
-	context->no_input_time = switch_micro_time_now();
-	if (context->start_input_timers) {
-		switch_set_flag(context, ASRFLAG_INPUT_TIMERS);
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	switch_size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char) data[i];
+		hash *= 0x100000001b3ULL;
 	}
+
+	return switch_core_sprintf(pool, "%016llx", (unsigned long long) hash);
 }
 
-static switch_status_t whisper_open(switch_asr_handle_t *ah, const char *codec, int rate, const char *dest, switch_asr_flag_t *flags)
+static char *whisper_grammar_read_file(const char *path, switch_size_t *len)
 {
-	whisper_t *context;
-	char *asr_server = NULL;
-	switch_status_t status = SWITCH_STATUS_SUCCESS;
+	FILE *fp;
+	long size;
+	char *data = NULL;
 
+	if (!(fp = fopen(path, "rb"))) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Unable to open grammar file %s\n", path);
+		return NULL;
+	}
 
-	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "asr_open attempt on CLOSED asr handle\n");
-		return SWITCH_STATUS_FALSE;
+	if (fseek(fp, 0, SEEK_END) || (size = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Unable to stat grammar file %s\n", path);
+		goto end;
 	}
 
-	if (!(context = (whisper_t *) switch_core_alloc(ah->memory_pool, sizeof(*context)))) {
-		return SWITCH_STATUS_MEMERR;
+	if ((switch_size_t) size > whisper_globals.grammar_max_size) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Grammar file %s is %ld bytes, limit is %" SWITCH_SIZE_T_FMT "\n",
+						  path, size, whisper_globals.grammar_max_size);
+		goto end;
 	}
 
-	context->pool = ah->memory_pool;
+	switch_zmalloc(data, size + 1);
 
-	ah->private_info = context;
-	codec = "L16";
-	ah->codec = switch_core_strdup(ah->memory_pool, codec);
+	if (fread(data, 1, size, fp) != (size_t) size) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Short read on grammar file %s\n", path);
+		switch_safe_free(data);
+		goto end;
+	}
 
-	asr_server = switch_core_strdup(whisper_globals.pool, whisper_globals.asr_server_url);
+	*len = size;
 
-	if (rate > 16000) {
-		ah->native_rate = 16000;
+  end:
+	fclose(fp);
+	return data;
+}
+
+/*
+ * Build the request for a grammar once. A grammar with a server registered id is sent as
+ * {"grammar_id": id}, anything else carries its content hash so the server can cache it too.
+ * "hints:a,b,c" (or type="hints" in the config) becomes a {"hints": [...]} list.
+ * Everything is allocated from pool. Must be called with grammar_mutex held.
+ */
+static whisper_grammar_t *whisper_grammar_compile(const char *name, const char *value, const char *id, switch_bool_t hints, switch_memory_pool_t *pool)
+{
+	whisper_grammar_t *grammar = NULL;
+	ks_json_t *req = NULL;
+	char *data = NULL, *message = NULL;
+	const char *content = value;
+	switch_size_t len;
+
+	if (!strncasecmp(content, "hints:", 6)) {
+		content += 6;
+		hints = SWITCH_TRUE;
+	}
+
+	if (!strncasecmp(content, "file:", 5)) {
+		if (!(data = whisper_grammar_read_file(content + 5, &len))) {
+			return NULL;
+		}
+		content = data;
+	} else if ((len = strlen(content)) > whisper_globals.grammar_max_size) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Grammar %s is %" SWITCH_SIZE_T_FMT " bytes, limit is %" SWITCH_SIZE_T_FMT "\n",
+						  name, len, whisper_globals.grammar_max_size);
+		return NULL;
 	}
 
-	switch_mutex_init(&context->mutex, SWITCH_MUTEX_NESTED, whisper_globals.pool);
+	grammar = switch_core_alloc(pool, sizeof(*grammar));
+	grammar->name = switch_core_strdup(pool, name);
+	grammar->size = len;
 
-	if (switch_buffer_create_dynamic(&context->audio_buffer, AUDIO_BLOCK_SIZE, AUDIO_BLOCK_SIZE, 0) != SWITCH_STATUS_SUCCESS) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Failed to create the audio buffer\n");
-		return SWITCH_STATUS_MEMERR;
+	req = ks_json_create_object();
+
+	if (!zstr(id)) {
+		grammar->id = switch_core_strdup(pool, id);
+	} else {
+		grammar->id = whisper_grammar_hash(content, len, pool);
+
+		if (hints) {
+			ks_json_t *list = ks_json_create_array();
+			char *dup = strdup(content), *p = dup, *next;
+
+			while (p) {
+				if ((next = strchr(p, ','))) {
+					*next++ = '\0';
+				}
+				if (!zstr(p)) {
+					ks_json_add_item_to_array(list, ks_json_create_string(p));
+				}
+				p = next;
+			}
+
+			free(dup);
+			ks_json_add_item_to_object(req, "hints", list);
+		} else {
+			ks_json_add_string_to_object(req, "grammar", content);
+		}
 	}
 
-	status = ws_asr_setup_connection(asr_server, context, whisper_globals.pool);
+	ks_json_add_string_to_object(req, "grammar_id", grammar->id);
 
-	if (status != SWITCH_STATUS_SUCCESS) {
-		whisper_fire_event(context, "whisper::asr_connection_error");
-		ws_asr_close_connection(context);
-		return status;
+	message = ks_json_print_unformatted(req);
+	grammar->message = switch_core_strdup(pool, message);
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Compiled grammar %s id %s (%" SWITCH_SIZE_T_FMT " bytes)\n", name, grammar->id, len);
+
+	switch_safe_free(message);
+	switch_safe_free(data);
+	ks_json_delete(&req);
+
+	return grammar;
+}
+
+/* grammar_mutex held */
+static void whisper_grammar_adhoc_unlink(whisper_grammar_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		whisper_globals.adhoc_head = entry->next;
 	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		whisper_globals.adhoc_tail = entry->prev;
+	}
+	entry->prev = entry->next = NULL;
+}
 
-	context->thresh = 400;
-	context->silence_ms = 700;
-	context->voice_ms = 60;
-	context->start_input_timers = 1;
-	context->no_input_timeout = 5000;
-	context->speech_timeout = 10000;
+/* grammar_mutex held */
+static void whisper_grammar_adhoc_push(whisper_grammar_t *entry)
+{
+	entry->prev = NULL;
+	if ((entry->next = whisper_globals.adhoc_head)) {
+		entry->next->prev = entry;
+	} else {
+		whisper_globals.adhoc_tail = entry;
+	}
+	whisper_globals.adhoc_head = entry;
+}
 
-	context->vad = switch_vad_init(ah->native_rate, 1);
-	switch_vad_set_mode(context->vad, -1);
-	switch_vad_set_param(context->vad, "thresh", context->thresh);
-	switch_vad_set_param(context->vad, "silence_ms", context->silence_ms);
-	switch_vad_set_param(context->vad, "voice_ms", context->voice_ms);
-	switch_vad_set_param(context->vad, "debug", 1);
+/* grammar_mutex held */
+static void whisper_grammar_adhoc_free(whisper_grammar_t *entry)
+{
+	switch_memory_pool_t *pool = entry->pool;
 
-	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "ASR opened\n");
+	whisper_grammar_adhoc_unlink(entry);
+	switch_core_hash_delete(whisper_globals.grammar_adhoc, entry->name);
+	whisper_globals.adhoc_count--;
+	switch_core_destroy_memory_pool(&pool);
+}
 
-	whisper_reset_vad(context);
+/*
+ * A grammar given inline by the caller rather than by a configured name. Each one gets its own
+ * pool so the least recently used can be dropped once GRAMMAR_ADHOC_CACHE_MAX are cached.
+ * grammar_mutex held.
+ */
+static whisper_grammar_t *whisper_grammar_adhoc_get(const char *grammar)
+{
+	switch_memory_pool_t *pool = NULL;
+	whisper_grammar_t *entry;
 
-	return status;
+	if ((entry = switch_core_hash_find(whisper_globals.grammar_adhoc, grammar))) {
+		whisper_grammar_adhoc_unlink(entry);
+		whisper_grammar_adhoc_push(entry);
+		return entry;
+	}
+
+	if (switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS) {
+		return NULL;
+	}
+
+	if (!(entry = whisper_grammar_compile(grammar, grammar, NULL, SWITCH_FALSE, pool))) {
+		switch_core_destroy_memory_pool(&pool);
+		return NULL;
+	}
+
+	while (whisper_globals.adhoc_count >= GRAMMAR_ADHOC_CACHE_MAX && whisper_globals.adhoc_tail) {
+		whisper_grammar_adhoc_free(whisper_globals.adhoc_tail);
+	}
+
+	entry->pool = pool;
+	switch_core_hash_insert(whisper_globals.grammar_adhoc, entry->name, entry);
+	whisper_grammar_adhoc_push(entry);
+	whisper_globals.adhoc_count++;
+
+	return entry;
 }
 
-static switch_status_t whisper_load_grammar(switch_asr_handle_t *ah, const char *grammar, const char *name)
+/* Returns a copy of the prepared grammar request in the given pool, compiling it on first use */
+static char *whisper_grammar_cache_get(const char *grammar, switch_memory_pool_t *pool)
 {
-	whisper_t *context = (whisper_t *)ah->private_info;
-	char req_string[100];
+	whisper_grammar_t *entry;
+	char *message = NULL;
 
-	ks_json_t *req = ks_json_create_object();
+	switch_mutex_lock(whisper_globals.grammar_mutex);
 
-	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "asr_open attempt on CLOSED asr handle\n");
-		return SWITCH_STATUS_FALSE;
+	if (!(entry = switch_core_hash_find(whisper_globals.grammar_cache, grammar))) {
+		entry = whisper_grammar_adhoc_get(grammar);
 	}
 
-	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "load grammar %s\n", grammar);
-	context->grammar = switch_core_strdup(ah->memory_pool, grammar);
+	if (entry) {
+		message = switch_core_strdup(pool, entry->message);
+	}
 
-	snprintf(req_string, sizeof(req_string), "{\"grammar\": \"%s\"}", grammar);
-	
-	ks_json_add_string_to_object(req, "grammar", grammar);
-	strcpy(req_string, ks_json_print_unformatted(req));
+	switch_mutex_unlock(whisper_globals.grammar_mutex);
 
+	return message;
+}
 
-	if (ws_send_text(context->wsi, req_string) != SWITCH_STATUS_SUCCESS) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Unable to send grammar to websocket server\n");
+/* grammar_mutex held */
+static void whisper_grammar_cache_destroy(void)
+{
+	while (whisper_globals.adhoc_head) {
+		whisper_grammar_adhoc_free(whisper_globals.adhoc_head);
+	}
+	if (whisper_globals.grammar_adhoc) {
+		switch_core_hash_destroy(&whisper_globals.grammar_adhoc);
+	}
+	if (whisper_globals.grammar_cache) {
+		switch_core_hash_destroy(&whisper_globals.grammar_cache);
+	}
+	if (whisper_globals.grammar_pool) {
+		switch_core_destroy_memory_pool(&whisper_globals.grammar_pool);
 	}
-	
-	return SWITCH_STATUS_SUCCESS;
 }
 
-static switch_status_t whisper_unload_grammar(switch_asr_handle_t *ah, const char *name)
+static void whisper_grammar_cache_flush(void)
 {
-	return SWITCH_STATUS_SUCCESS;
+	switch_mutex_lock(whisper_globals.grammar_mutex);
+
+	whisper_grammar_cache_destroy();
+
+	switch_core_new_memory_pool(&whisper_globals.grammar_pool);
+	switch_core_hash_init(&whisper_globals.grammar_cache);
+	switch_core_hash_init(&whisper_globals.grammar_adhoc);
+
+	switch_mutex_unlock(whisper_globals.grammar_mutex);
 }
 
-static switch_status_t whisper_close(switch_asr_handle_t *ah, switch_asr_flag_t *flags)
+static void load_grammars(switch_xml_t cfg, whisper_settings_t *settings)
 {
-	whisper_t *context = (whisper_t *)ah->private_info;
-	switch_status_t status = SWITCH_STATUS_SUCCESS;
+	switch_xml_t grammars, grammar;
+	whisper_grammar_t *entry;
 
-	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "ASR close!\n");
-	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Double ASR close!\n");
-		return SWITCH_STATUS_FALSE;
+	whisper_grammar_cache_flush();
+
+	switch_mutex_lock(whisper_globals.grammar_mutex);
+	whisper_globals.grammar_max_size = settings->grammar_max_size;
+
+	if (!(grammars = switch_xml_child(cfg, "grammars"))) {
+		switch_mutex_unlock(whisper_globals.grammar_mutex);
+		return;
 	}
 
-	switch_mutex_lock(context->mutex);
-	ws_asr_close_connection(context);
+	for (grammar = switch_xml_child(grammars, "grammar"); grammar; grammar = grammar->next) {
+		const char *name = switch_xml_attr_soft(grammar, "name");
+		const char *value = switch_xml_attr_soft(grammar, "value");
+		const char *id = switch_xml_attr(grammar, "id");
+		const char *type = switch_xml_attr_soft(grammar, "type");
 
-	if (context->vad) {
-		switch_vad_destroy(&context->vad);
+		if (zstr(name) || (zstr(value) && zstr(id))) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Ignoring grammar without name or value\n");
+			continue;
+		}
+
+		if (!(entry = whisper_grammar_compile(name, value, id, !strcasecmp(type, "hints"), whisper_globals.grammar_pool))) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Unable to load grammar %s\n", name);
+		} else {
+			switch_core_hash_insert(whisper_globals.grammar_cache, entry->name, entry);
+		}
 	}
 
-	
-	switch_buffer_destroy(&context->audio_buffer);
-	switch_set_flag(ah, SWITCH_ASR_FLAG_CLOSED);
-	
-	switch_mutex_unlock(context->mutex);
-	return status;
+	switch_mutex_unlock(whisper_globals.grammar_mutex);
 }
 
-static switch_status_t whisper_feed(switch_asr_handle_t *ah, void *data, unsigned int len, switch_asr_flag_t *flags)
+/* Session arenas */
+
+#define WHISPER_ARENA_ALIGN(x) (((x) + 15) & ~((switch_size_t) 15))
+
+switch_status_t whisper_slab_pool_init(whisper_slab_pool_t *slabs, switch_size_t slab_size, uint32_t max_free, switch_memory_pool_t *pool)
 {
-	whisper_t *context = (whisper_t *) ah->private_info;
-	switch_vad_state_t vad_state;
-	int rlen;
+	memset(slabs, 0, sizeof(*slabs));
+	switch_mutex_init(&slabs->mutex, SWITCH_MUTEX_NESTED, pool);
+	whisper_slab_pool_resize(slabs, slab_size, max_free);
 
-	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
-		return SWITCH_STATUS_BREAK;
+	return slabs->free ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_MEMERR;
+}
+
+/* Cached slabs of the old size are dropped, arenas still holding one free it on release */
+void whisper_slab_pool_resize(whisper_slab_pool_t *slabs, switch_size_t slab_size, uint32_t max_free)
+{
+	void **free_list = NULL;
+
+	switch_zmalloc(free_list, (max_free ? max_free : 1) * sizeof(void *));
+
+	switch_mutex_lock(slabs->mutex);
+
+	while (slabs->nfree) {
+		free(slabs->free[--slabs->nfree]);
 	}
+	switch_safe_free(slabs->free);
 
-	if (switch_test_flag(context, ASRFLAG_RETURNED_RESULT) && switch_test_flag(ah, SWITCH_ASR_FLAG_AUTO_RESUME)) {
-		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Auto Resuming\n");
-		whisper_reset_vad(context);
+	slabs->free = free_list;
+	slabs->max_free = max_free;
+	slabs->slab_size = WHISPER_ARENA_ALIGN(slab_size);
+
+	switch_mutex_unlock(slabs->mutex);
+}
+
+void whisper_slab_pool_destroy(whisper_slab_pool_t *slabs)
+{
+	whisper_slab_pool_resize(slabs, 0, 0);
+	switch_safe_free(slabs->free);
+}
+
+whisper_arena_t *whisper_arena_create(whisper_slab_pool_t *slabs)
+{
+	whisper_arena_t *arena;
+	void *slab = NULL;
+	switch_size_t slab_size;
+
+	switch_mutex_lock(slabs->mutex);
+	slab_size = slabs->slab_size;
+	if (slabs->nfree) {
+		slab = slabs->free[--slabs->nfree];
+	}
+	slabs->in_use++;
+	switch_mutex_unlock(slabs->mutex);
+
+	if (!slab && !(slab = malloc(slab_size))) {
+		switch_mutex_lock(slabs->mutex);
+		slabs->in_use--;
+		switch_mutex_unlock(slabs->mutex);
+		return NULL;
 	}
 
-	switch_mutex_lock(context->mutex);
-	
-	if (switch_test_flag(context, ASRFLAG_READY)) {
+	arena = (whisper_arena_t *) slab;
+	memset(arena, 0, sizeof(*arena));
+	arena->slabs = slabs;
+	arena->slab_size = slab_size;
+	arena->base = (uint8_t *) slab + WHISPER_ARENA_ALIGN(sizeof(*arena));
+	arena->size = slab_size - WHISPER_ARENA_ALIGN(sizeof(*arena));
 
-		vad_state = switch_vad_process(context->vad, (int16_t *)data, len / sizeof(uint16_t));
-		
-		if (vad_state == SWITCH_VAD_STATE_TALKING) {
+	return arena;
+}
 
-			char buf[AUDIO_BLOCK_SIZE];
+/* Zeroed memory, safe to call from the media and the websocket thread at once */
+void *whisper_arena_alloc(whisper_arena_t *arena, switch_size_t size)
+{
+	switch_size_t need = WHISPER_ARENA_ALIGN(size);
+	switch_size_t offset = __atomic_fetch_add(&arena->used, need, __ATOMIC_RELAXED);
+	whisper_arena_chunk_t *chunk = NULL;
 
-			switch_buffer_write(context->audio_buffer, data, len);
+	if (offset + need <= arena->size) {
+		memset(arena->base + offset, 0, need);
+		return arena->base + offset;
+	}
 
-			if (switch_buffer_inuse(context->audio_buffer) > AUDIO_BLOCK_SIZE) {
-				rlen = switch_buffer_read(context->audio_buffer, buf, AUDIO_BLOCK_SIZE);
-				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Sending data %d %d\n", rlen, context->started);
-	
-				if (context->started != WS_STATE_STARTED) {
-					whisper_fire_event(context, "whisper::asr_connection_error");
-					switch_mutex_unlock(context->mutex);
-					return SWITCH_STATUS_BREAK; 
-				}
+	/* slab exhausted, fall back to the heap; the chunk still goes back with the arena */
+	switch_zmalloc(chunk, WHISPER_ARENA_ALIGN(sizeof(*chunk)) + size);
+	chunk->next = __atomic_load_n(&arena->overflow, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&arena->overflow, &chunk->next, chunk, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 
-				if (ws_send_binary(context->wsi, buf, rlen) != SWITCH_STATUS_SUCCESS) {
-					switch_mutex_unlock(context->mutex);
-					return SWITCH_STATUS_BREAK;
-				}
-			} 
+	__atomic_fetch_add(&arena->slabs->overflows, 1, __ATOMIC_RELAXED);
 
-		}
+	return (uint8_t *) chunk + WHISPER_ARENA_ALIGN(sizeof(*chunk));
+}
 
-		if (vad_state == SWITCH_VAD_STATE_STOP_TALKING || switch_test_flag(context, ASRFLAG_TIMEOUT)) {
-			switch_status_t ws_status;
+char *whisper_arena_strndup(whisper_arena_t *arena, const char *str, switch_size_t len)
+{
+	char *dup = whisper_arena_alloc(arena, len + 1);
 
-			whisper_fire_event(context, "whisper::asr_stop_talking");
+	memcpy(dup, str, len);
+	dup[len] = '\0';
 
-			ws_status = whisper_get_final_transcription(context);
-			
-			if (ws_status != SWITCH_STATUS_SUCCESS) {
-				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Sendig data for transcription failed\n");
+	return dup;
+}
 
-				switch_mutex_unlock(context->mutex);
+char *whisper_arena_strdup(whisper_arena_t *arena, const char *str)
+{
+	return str ? whisper_arena_strndup(arena, str, strlen(str)) : NULL;
+}
 
-				return SWITCH_STATUS_BREAK;
-			}
-			
-			// set vad flags to stop detection
-			switch_set_flag(context, ASRFLAG_RESULT_PENDING);
-			switch_vad_reset(context->vad);
-			switch_clear_flag(context, ASRFLAG_READY);
-		} else if (vad_state == SWITCH_VAD_STATE_START_TALKING) {
-			
-			whisper_fire_event(context, "whisper::asr_start_talking");
+void whisper_arena_destroy(whisper_arena_t **arena)
+{
+	whisper_arena_t *a = *arena;
+	whisper_slab_pool_t *slabs;
+	whisper_arena_chunk_t *chunk, *next;
 
-			switch_set_flag(context, ASRFLAG_START_OF_SPEECH);
-			context->speech_time = switch_micro_time_now();
-		}
+	if (!a) {
+		return;
 	}
 
-	switch_mutex_unlock(context->mutex);
-	
-	return SWITCH_STATUS_SUCCESS;
+	*arena = NULL;
+	slabs = a->slabs;
+
+	for (chunk = a->overflow; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
+	switch_mutex_lock(slabs->mutex);
+	slabs->in_use--;
+	if (a->slab_size == slabs->slab_size && slabs->nfree < slabs->max_free) {
+		slabs->free[slabs->nfree++] = a;
+		a = NULL;
+	}
+	switch_mutex_unlock(slabs->mutex);
+
+	switch_safe_free(a);
 }
 
-static switch_status_t whisper_pause(switch_asr_handle_t *ah)
+/* context, decoder scratch and the flow-controlled audio buffer share one slab */
+static switch_size_t whisper_tts_slab_size(switch_size_t high_water)
 {
-	whisper_t *context = (whisper_t *) ah->private_info;
+	return WHISPER_ARENA_ALIGN(sizeof(whisper_arena_t)) + WHISPER_ARENA_ALIGN(sizeof(whisper_tts_t)) +
+		TTS_DECODE_BUFFER_SIZE + high_water + TTS_DECODE_BUFFER_SIZE + 4096;
+}
 
-	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "asr_pause attempt on CLOSED asr handle\n");
-		return SWITCH_STATUS_FALSE;
-	}
+/* Settings snapshots */
 
-	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Pausing\n");
+static whisper_settings_t *whisper_settings_create(void)
+{
+	switch_memory_pool_t *pool;
+	whisper_settings_t *settings;
 
-	switch_mutex_lock(context->mutex);
-	context->flags = 0;
+	if (switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS) {
+		return NULL;
+	}
 
-	switch_mutex_unlock(context->mutex);
+	settings = switch_core_alloc(pool, sizeof(*settings));
+	settings->pool = pool;
+	settings->refs = 1;
+
+	settings->asr_server_url = "ws://127.0.0.1:2700";
+	settings->tts_server_url = "ws://127.0.0.1:2600";
+	settings->auto_reload = SWITCH_TRUE;
+	settings->defaults.name = "default";
+	settings->defaults.vad_adaptive = SWITCH_TRUE;
+	settings->defaults.vad_thresh = 400;
+	settings->defaults.vad_silence_ms = 700;
+	settings->defaults.vad_voice_ms = 60;
+	settings->defaults.no_input_timeout = 5000;
+	settings->defaults.speech_timeout = 10000;
+	settings->defaults.result_timeout_ms = ASR_RESULT_TIMEOUT_MS_DEFAULT;
+	settings->tts_encoding = "L16";
+	settings->tts_frame_ms = TTS_FRAME_MS_DEFAULT;
+	settings->tts_high_water = TTS_HIGH_WATER_DEFAULT;
+	settings->tts_low_water = TTS_LOW_WATER_DEFAULT;
+	settings->tts_chunk_max_chars = TTS_CHUNK_MAX_CHARS_DEFAULT;
+	settings->tts_pipeline_depth = TTS_PIPELINE_DEPTH_DEFAULT;
+	settings->admit_queue_size = ADMIT_QUEUE_SIZE_DEFAULT;
+	settings->admit_timeout_ms = ADMIT_TIMEOUT_MS_DEFAULT;
+	settings->arena_cache_slabs = ARENA_CACHE_SLABS_DEFAULT;
+	settings->grammar_max_size = GRAMMAR_MAX_SIZE_DEFAULT;
+	settings->tts_prefetch_max_bytes = STAGE_MAX_BYTES_DEFAULT;
+	settings->ws_ping_interval = WS_PING_INTERVAL_DEFAULT;
+	settings->ws_ping_timeout = WS_PING_TIMEOUT_DEFAULT;
+	settings->tcp_nodelay = SWITCH_TRUE;
+	settings->record_dir = switch_core_sprintf(pool, "%s%swhisper", SWITCH_GLOBAL_dirs.recordings_dir, SWITCH_PATH_SEPARATOR);
+
+	switch_core_hash_init(&settings->profiles);
+	switch_core_hash_init(&settings->routes);
+
+	return settings;
+}
 
-	return SWITCH_STATUS_SUCCESS;
+/* Shared by <settings> and <profile>, returns SWITCH_FALSE for params that are not profile params */
+static switch_bool_t whisper_profile_param(whisper_profile_t *profile, const char *var, const char *val)
+{
+	int nval = atoi(val);
+
+	if (!strcasecmp(var, "vad-thresh")) {
+		if (nval > 0) profile->vad_thresh = nval;
+	} else if (!strcasecmp(var, "vad-silence-ms")) {
+		if (nval > 0) profile->vad_silence_ms = nval;
+	} else if (!strcasecmp(var, "vad-voice-ms")) {
+		if (nval > 0) profile->vad_voice_ms = nval;
+	} else if (!strcasecmp(var, "no-input-timeout")) {
+		if (nval >= 0) profile->no_input_timeout = nval;
+	} else if (!strcasecmp(var, "speech-timeout")) {
+		if (nval >= 0) profile->speech_timeout = nval;
+	} else if (!strcasecmp(var, "vad-adaptive")) {
+		profile->vad_adaptive = switch_true(val);
+	} else if (!strcasecmp(var, "asr-speculative-pause-ms") || !strcasecmp(var, "speculative-pause-ms")) {
+		profile->speculative_pause_ms = nval > 0 ? nval : 0;
+	} else if (!strcasecmp(var, "asr-result-timeout-ms") || !strcasecmp(var, "result-timeout-ms")) {
+		/* always bounded, there is no way to wait forever */
+		if (nval > 0) profile->result_timeout_ms = nval;
+	} else {
+		return SWITCH_FALSE;
+	}
+
+	return SWITCH_TRUE;
 }
 
-static switch_status_t whisper_resume(switch_asr_handle_t *ah)
+/* Calls add for every core in a list like "0-7,16,24-31", false on a malformed list */
+static switch_bool_t whisper_cpu_list_parse(const char *str, void (*add)(int cpu, void *obj), void *obj)
 {
-	whisper_t *context = (whisper_t *) ah->private_info;
+	const char *p = str;
+	char *end;
 
-	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "asr_resume attempt on CLOSED asr handle\n");
-		return SWITCH_STATUS_FALSE;
+	while (*p) {
+		long first, last;
+
+		first = last = strtol(p, &end, 10);
+		if (end == p || first < 0) {
+			return SWITCH_FALSE;
+		}
+		p = end;
+
+		if (*p == '-') {
+			last = strtol(++p, &end, 10);
+			if (end == p || last < first) {
+				return SWITCH_FALSE;
+			}
+			p = end;
+		}
+
+		for (; first <= last && first < WS_CPU_MAX; first++) {
+			add((int) first, obj);
+		}
+
+		while (*p == ',' || *p == ' ' || *p == '\n') {
+			p++;
+		}
 	}
 
-	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Resuming\n");
-	whisper_reset_vad(context);
-	
-	return SWITCH_STATUS_SUCCESS;
+	return SWITCH_TRUE;
 }
 
-static switch_status_t whisper_check_results(switch_asr_handle_t *ah, switch_asr_flag_t *flags)
+static void whisper_ws_cpu_add(int cpu, void *obj)
 {
-	whisper_t *context = (whisper_t *) ah->private_info;
+	whisper_settings_t *settings = (whisper_settings_t *) obj;
+	uint32_t i;
 
-	if (switch_test_flag(context, ASRFLAG_RESULT_PENDING)) {
-		return SWITCH_STATUS_BREAK;
+	for (i = 0; i < settings->ws_cpu_count; i++) {
+		if (settings->ws_cpus[i] == cpu) {
+			return;
+		}
 	}
-		
 
-	if (switch_test_flag(context, ASRFLAG_RETURNED_RESULT) || switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
-		return SWITCH_STATUS_BREAK;
+	settings->ws_cpus[settings->ws_cpu_count++] = cpu;
+}
+
+static void whisper_cpu_node_set(int cpu, void *obj)
+{
+	whisper_globals.cpu_node[cpu] = (int16_t) (intptr_t) obj;
+}
+
+/* cpu -> NUMA node from sysfs, cores stay -1 on systems without it */
+static void whisper_cpu_nodes_load(void)
+{
+	int i;
+
+	for (i = 0; i < WS_CPU_MAX; i++) {
+		whisper_globals.cpu_node[i] = -1;
 	}
 
-	if (!switch_test_flag(context, ASRFLAG_RETURNED_START_OF_SPEECH) && switch_test_flag(context, ASRFLAG_START_OF_SPEECH)) {
-		return SWITCH_STATUS_SUCCESS;
+#ifdef __linux__
+	for (i = 0; i < WS_NUMA_NODE_MAX; i++) {
+		char path[64], buf[1024];
+		FILE *f;
+
+		switch_snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", i);
+		if (!(f = fopen(path, "r"))) {
+			continue;
+		}
+		if (fgets(buf, sizeof(buf), f)) {
+			whisper_cpu_list_parse(buf, whisper_cpu_node_set, (void *) (intptr_t) i);
+		}
+		fclose(f);
 	}
+#endif
+}
 
-	if ((!switch_test_flag(context, ASRFLAG_RESULT_READY)) && (!switch_test_flag(context, ASRFLAG_NOINPUT_TIMEOUT))) {
-		if (switch_test_flag(context, ASRFLAG_INPUT_TIMERS) && !(switch_test_flag(context, ASRFLAG_START_OF_SPEECH)) &&
-				context->no_input_timeout >= 0 &&
+/* <profiles><profile name="noisy"> params start from the <settings> values */
+static void load_profiles(switch_xml_t cfg, whisper_settings_t *settings)
+{
+	switch_xml_t profiles, xprofile, param;
+
+	if (!(profiles = switch_xml_child(cfg, "profiles"))) {
+		return;
+	}
+
+	for (xprofile = switch_xml_child(profiles, "profile"); xprofile; xprofile = xprofile->next) {
+		const char *name = switch_xml_attr_soft(xprofile, "name");
+		whisper_profile_t *profile;
+
+		if (zstr(name)) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Ignoring profile without a name\n");
+			continue;
+		}
+
+		profile = switch_core_alloc(settings->pool, sizeof(*profile));
+		*profile = settings->defaults;
+		profile->name = switch_core_strdup(settings->pool, name);
+
+		for (param = switch_xml_child(xprofile, "param"); param; param = param->next) {
+			const char *var = switch_xml_attr_soft(param, "name");
+
+			if (!whisper_profile_param(profile, var, switch_xml_attr_soft(param, "value"))) {
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Unknown param %s in profile %s\n", var, name);
+			}
+		}
+
+		switch_core_hash_insert(settings->profiles, profile->name, profile);
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Loaded profile %s\n", profile->name);
+	}
+}
+
+/* <routes><route name="zh" url="ws://..." language="zh" max-sessions="8"/>, name is a language or a model */
+static void load_routes(switch_xml_t cfg, whisper_settings_t *settings)
+{
+	switch_xml_t routes, xroute;
+
+	if (!(routes = switch_xml_child(cfg, "routes"))) {
+		return;
+	}
+
+	for (xroute = switch_xml_child(routes, "route"); xroute; xroute = xroute->next) {
+		const char *name = switch_xml_attr_soft(xroute, "name");
+		const char *url = switch_xml_attr_soft(xroute, "url");
+		const char *language = switch_xml_attr(xroute, "language");
+		const char *fallback = switch_xml_attr(xroute, "fallback");
+		const char *max_sessions = switch_xml_attr(xroute, "max-sessions");
+		whisper_route_t *route;
+
+		if (zstr(name) || zstr(url)) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Ignoring route without a name or url\n");
+			continue;
+		}
+
+		route = switch_core_alloc(settings->pool, sizeof(*route));
+		route->name = switch_core_strdup(settings->pool, name);
+		route->url = switch_core_strdup(settings->pool, url);
+		route->language = zstr(language) ? NULL : switch_core_strdup(settings->pool, language);
+		route->fallback = zstr(fallback) ? NULL : switch_core_strdup(settings->pool, fallback);
+		route->max_sessions = max_sessions && atoi(max_sessions) > 0 ? atoi(max_sessions) : 0;
+
+		switch_core_hash_insert(settings->routes, route->name, route);
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Loaded route %s -> %s\n", route->name, route->url);
+	}
+}
+
+/* A model name wins over the language, NULL means asr-server-url */
+static const whisper_route_t *whisper_route_find(whisper_settings_t *settings, const char *model, const char *language)
+{
+	const whisper_route_t *route = NULL;
+
+	if (!zstr(model)) {
+		route = switch_core_hash_find(settings->routes, model);
+	}
+
+	if (!route && !zstr(language)) {
+		route = switch_core_hash_find(settings->routes, language);
+	}
+
+	return route;
+}
+
+static const whisper_profile_t *whisper_profile_find(whisper_settings_t *settings, const char *name)
+{
+	return zstr(name) ? NULL : switch_core_hash_find(settings->profiles, name);
+}
+
+/* The current snapshot with a reference taken, it stays valid until released even across reloads */
+whisper_settings_t *whisper_settings_acquire(void)
+{
+	whisper_settings_t *settings;
+
+	switch_mutex_lock(whisper_globals.settings_mutex);
+	if ((settings = whisper_globals.settings)) {
+		__atomic_add_fetch(&settings->refs, 1, __ATOMIC_ACQ_REL);
+	}
+	switch_mutex_unlock(whisper_globals.settings_mutex);
+
+	return settings;
+}
+
+void whisper_settings_release(whisper_settings_t **settings)
+{
+	switch_memory_pool_t *pool;
+
+	if (!*settings) {
+		return;
+	}
+
+	if (!__atomic_sub_fetch(&(*settings)->refs, 1, __ATOMIC_ACQ_REL)) {
+		switch_core_hash_destroy(&(*settings)->profiles);
+		switch_core_hash_destroy(&(*settings)->routes);
+		pool = (*settings)->pool;
+		switch_core_destroy_memory_pool(&pool);
+	}
+
+	*settings = NULL;
+}
+
+/* Swaps in a new snapshot, sessions still holding the old one keep it until they close */
+static void whisper_settings_publish(whisper_settings_t *settings)
+{
+	whisper_settings_t *old;
+
+	switch_mutex_lock(whisper_globals.settings_mutex);
+	old = whisper_globals.settings;
+	settings->version = ++whisper_globals.settings_version;
+	whisper_globals.settings = settings;
+	switch_mutex_unlock(whisper_globals.settings_mutex);
+
+	whisper_settings_release(&old);
+}
+
+/* the watchdog below records timeouts against the routes further down */
+static void whisper_route_stats_timeout(whisper_route_stats_t *stats, switch_time_t waited, switch_time_t now);
+
+/* Watchdog, sessions are registered once connected and removed before their connection is closed */
+static void whisper_watch_add(whisper_watch_t *watch, whisper_watch_kind_t kind, void *context)
+{
+	switch_mutex_lock(whisper_globals.watch_mutex);
+	watch->kind = kind;
+	watch->context = context;
+	watch->opened = switch_micro_time_now();
+	watch->prev = NULL;
+	if ((watch->next = whisper_globals.watch_list)) {
+		watch->next->prev = watch;
+	}
+	whisper_globals.watch_list = watch;
+	if (kind == WATCH_ASR) {
+		whisper_globals.asr_sessions++;
+	} else {
+		whisper_globals.tts_sessions++;
+	}
+	switch_mutex_unlock(whisper_globals.watch_mutex);
+}
+
+static void whisper_watch_remove(whisper_watch_t *watch)
+{
+	if (!watch->context) {
+		return;
+	}
+
+	switch_mutex_lock(whisper_globals.watch_mutex);
+	if (watch->prev) {
+		watch->prev->next = watch->next;
+	} else {
+		whisper_globals.watch_list = watch->next;
+	}
+	if (watch->next) {
+		watch->next->prev = watch->prev;
+	}
+	if (watch->kind == WATCH_ASR) {
+		whisper_globals.asr_sessions--;
+	} else {
+		whisper_globals.tts_sessions--;
+	}
+	watch->context = NULL;
+	switch_mutex_unlock(whisper_globals.watch_mutex);
+}
+
+/*
+ * Ends a result wait nobody will answer, from the watchdog or the media thread polling for results.
+ * The CAS loses to a reply that just arrived. A timed out connection is shut down at once; the next
+ * utterance's first frame asks for a new one, which a reconnect thread opens.
+ */
+static switch_bool_t whisper_result_expire(whisper_t *context, switch_time_t now)
+{
+	switch_time_t pending = whisper_atomic_get(context->pending_time);
+	uint32_t reason, rx, tx;
+
+	if (!whisper_flag_test(context, ASRFLAG_RESULT_PENDING)) {
+		return SWITCH_FALSE;
+	}
+
+	if (whisper_atomic_get(context->started) != WS_STATE_STARTED) {
+		reason = ASRFLAG_CONNECTION_LOST;
+	} else if (pending && now - pending >= (switch_time_t) context->result_timeout_ms * 1000) {
+		reason = ASRFLAG_RESULT_TIMEOUT;
+	} else {
+		return SWITCH_FALSE;
+	}
+
+	if (!whisper_flag_transition(context, ASRFLAG_RESULT_PENDING, ASRFLAG_RESULT_PENDING, ASRFLAG_RESULT_READY | reason)) {
+		return SWITCH_FALSE;
+	}
+
+	/* a late reply must not answer the next utterance */
+	tx = whisper_atomic_get(context->reply_tx);
+	for (rx = whisper_atomic_get(context->reply_rx); rx != tx; rx++) {
+		int slot = rx % ASR_REPLY_RING_SIZE, kind = ASR_REPLY_FINAL;
+
+		if (!__atomic_compare_exchange_n(&context->reply_kind[slot], &kind, ASR_REPLY_DROP, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+			kind == ASR_REPLY_PROMOTED) {
+			__atomic_compare_exchange_n(&context->reply_kind[slot], &kind, ASR_REPLY_DROP, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+		}
+	}
+
+	if (reason == ASRFLAG_RESULT_TIMEOUT) {
+		__atomic_add_fetch(&whisper_globals.result_timeouts, 1, __ATOMIC_RELAXED);
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_WARNING, "No ASR result from %s after %" SWITCH_TIME_T_FMT "ms\n",
+						  context->asr_url, (now - pending) / 1000);
+
+		if (context->route_stats) {
+			whisper_route_stats_timeout(context->route_stats, now - pending, now);
+		}
+
+		whisper_atomic_set(context->started, WS_STATE_DESTROY);
+		if (context->local) {
+			whisper_local_wake(context->local);
+		} else if (context->lws_context) {
+			lws_cancel_service(context->lws_context);
+		}
+	} else {
+		__atomic_add_fetch(&whisper_globals.connections_lost, 1, __ATOMIC_RELAXED);
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_WARNING, "ASR connection to %s lost while waiting for a result\n",
+						  context->asr_url);
+	}
+
+	return SWITCH_TRUE;
+}
+
+/* A prompt that stopped streaming: readers see the prompt end, close joins the service thread as usual */
+static void whisper_watchdog_tts(whisper_tts_t *context, switch_time_t now)
+{
+	switch_time_t rx_time = whisper_atomic_get(context->rx_time);
+	uint32_t request_id = whisper_atomic_get(context->request_id);
+
+	if (whisper_atomic_get(context->started) != WS_STATE_STARTED || whisper_atomic_get(context->rx_request_id) > request_id ||
+		!rx_time || now - rx_time < (switch_time_t) WATCHDOG_TTS_STALL_MS * 1000) {
+		return;
+	}
+
+	whisper_atomic_set(context->started, WS_STATE_DESTROY);
+	whisper_tts_wake(context);
+
+	__atomic_add_fetch(&whisper_globals.tts_stalls, 1, __ATOMIC_RELAXED);
+	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_WARNING, "TTS request %u stalled for %" SWITCH_TIME_T_FMT "ms, dropping the connection\n",
+					  request_id, (now - rx_time) / 1000);
+}
+
+static void whisper_watchdog_scan(void)
+{
+	switch_time_t now = switch_micro_time_now();
+	whisper_watch_t *watch;
+
+	switch_mutex_lock(whisper_globals.watch_mutex);
+	for (watch = whisper_globals.watch_list; watch; watch = watch->next) {
+		if (watch->kind == WATCH_ASR) {
+			whisper_result_expire((whisper_t *) watch->context, now);
+		} else {
+			whisper_watchdog_tts((whisper_tts_t *) watch->context, now);
+		}
+	}
+	switch_mutex_unlock(whisper_globals.watch_mutex);
+}
+
+/* Service thread load per pinned core, only cores that ever had a thread */
+static ks_json_t *whisper_cpu_report(void)
+{
+	ks_json_t *list = ks_json_create_array();
+	int cpu;
+
+	for (cpu = 0; cpu < WS_CPU_MAX; cpu++) {
+		whisper_cpu_stats_t *stats = &whisper_globals.ws_cpu[cpu];
+		ks_json_t *item;
+
+		if (!whisper_atomic_get(stats->opened)) {
+			continue;
+		}
+
+		item = ks_json_create_object();
+		ks_json_add_number_to_object(item, "cpu", cpu);
+		ks_json_add_number_to_object(item, "node", whisper_globals.cpu_node[cpu]);
+		ks_json_add_number_to_object(item, "threads", whisper_atomic_get(stats->threads));
+		ks_json_add_number_to_object(item, "opened", (double) whisper_atomic_get(stats->opened));
+		ks_json_add_number_to_object(item, "local", (double) whisper_atomic_get(stats->local));
+		ks_json_add_number_to_object(item, "same_node", (double) whisper_atomic_get(stats->same_node));
+		ks_json_add_number_to_object(item, "rx_msgs", (double) whisper_atomic_get(stats->rx_msgs));
+		ks_json_add_number_to_object(item, "cpu_ms", (double) (whisper_atomic_get(stats->cpu_us) / 1000));
+		ks_json_add_item_to_array(list, item);
+	}
+
+	return list;
+}
+
+static void whisper_status_report(switch_stream_handle_t *stream)
+{
+	ks_json_t *report = ks_json_create_object();
+	switch_time_t now = switch_micro_time_now(), oldest = 0;
+	uint32_t pending = 0, dead = 0;
+	uint64_t batches, batched;
+	whisper_watch_t *watch;
+	char *str;
+
+	switch_mutex_lock(whisper_globals.watch_mutex);
+	for (watch = whisper_globals.watch_list; watch; watch = watch->next) {
+		if (watch->kind == WATCH_ASR) {
+			whisper_t *context = (whisper_t *) watch->context;
+
+			if (whisper_flag_test(context, ASRFLAG_RESULT_PENDING)) {
+				switch_time_t since = whisper_atomic_get(context->pending_time);
+
+				pending++;
+				if (since && now - since > oldest) {
+					oldest = now - since;
+				}
+			}
+			if (whisper_atomic_get(context->started) != WS_STATE_STARTED) {
+				dead++;
+			}
+		} else if (whisper_atomic_get(((whisper_tts_t *) watch->context)->started) != WS_STATE_STARTED) {
+			dead++;
+		}
+	}
+	ks_json_add_number_to_object(report, "asr_sessions", whisper_globals.asr_sessions);
+	ks_json_add_number_to_object(report, "tts_sessions", whisper_globals.tts_sessions);
+	switch_mutex_unlock(whisper_globals.watch_mutex);
+
+	ks_json_add_number_to_object(report, "results_pending", pending);
+	ks_json_add_number_to_object(report, "oldest_pending_ms", (double) (oldest / 1000));
+	ks_json_add_number_to_object(report, "dead_connections", dead);
+	ks_json_add_number_to_object(report, "result_timeouts", (double) whisper_atomic_get(whisper_globals.result_timeouts));
+	ks_json_add_number_to_object(report, "connections_lost", (double) whisper_atomic_get(whisper_globals.connections_lost));
+	ks_json_add_number_to_object(report, "handshake_timeouts", (double) whisper_atomic_get(whisper_globals.handshake_timeouts));
+	ks_json_add_number_to_object(report, "tts_stalls", (double) whisper_atomic_get(whisper_globals.tts_stalls));
+	ks_json_add_number_to_object(report, "tls_connections", (double) whisper_atomic_get(whisper_globals.tls_connections));
+	ks_json_add_number_to_object(report, "tls_resumed", (double) whisper_atomic_get(whisper_globals.tls_resumed));
+	ks_json_add_number_to_object(report, "paced_blocks", (double) whisper_atomic_get(whisper_globals.paced_blocks));
+	ks_json_add_number_to_object(report, "paced_late_blocks", (double) whisper_atomic_get(whisper_globals.paced_late_blocks));
+	ks_json_add_number_to_object(report, "paced_lag_max_ms", (double) whisper_atomic_get(whisper_globals.paced_lag_max_ms));
+	batches = whisper_atomic_get(whisper_globals.asr_batches);
+	batched = whisper_atomic_get(whisper_globals.asr_batched_eofs);
+	ks_json_add_number_to_object(report, "asr_batches", (double) batches);
+	ks_json_add_number_to_object(report, "asr_batch_size_avg", batches ? (double) batched / batches : 0);
+	ks_json_add_number_to_object(report, "asr_batch_wait_ms_avg", batched ? (double) whisper_atomic_get(whisper_globals.asr_batch_wait_us) / batched / 1000 : 0);
+	ks_json_add_number_to_object(report, "asr_batch_wait_ms_max", (double) whisper_atomic_get(whisper_globals.asr_batch_wait_max_us) / 1000);
+	ks_json_add_number_to_object(report, "tts_prefetch_hits", (double) whisper_atomic_get(whisper_globals.tts_prefetch_hits));
+	ks_json_add_number_to_object(report, "tts_prefetch_misses", (double) whisper_atomic_get(whisper_globals.tts_prefetch_misses));
+	ks_json_add_number_to_object(report, "tts_staged_bytes", (double) whisper_atomic_get(whisper_globals.tts_staged_bytes));
+	ks_json_add_number_to_object(report, "prefetch_threads", whisper_atomic_get(whisper_globals.prefetch_threads));
+	ks_json_add_number_to_object(report, "local_connections", (double) whisper_atomic_get(whisper_globals.local_connections));
+	ks_json_add_number_to_object(report, "local_ring_full", (double) whisper_atomic_get(whisper_globals.local_ring_full));
+	ks_json_add_item_to_object(report, "ws_cpus", whisper_cpu_report());
+
+	if ((str = ks_json_print_unformatted(report))) {
+		stream->write_function(stream, "%s\n", str);
+		free(str);
+	}
+	ks_json_delete(&report);
+}
+
+/* ASR interface */ 
+
+/* Caller holds endpoint_mutex. Endpoints live as long as the module, there are only a few configured URLs */
+static whisper_endpoint_t *whisper_endpoint_get(const char *kind, const char *url, uint32_t max_sessions)
+{
+	whisper_endpoint_t *endpoint;
+	char key[1024];
+
+	switch_snprintf(key, sizeof(key), "%s %s", kind, url);
+
+	if (!(endpoint = switch_core_hash_find(whisper_globals.endpoints, key))) {
+		endpoint = switch_core_alloc(whisper_globals.pool, sizeof(*endpoint));
+		endpoint->kind = kind;
+		endpoint->url = switch_core_strdup(whisper_globals.pool, url);
+		switch_core_hash_insert(whisper_globals.endpoints, key, endpoint);
+	}
+
+	/* picks up limits changed by a reload */
+	endpoint->max_sessions = max_sessions;
+
+	return endpoint;
+}
+
+static void whisper_fire_overload(whisper_endpoint_t *endpoint, switch_core_session_t *session, const char *reason)
+{
+	switch_event_t *event = NULL;
+	char subclass[64];
+
+	switch_snprintf(subclass, sizeof(subclass), "whisper::%s_overload", endpoint->kind);
+
+	if (switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, subclass) != SWITCH_STATUS_SUCCESS) {
+		return;
+	}
+
+	if (session) {
+		switch_channel_event_set_data(switch_core_session_get_channel(session), event);
+	}
+
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "WHISPER-endpoint", endpoint->url);
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "WHISPER-reason", reason);
+	switch_event_add_header(event, SWITCH_STACK_BOTTOM, "WHISPER-max-sessions", "%u", endpoint->max_sessions);
+	switch_event_fire(&event);
+}
+
+/* Takes a session slot on the endpoint, waiting up to admit-timeout-ms in priority order. NULL means overloaded */
+static whisper_endpoint_t *whisper_admit(const char *kind, const char *url, uint32_t max_sessions, whisper_settings_t *settings,
+										 switch_memory_pool_t *pool)
+{
+	switch_core_session_t *session = switch_core_memory_pool_get_data(pool, "__session");
+	whisper_admit_waiter_t waiter = { 0 }, **wp;
+	whisper_endpoint_t *endpoint;
+	const char *reason = NULL;
+	switch_time_t deadline, now;
+
+	switch_mutex_lock(whisper_globals.endpoint_mutex);
+	endpoint = whisper_endpoint_get(kind, url, max_sessions);
+
+	if (!endpoint->max_sessions || endpoint->active < endpoint->max_sessions) {
+		endpoint->active++;
+		goto done;
+	}
+
+	if (endpoint->waiting >= settings->admit_queue_size || !settings->admit_timeout_ms ||
+		switch_thread_cond_create(&waiter.cond, pool) != SWITCH_STATUS_SUCCESS) {
+		reason = "queue-full";
+		goto done;
+	}
+
+	if (session) {
+		const char *var = switch_channel_get_variable(switch_core_session_get_channel(session), "whisper_priority");
+
+		if (!zstr(var)) {
+			waiter.priority = atoi(var);
+		}
+	}
+
+	/* higher priority first, FIFO within the same priority */
+	for (wp = &endpoint->queue; *wp && (*wp)->priority >= waiter.priority; wp = &(*wp)->next);
+	waiter.next = *wp;
+	*wp = &waiter;
+	endpoint->waiting++;
+
+	deadline = switch_micro_time_now() + (switch_time_t) settings->admit_timeout_ms * 1000;
+	while (!waiter.granted && (now = switch_micro_time_now()) < deadline) {
+		switch_thread_cond_timedwait(waiter.cond, whisper_globals.endpoint_mutex, deadline - now);
+	}
+
+	if (!waiter.granted) {
+		for (wp = &endpoint->queue; *wp && *wp != &waiter; wp = &(*wp)->next);
+		if (*wp) {
+			*wp = waiter.next;
+		}
+		endpoint->waiting--;
+		reason = "timeout";
+	}
+
+  done:
+	if (reason) {
+		endpoint->rejected++;
+	}
+	switch_mutex_unlock(whisper_globals.endpoint_mutex);
+
+	if (reason) {
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "%s endpoint %s overloaded (%s, %u sessions)\n",
+						  kind, url, reason, max_sessions);
+		whisper_fire_overload(endpoint, session, reason);
+		return NULL;
+	}
+
+	return endpoint;
+}
+
+/* Hands the slot straight to the first waiter so nobody can jump the queue */
+static void whisper_admit_release(whisper_endpoint_t **endpointp)
+{
+	whisper_endpoint_t *endpoint = *endpointp;
+	whisper_admit_waiter_t *waiter;
+
+	if (!endpoint) {
+		return;
+	}
+
+	switch_mutex_lock(whisper_globals.endpoint_mutex);
+	if ((waiter = endpoint->queue) && (!endpoint->max_sessions || endpoint->active <= endpoint->max_sessions)) {
+		endpoint->queue = waiter->next;
+		endpoint->waiting--;
+		waiter->granted = 1;
+		switch_thread_cond_signal(waiter->cond);
+	} else {
+		endpoint->active--;
+	}
+	switch_mutex_unlock(whisper_globals.endpoint_mutex);
+
+	*endpointp = NULL;
+}
+
+/* Stats are keyed by route name and outlive reloads, the URL shown is the latest one */
+static whisper_route_stats_t *whisper_route_stats_get(const whisper_route_t *route, whisper_settings_t *settings)
+{
+	const char *name = route ? route->name : ROUTE_DEFAULT_NAME;
+	const char *url = route ? route->url : settings->asr_server_url;
+	whisper_route_stats_t *stats;
+
+	switch_mutex_lock(whisper_globals.endpoint_mutex);
+	if (!(stats = switch_core_hash_find(whisper_globals.route_stats, name))) {
+		stats = switch_core_alloc(whisper_globals.pool, sizeof(*stats));
+		stats->name = switch_core_strdup(whisper_globals.pool, name);
+		switch_core_hash_insert(whisper_globals.route_stats, stats->name, stats);
+	}
+	if (!stats->url || strcmp(stats->url, url)) {
+		stats->url = switch_core_strdup(whisper_globals.pool, url);
+	}
+	__atomic_add_fetch(&stats->sessions, 1, __ATOMIC_RELAXED);
+	switch_mutex_unlock(whisper_globals.endpoint_mutex);
+
+	return stats;
+}
+
+static void whisper_route_stats_put(whisper_route_stats_t **stats)
+{
+	if (*stats) {
+		__atomic_sub_fetch(&(*stats)->sessions, 1, __ATOMIC_RELAXED);
+		*stats = NULL;
+	}
+}
+
+/* Called from the websocket thread on every final result */
+void whisper_route_stats_record(whisper_route_stats_t *stats, switch_time_t latency)
+{
+	uint32_t ms = (uint32_t) (latency / 1000), max = __atomic_load_n(&stats->latency_max_ms, __ATOMIC_RELAXED);
+	int bucket = 0;
+
+	while (bucket < ROUTE_LATENCY_BUCKETS - 1 && ms >= (50U << bucket)) {
+		bucket++;
+	}
+
+	__atomic_add_fetch(&stats->results, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->latency_total_ms, ms, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->latency_hist[bucket], 1, __ATOMIC_RELAXED);
+
+	while (ms > max && !__atomic_compare_exchange_n(&stats->latency_max_ms, &max, ms, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* A result that never came counts at the time waited and takes the route out of rotation for a while */
+static void whisper_route_stats_timeout(whisper_route_stats_t *stats, switch_time_t waited, switch_time_t now)
+{
+	whisper_route_stats_record(stats, waited);
+	__atomic_add_fetch(&stats->timeouts, 1, __ATOMIC_RELAXED);
+	whisper_atomic_set(stats->degraded_until, now + (switch_time_t) ROUTE_DEGRADED_MS * 1000);
+}
+
+static switch_bool_t whisper_route_degraded(const char *name)
+{
+	whisper_route_stats_t *stats;
+	switch_bool_t degraded = SWITCH_FALSE;
+
+	switch_mutex_lock(whisper_globals.endpoint_mutex);
+	if ((stats = switch_core_hash_find(whisper_globals.route_stats, name))) {
+		degraded = whisper_atomic_get(stats->degraded_until) > switch_micro_time_now();
+	}
+	switch_mutex_unlock(whisper_globals.endpoint_mutex);
+
+	return degraded;
+}
+
+/* whisper_route_find, skipping to the fallback route while the chosen one is degraded */
+static const whisper_route_t *whisper_route_pick(whisper_settings_t *settings, const char *model, const char *language)
+{
+	const whisper_route_t *route = whisper_route_find(settings, model, language), *fallback;
+
+	if (route && route->fallback && whisper_route_degraded(route->name) && (fallback = switch_core_hash_find(settings->routes, route->fallback))) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Route %s is degraded, using %s\n", route->name, fallback->name);
+		route = fallback;
+	}
+
+	return route;
+}
+
+/* Upper bound of the bucket holding the given fraction of results, the max seen for the open-ended last bucket */
+static uint32_t whisper_route_stats_quantile(whisper_route_stats_t *stats, uint64_t results, double q)
+{
+	uint64_t seen = 0, want = (uint64_t) (results * q);
+	uint32_t max = __atomic_load_n(&stats->latency_max_ms, __ATOMIC_RELAXED);
+	int i;
+
+	for (i = 0; i < ROUTE_LATENCY_BUCKETS - 1; i++) {
+		if ((seen += __atomic_load_n(&stats->latency_hist[i], __ATOMIC_RELAXED)) > want) {
+			return 50U << i;
+		}
+	}
+
+	/* the max and the counts are updated apart, never report below the bucket */
+	return max > (50U << (ROUTE_LATENCY_BUCKETS - 2)) ? max : 50U << (ROUTE_LATENCY_BUCKETS - 2);
+}
+
+static void whisper_routes_report(switch_stream_handle_t *stream)
+{
+	ks_json_t *report = ks_json_create_array();
+	switch_hash_index_t *hi;
+	char *str;
+	void *val;
+
+	switch_mutex_lock(whisper_globals.endpoint_mutex);
+	for (hi = switch_core_hash_first(whisper_globals.route_stats); hi; hi = switch_core_hash_next(&hi)) {
+		whisper_route_stats_t *stats;
+		ks_json_t *item = ks_json_create_object(), *hist = ks_json_create_array();
+		uint64_t results;
+		int i;
+
+		switch_core_hash_this(hi, NULL, NULL, &val);
+		stats = (whisper_route_stats_t *) val;
+		results = __atomic_load_n(&stats->results, __ATOMIC_RELAXED);
+
+		ks_json_add_string_to_object(item, "route", stats->name);
+		ks_json_add_string_to_object(item, "url", stats->url);
+		ks_json_add_number_to_object(item, "sessions", __atomic_load_n(&stats->sessions, __ATOMIC_RELAXED));
+		ks_json_add_number_to_object(item, "results", (double) results);
+		ks_json_add_number_to_object(item, "latency_avg_ms", results ? (double) stats->latency_total_ms / results : 0);
+		ks_json_add_number_to_object(item, "latency_max_ms", stats->latency_max_ms);
+		ks_json_add_number_to_object(item, "latency_p50_ms", whisper_route_stats_quantile(stats, results, 0.50));
+		ks_json_add_number_to_object(item, "latency_p95_ms", whisper_route_stats_quantile(stats, results, 0.95));
+		ks_json_add_number_to_object(item, "timeouts", (double) stats->timeouts);
+		if (whisper_atomic_get(stats->degraded_until) > switch_micro_time_now()) {
+			ks_json_add_true_to_object(item, "degraded");
+		} else {
+			ks_json_add_false_to_object(item, "degraded");
+		}
+		for (i = 0; i < ROUTE_LATENCY_BUCKETS; i++) {
+			ks_json_add_item_to_array(hist, ks_json_create_number((double) stats->latency_hist[i]));
+		}
+		ks_json_add_item_to_object(item, "latency_hist", hist);
+
+		ks_json_add_item_to_array(report, item);
+	}
+	switch_mutex_unlock(whisper_globals.endpoint_mutex);
+
+	if ((str = ks_json_print_unformatted(report))) {
+		stream->write_function(stream, "%s\n", str);
+		free(str);
+	}
+	ks_json_delete(&report);
+}
+
+/* energy score on the same scale as switch_vad's thresh */
+static uint32_t whisper_vad_score(whisper_t *context, const int16_t *data, uint32_t samples)
+{
+	uint32_t energy = 0, i;
+
+	for (i = 0; i < samples; i++) {
+		energy += abs(data[i]);
+	}
+
+	return samples ? (uint32_t) ((uint64_t) energy * (context->rate / 8000 ? context->rate / 8000 : 1) / samples) : 0;
+}
+
+static void whisper_vad_set_silence(whisper_t *context, uint32_t silence_ms)
+{
+	if (context->cur_silence_ms != silence_ms) {
+		context->cur_silence_ms = silence_ms;
+		switch_vad_set_param(context->vad, "silence_ms", silence_ms);
+	}
+}
+
+/*
+ * Track the noise floor as the minimum frame energy over short windows; speech always has
+ * dips between syllables, stationary noise does not. The threshold follows the floor and the
+ * silence tail is shortened once the caller has spoken clearly above it for a while.
+ */
+static void whisper_vad_adapt(whisper_t *context, uint32_t score, uint32_t frame_ms, switch_vad_state_t vad_state)
+{
+	uint32_t thresh;
+
+	if (!context->vad_adaptive || !frame_ms) {
+		return;
+	}
+
+	if (score < context->window_min || !context->window_ms) {
+		context->window_min = score;
+	}
+
+	if ((context->window_ms += frame_ms) >= VAD_ADAPTIVE_WINDOW_MS) {
+		if (!context->noise_floor || context->window_min < context->noise_floor) {
+			context->noise_floor = context->window_min;
+		} else {
+			context->noise_floor += (context->window_min - context->noise_floor) / 2;
+		}
+		context->window_ms = 0;
+
+		thresh = context->noise_floor * VAD_ADAPTIVE_RATIO_Q4 / 16;
+		if (thresh < context->thresh) {
+			thresh = context->thresh;
+		} else if (thresh > VAD_ADAPTIVE_MAX_THRESH) {
+			thresh = VAD_ADAPTIVE_MAX_THRESH;
+		}
+
+		/* ignore small moves, each change re-arms the vad */
+		if (thresh > context->cur_thresh + context->cur_thresh / 8 || thresh < context->cur_thresh - context->cur_thresh / 8) {
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "vad noise floor %u thresh %u\n", context->noise_floor, thresh);
+			context->cur_thresh = thresh;
+			switch_vad_set_param(context->vad, "thresh", thresh);
+		}
+	}
+
+	if (vad_state == SWITCH_VAD_STATE_START_TALKING) {
+		context->speech_ms = 0;
+		context->speech_level = score;
+		whisper_vad_set_silence(context, context->silence_ms);
+	} else if (vad_state == SWITCH_VAD_STATE_TALKING) {
+		context->speech_ms += frame_ms;
+		if (score > context->cur_thresh) {
+			context->speech_level += ((int32_t) score - (int32_t) context->speech_level) / 8;
+		}
+
+		if (context->speech_ms >= VAD_ADAPTIVE_CONFIDENT_MS && context->speech_level >= context->cur_thresh * 3) {
+			uint32_t silence_ms = context->silence_ms / 2;
+
+			whisper_vad_set_silence(context, silence_ms > VAD_ADAPTIVE_MIN_SILENCE_MS ? silence_ms : VAD_ADAPTIVE_MIN_SILENCE_MS);
+		}
+	}
+}
+
+static void whisper_spec_count(switch_bool_t hit)
+{
+	switch_mutex_lock(whisper_globals.stats_mutex);
+	if (hit) {
+		whisper_globals.asr_spec_hits++;
+	} else {
+		whisper_globals.asr_spec_misses++;
+	}
+	switch_mutex_unlock(whisper_globals.stats_mutex);
+}
+
+/* the reconnect state is kept with the connection code further down */
+static switch_bool_t whisper_reconnect_pending(whisper_t *context);
+
+/* Sends what is buffered and asks for a transcript once the caller has paused long enough */
+static switch_status_t whisper_spec_track(whisper_t *context, uint32_t score, uint32_t frame_ms)
+{
+	uint8_t *buf = context->send_buf + LWS_PRE;
+	int rlen;
+
+	/* the connection is gone or being replaced, the block send path reports it */
+	if (whisper_atomic_get(context->started) != WS_STATE_STARTED || whisper_reconnect_pending(context)) {
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	if (score >= context->cur_thresh) {
+		context->pause_ms = 0;
+
+		if (context->spec_active) {
+			int kind = ASR_REPLY_SPEC;
+
+			/* speech resumed: drop the reply in flight, or the cached one if it already came back */
+			if (!__atomic_compare_exchange_n(&context->reply_kind[context->spec_slot], &kind, ASR_REPLY_DISCARD, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				whisper_atomic_set(context->spec_ready, 0);
+				context->spec_text = NULL;
+			}
+			context->spec_active = SWITCH_FALSE;
+			whisper_spec_count(SWITCH_FALSE);
+			whisper_tap_event(context->tap, "speech_resumed", NULL);
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Speech resumed, speculative result discarded\n");
+		}
+
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	if (context->spec_active || (context->pause_ms += frame_ms) < context->speculative_pause_ms) {
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	if (whisper_atomic_get(context->reply_tx) - whisper_atomic_get(context->reply_rx) >= ASR_REPLY_RING_SIZE - 1) {
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	while ((rlen = switch_buffer_read(context->audio_buffer, buf, AUDIO_BLOCK_SIZE)) > 0) {
+		if (whisper_send_audio(context, buf, rlen) != SWITCH_STATUS_SUCCESS) {
+			return SWITCH_STATUS_BREAK;
+		}
+	}
+
+	context->spec_active = SWITCH_TRUE;
+	whisper_atomic_set(context->spec_ready, 0);
+	whisper_tap_event(context->tap, "finalize", NULL);
+
+	return whisper_get_speculative_transcription(context);
+}
+
+/* At end of speech: promote the speculative request, returns the kind the eof reply should get */
+static whisper_reply_kind_t whisper_spec_finish(whisper_t *context)
+{
+	int kind = ASR_REPLY_SPEC;
+
+	if (!context->spec_active) {
+		return ASR_REPLY_FINAL;
+	}
+
+	context->spec_active = SWITCH_FALSE;
+	whisper_spec_count(SWITCH_TRUE);
+
+	if (__atomic_compare_exchange_n(&context->reply_kind[context->spec_slot], &kind, ASR_REPLY_PROMOTED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		return ASR_REPLY_DROP;
+	}
+
+	if (whisper_atomic_get(context->spec_ready)) {
+		context->result_text = context->spec_text;
+		whisper_atomic_set(context->spec_ready, 0);
+		whisper_flag_transition(context, ASRFLAG_RESULT_PENDING, ASRFLAG_RESULT_PENDING, ASRFLAG_RESULT_READY);
+		return ASR_REPLY_DROP;
+	}
+
+	return ASR_REPLY_FINAL;
+}
+
+/* Values were parsed at load, this only copies a few integers and re-arms the vad */
+static void whisper_apply_profile(whisper_t *context, const whisper_profile_t *profile)
+{
+	context->profile = profile;
+	context->thresh = context->cur_thresh = profile->vad_thresh;
+	context->silence_ms = context->cur_silence_ms = profile->vad_silence_ms;
+	context->voice_ms = profile->vad_voice_ms;
+	context->no_input_timeout = profile->no_input_timeout;
+	context->speech_timeout = profile->speech_timeout;
+	context->vad_adaptive = profile->vad_adaptive;
+	context->speculative_pause_ms = profile->speculative_pause_ms;
+	context->result_timeout_ms = profile->result_timeout_ms;
+
+	if (context->vad) {
+		switch_vad_set_param(context->vad, "thresh", context->thresh);
+		switch_vad_set_param(context->vad, "silence_ms", context->silence_ms);
+		switch_vad_set_param(context->vad, "voice_ms", context->voice_ms);
+	}
+}
+
+/* whisper_record on the channel wins, otherwise record-percent of the calls are sampled */
+static switch_bool_t whisper_tap_wanted(whisper_settings_t *settings, switch_core_session_t *session)
+{
+	const char *var;
+
+	if (session && (var = switch_channel_get_variable(switch_core_session_get_channel(session), "whisper_record"))) {
+		return switch_true(var);
+	}
+
+	return settings->record_percent && (uint32_t) (rand() % 100) < settings->record_percent;
+}
+
+static void whisper_reset_vad(whisper_t *context)
+{
+	if (context->vad) {
+		switch_vad_reset(context->vad);
+		if (context->vad_adaptive) {
+			whisper_vad_set_silence(context, context->silence_ms);
+		}
+	}
+	context->pause_ms = 0;
+	context->spec_active = SWITCH_FALSE;
+	whisper_atomic_set(context->spec_ready, 0);
+	context->result_text = "";
+	context->result_confidence = 87.3;
+	context->no_input_time = switch_micro_time_now();
+	whisper_atomic_set(context->flags, ASRFLAG_READY | (context->start_input_timers ? ASRFLAG_INPUT_TIMERS : 0));
+}
+
+static void whisper_release(whisper_t *context)
+{
+	whisper_watch_remove(&context->watch);
+
+	/* joins the service thread, nothing touches the arena or the reply buffers afterwards */
+	ws_asr_close_connection(context);
+	whisper_reply_buffers_free(context);
+	whisper_tap_close(&context->tap);
+
+	if (context->vad) {
+		switch_vad_destroy(&context->vad);
+	}
+
+	if (context->audio_buffer) {
+		switch_buffer_destroy(&context->audio_buffer);
+	}
+
+	whisper_admit_release(&context->endpoint);
+	whisper_route_stats_put(&context->route_stats);
+	whisper_settings_release(&context->settings);
+	whisper_arena_destroy(&context->arena);
+}
+
+/* {"language": "zh"} tells a multilingual server what to expect, "auto" asks it to identify the language */
+static void whisper_send_language(whisper_t *context, const whisper_route_t *route)
+{
+	const char *language = route && route->language ? route->language : context->language;
+	ks_json_t *req;
+	char *str;
+
+	if (zstr(language)) {
+		return;
+	}
+
+	req = ks_json_create_object();
+	ks_json_add_string_to_object(req, "language", language);
+
+	if ((str = ks_json_print_unformatted(req))) {
+		if (whisper_send_text_request(context, str) != SWITCH_STATUS_SUCCESS) {
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_ERROR, "Unable to send language to websocket server\n");
+		}
+		free(str);
+	}
+
+	ks_json_delete(&req);
+}
+
+/* (Re)opens context->asr_url and replays what the server was told on the old connection */
+static switch_status_t whisper_asr_connect(whisper_t *context)
+{
+	char *req_string;
+
+	whisper_atomic_set(context->wc_connected, FALSE);
+	whisper_atomic_set(context->wc_error, FALSE);
+	whisper_atomic_set(context->final_time, 0);
+
+	/* lws_parse_uri writes into the string */
+	if (ws_asr_setup_connection(switch_core_strdup(context->pool, context->asr_url), context, context->pool) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_ERROR, "Unable to connect to %s\n", context->asr_url);
+		whisper_fire_event(context, "whisper::asr_connection_error");
+		return SWITCH_STATUS_FALSE;
+	}
+
+	whisper_send_language(context, context->route);
+
+	if (context->grammar && (req_string = whisper_grammar_cache_get(context->grammar, context->pool))) {
+		whisper_send_text_request(context, req_string);
+	}
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* Media thread, on a new connection: replies the old one owed never come */
+static void whisper_asr_reset_replies(whisper_t *context)
+{
+	whisper_atomic_set(context->reply_rx, whisper_atomic_get(context->reply_tx));
+	context->spec_active = SWITCH_FALSE;
+	context->spec_text = NULL;
+	whisper_atomic_set(context->spec_ready, 0);
+}
+
+/* Media thread only, the watchdog must not see the connection while it is replaced */
+static void whisper_asr_drop(whisper_t *context)
+{
+	/* a reconnect in progress replaces it anyway */
+	if (context->loopback || (!context->lws_context && !context->mux && !context->local) ||
+		whisper_atomic_get(context->reconnect) != ASR_RECONNECT_IDLE) {
+		return;
+	}
+
+	whisper_watch_remove(&context->watch);
+	ws_asr_close_connection(context);
+	whisper_watch_add(&context->watch, WATCH_ASR, context);
+}
+
+/* Reconnect thread, holding the claim: replaces a dropped connection while the media thread keeps off it */
+static void whisper_asr_reconnect(whisper_t *context)
+{
+	switch_status_t status;
+
+	whisper_watch_remove(&context->watch);
+	ws_asr_close_connection(context);
+
+	/* the new service thread goes where the media thread asked from */
+	ws_thread_cpu_hint(whisper_atomic_get(context->media_cpu));
+	if ((status = whisper_asr_connect(context)) == SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_INFO, "Reconnected to %s\n", context->asr_url);
+	}
+	ws_thread_cpu_hint(-1);
+	whisper_watch_add(&context->watch, WATCH_ASR, context);
+
+	/* at most once per ASR_RECONNECT_INTERVAL_MS */
+	context->reconnect_time = switch_micro_time_now() + (switch_time_t) ASR_RECONNECT_INTERVAL_MS * 1000;
+	whisper_atomic_set(context->reconnect, status == SWITCH_STATUS_SUCCESS ? ASR_RECONNECT_DONE : ASR_RECONNECT_FAILED);
+}
+
+/* Reconnect thread: claims one session that asked for a new connection and is due */
+static whisper_t *whisper_reconnect_claim(void)
+{
+	switch_time_t now = switch_micro_time_now();
+	whisper_watch_t *watch;
+	whisper_t *context = NULL;
+
+	if (!whisper_atomic_get(whisper_globals.reconnects_wanted)) {
+		return NULL;
+	}
+
+	switch_mutex_lock(whisper_globals.watch_mutex);
+	for (watch = whisper_globals.watch_list; watch; watch = watch->next) {
+		whisper_t *candidate = (whisper_t *) watch->context;
+		int wanted = ASR_RECONNECT_WANTED;
+
+		if (watch->kind == WATCH_ASR && now >= candidate->reconnect_time &&
+			__atomic_compare_exchange_n(&candidate->reconnect, &wanted, ASR_RECONNECT_RUNNING, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			__atomic_sub_fetch(&whisper_globals.reconnects_wanted, 1, __ATOMIC_ACQ_REL);
+			context = candidate;
+			break;
+		}
+	}
+	switch_mutex_unlock(whisper_globals.watch_mutex);
+
+	return context;
+}
+
+/* A handshake blocks for up to WS_HANDSHAKE_TIMEOUT_MS, so it runs here and never on the watchdog's thread */
+static void *SWITCH_THREAD_FUNC whisper_reconnect_run(switch_thread_t *thread, void *obj)
+{
+	whisper_t *context;
+
+	while (whisper_atomic_get(whisper_globals.running)) {
+		/* close waits for the claim to end, so the context stays */
+		if ((context = whisper_reconnect_claim())) {
+			whisper_asr_reconnect(context);
+		} else {
+			switch_yield(ASR_RECONNECT_POLL_MS * 1000);
+		}
+	}
+
+	return NULL;
+}
+
+static void whisper_reconnect_start(switch_memory_pool_t *pool)
+{
+	switch_threadattr_t *thd_attr = NULL;
+	int i;
+
+	switch_threadattr_create(&thd_attr, pool);
+	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+
+	for (i = 0; i < ASR_RECONNECT_WORKERS; i++) {
+		if (switch_thread_create(&whisper_globals.reconnect_threads[i], thd_attr, whisper_reconnect_run, NULL, pool) != SWITCH_STATUS_SUCCESS) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Unable to start ASR reconnect thread %d\n", i);
+			whisper_globals.reconnect_threads[i] = NULL;
+		}
+	}
+}
+
+/* After running is cleared: a thread in a handshake returns when it times out */
+static void whisper_reconnect_stop(void)
+{
+	switch_status_t retval;
+	int i;
+
+	for (i = 0; i < ASR_RECONNECT_WORKERS; i++) {
+		if (whisper_globals.reconnect_threads[i]) {
+			switch_thread_join(&retval, whisper_globals.reconnect_threads[i]);
+			whisper_globals.reconnect_threads[i] = NULL;
+		}
+	}
+}
+
+/* Media thread: asks a reconnect thread for a new connection, never blocks */
+static void whisper_reconnect_request(whisper_t *context)
+{
+	int idle = ASR_RECONNECT_IDLE;
+
+	if (context->loopback) {
+		return;
+	}
+
+	if (whisper_atomic_get(context->reconnect) != ASR_RECONNECT_IDLE) {
+		return;
+	}
+
+	whisper_atomic_set(context->media_cpu, ws_thread_cpu_current());
+	if (__atomic_compare_exchange_n(&context->reconnect, &idle, ASR_RECONNECT_WANTED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		__atomic_add_fetch(&whisper_globals.reconnects_wanted, 1, __ATOMIC_ACQ_REL);
+	}
+}
+
+/* Media thread: true once for a reconnect that succeeded, the caller resets the reply ring */
+static switch_bool_t whisper_reconnect_done(whisper_t *context)
+{
+	int done = ASR_RECONNECT_DONE;
+
+	return __atomic_compare_exchange_n(&context->reconnect, &done, ASR_RECONNECT_IDLE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ? SWITCH_TRUE : SWITCH_FALSE;
+}
+
+/* Requested or in progress: the media thread holds its audio and leaves the connection alone */
+static switch_bool_t whisper_reconnect_pending(whisper_t *context)
+{
+	int state = whisper_atomic_get(context->reconnect);
+
+	return state == ASR_RECONNECT_WANTED || state == ASR_RECONNECT_RUNNING;
+}
+
+/* Before the media thread closes or replaces the connection itself: withdraws a request, waits out a reconnect in progress */
+static void whisper_reconnect_cancel(whisper_t *context)
+{
+	int state;
+
+	while ((state = whisper_atomic_get(context->reconnect)) != ASR_RECONNECT_IDLE) {
+		if (state == ASR_RECONNECT_RUNNING) {
+			switch_yield(10000);
+		} else if (__atomic_compare_exchange_n(&context->reconnect, &state, ASR_RECONNECT_IDLE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+				   state == ASR_RECONNECT_WANTED) {
+			__atomic_sub_fetch(&whisper_globals.reconnects_wanted, 1, __ATOMIC_ACQ_REL);
+		}
+	}
+}
+
+/* language/model set after open: move to the new route's server between utterances */
+static void whisper_set_route(whisper_t *context, const char *param, const char *val)
+{
+	whisper_settings_t *settings = context->settings;
+	const whisper_route_t *route;
+	whisper_endpoint_t *endpoint;
+	const char *url;
+
+	if (!strcasecmp(param, "model")) {
+		context->model = whisper_arena_strdup(context->arena, val);
+	} else {
+		context->language = whisper_arena_strdup(context->arena, val);
+	}
+
+	route = whisper_route_pick(settings, context->model, context->language);
+	url = route ? route->url : settings->asr_server_url;
+
+	if (context->loopback || !strcmp(url, context->asr_url)) {
+		whisper_send_language(context, route);
+		return;
+	}
+
+	if (whisper_flag_test(context, ASRFLAG_START_OF_SPEECH | ASRFLAG_RESULT_PENDING)) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_WARNING, "Not switching to %s in the middle of an utterance\n", url);
+		return;
+	}
+
+	/* take the new slot first, an overloaded route leaves the call where it was */
+	if (!(endpoint = whisper_admit("asr", url, route && route->max_sessions ? route->max_sessions : settings->asr_max_sessions, settings, context->pool))) {
+		return;
+	}
+
+	whisper_reconnect_cancel(context);
+	whisper_watch_remove(&context->watch);
+	ws_asr_close_connection(context);
+	whisper_admit_release(&context->endpoint);
+	whisper_route_stats_put(&context->route_stats);
+
+	context->endpoint = endpoint;
+	context->route = route;
+	context->route_stats = whisper_route_stats_get(route, settings);
+	context->asr_url = whisper_arena_strdup(context->arena, url);
+
+	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_INFO, "Routing ASR to %s (%s)\n", url, route ? route->name : ROUTE_DEFAULT_NAME);
+
+	whisper_asr_connect(context);
+	whisper_asr_reset_replies(context);
+	whisper_watch_add(&context->watch, WATCH_ASR, context);
+}
+
+static switch_status_t whisper_open(switch_asr_handle_t *ah, const char *codec, int rate, const char *dest, switch_asr_flag_t *flags)
+{
+	whisper_t *context;
+	whisper_arena_t *arena;
+	whisper_endpoint_t *endpoint;
+	whisper_settings_t *settings;
+	const whisper_profile_t *profile;
+	const whisper_route_t *route;
+	switch_core_session_t *session;
+	const char *model = NULL, *language = NULL, *url;
+	char *asr_server = NULL;
+	switch_status_t status = SWITCH_STATUS_SUCCESS;
+
+
+	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "asr_open attempt on CLOSED asr handle\n");
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if (!(settings = whisper_settings_acquire())) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if ((session = switch_core_memory_pool_get_data(ah->memory_pool, "__session"))) {
+		model = switch_channel_get_variable(switch_core_session_get_channel(session), "whisper_model");
+		language = switch_channel_get_variable(switch_core_session_get_channel(session), "whisper_language");
+	}
+
+	route = whisper_route_pick(settings, model, language);
+	url = route ? route->url : settings->asr_server_url;
+
+	/* before any allocation, an overloaded backend is answered straight away. Replays never reach a server */
+	if (switch_core_memory_pool_get_data(ah->memory_pool, "__whisper_loopback")) {
+		endpoint = NULL;
+	} else if (!(endpoint = whisper_admit("asr", url, route && route->max_sessions ? route->max_sessions : settings->asr_max_sessions,
+										  settings, ah->memory_pool))) {
+		whisper_settings_release(&settings);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if (!(arena = whisper_arena_create(&whisper_globals.asr_slabs))) {
+		whisper_admit_release(&endpoint);
+		whisper_settings_release(&settings);
+		return SWITCH_STATUS_MEMERR;
+	}
+
+	context = (whisper_t *) whisper_arena_alloc(arena, sizeof(*context));
+	context->arena = arena;
+	context->pool = ah->memory_pool;
+	context->endpoint = endpoint;
+	context->settings = settings;
+	context->loopback = switch_core_memory_pool_get_data(ah->memory_pool, "__whisper_loopback");
+	context->model = zstr(model) ? NULL : whisper_arena_strdup(arena, model);
+	context->language = zstr(language) ? NULL : whisper_arena_strdup(arena, language);
+	context->asr_url = whisper_arena_strdup(arena, url);
+	context->route = route;
+	if (!context->loopback) {
+		context->route_stats = whisper_route_stats_get(route, settings);
+	}
+
+	if (session) {
+		context->channel_uuid = whisper_arena_strdup(arena, switch_core_session_get_uuid(session));
+	}
+
+	ah->private_info = context;
+	codec = "L16";
+	ah->codec = switch_core_strdup(ah->memory_pool, codec);
+
+	asr_server = whisper_arena_strdup(arena, url);
+
+	if (rate > 16000) {
+		ah->native_rate = 16000;
+	}
+
+	context->send_buf = whisper_arena_alloc(arena, LWS_PRE + AUDIO_BLOCK_SIZE);
+
+	if (switch_buffer_create_partition(ah->memory_pool, &context->audio_buffer, whisper_arena_alloc(arena, ASR_AUDIO_BUFFER_SIZE),
+									   ASR_AUDIO_BUFFER_SIZE) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Failed to create the audio buffer\n");
+		ah->private_info = NULL;
+		whisper_release(context);
+		return SWITCH_STATUS_MEMERR;
+	}
+
+	context->pace.catchup = settings->asr_pace_catchup;
+	switch_mutex_init(&context->pace_mutex, SWITCH_MUTEX_NESTED, ah->memory_pool);
+
+	status = ws_asr_setup_connection(asr_server, context, ah->memory_pool);
+
+	if (status != SWITCH_STATUS_SUCCESS) {
+		whisper_fire_event(context, "whisper::asr_connection_error");
+		/* the arena goes back to the slab, nothing may reach it through the handle */
+		ah->private_info = NULL;
+		whisper_release(context);
+		return status;
+	}
+
+	whisper_send_language(context, route);
+
+	if (!session || !(profile = whisper_profile_find(settings, switch_channel_get_variable(switch_core_session_get_channel(session), "whisper_profile")))) {
+		profile = &settings->defaults;
+	}
+	whisper_apply_profile(context, profile);
+
+	context->start_input_timers = 1;
+	context->rate = ah->native_rate ? ah->native_rate : rate;
+
+	if (whisper_tap_wanted(settings, session)) {
+		context->tap = whisper_tap_create(settings->record_dir, context->channel_uuid, context->rate, profile->name);
+	}
+
+	context->vad = switch_vad_init(ah->native_rate, 1);
+	switch_vad_set_mode(context->vad, -1);
+	switch_vad_set_param(context->vad, "thresh", context->thresh);
+	switch_vad_set_param(context->vad, "silence_ms", context->silence_ms);
+	switch_vad_set_param(context->vad, "voice_ms", context->voice_ms);
+	switch_vad_set_param(context->vad, "debug", 1);
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "ASR opened\n");
+
+	whisper_reset_vad(context);
+	whisper_watch_add(&context->watch, WATCH_ASR, context);
+
+	return status;
+}
+
+static switch_status_t whisper_load_grammar(switch_asr_handle_t *ah, const char *grammar, const char *name)
+{
+	whisper_t *context = (whisper_t *)ah->private_info;
+	char *req_string;
+
+	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "asr_open attempt on CLOSED asr handle\n");
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if (zstr(grammar)) {
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "load grammar %s\n", grammar);
+	context->grammar = switch_core_strdup(ah->memory_pool, grammar);
+
+	if (!(req_string = whisper_grammar_cache_get(grammar, ah->memory_pool))) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_ERROR, "Unable to load grammar %s\n", grammar);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if (whisper_send_text_request(context, req_string) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Unable to send grammar to websocket server\n");
+	}
+	
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static switch_status_t whisper_unload_grammar(switch_asr_handle_t *ah, const char *name)
+{
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static switch_status_t whisper_close(switch_asr_handle_t *ah, switch_asr_flag_t *flags)
+{
+	whisper_t *context = (whisper_t *)ah->private_info;
+	switch_status_t status = SWITCH_STATUS_SUCCESS;
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "ASR close!\n");
+	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Double ASR close!\n");
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if (!context) {
+		/* open failed */
+		switch_set_flag(ah, SWITCH_ASR_FLAG_CLOSED);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	whisper_atomic_set(context->flags, 0);
+	whisper_reconnect_cancel(context);
+	whisper_release(context);
+
+	switch_set_flag(ah, SWITCH_ASR_FLAG_CLOSED);
+	
+	return status;
+}
+
+static switch_status_t whisper_feed(switch_asr_handle_t *ah, void *data, unsigned int len, switch_asr_flag_t *flags)
+{
+	whisper_t *context = (whisper_t *) ah->private_info;
+	switch_vad_state_t vad_state;
+	uint32_t samples = len / sizeof(uint16_t), score = 0, frame_ms = 0;
+	int rlen;
+
+	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
+		return SWITCH_STATUS_BREAK;
+	}
+
+	/* every frame advances the media clock, sent or not */
+	context->fed_samples += samples;
+
+	if (whisper_flag_test(context, ASRFLAG_RETURNED_RESULT) && switch_test_flag(ah, SWITCH_ASR_FLAG_AUTO_RESUME)) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Auto Resuming\n");
+		whisper_reset_vad(context);
+	}
+
+	if (whisper_reconnect_done(context)) {
+		whisper_asr_reset_replies(context);
+	}
+
+	if (whisper_flag_test(context, ASRFLAG_READY) && whisper_atomic_get(context->started) != WS_STATE_STARTED) {
+		whisper_reconnect_request(context);
+	}
+
+	if (whisper_flag_test(context, ASRFLAG_READY)) {
+
+		vad_state = switch_vad_process(context->vad, (int16_t *)data, samples);
+
+		if ((context->vad_adaptive || context->speculative_pause_ms) && context->rate) {
+			score = whisper_vad_score(context, (int16_t *)data, samples);
+			frame_ms = samples * 1000 / context->rate;
+		}
+		whisper_vad_adapt(context, score, frame_ms, vad_state);
+		whisper_tap_audio(context->tap, data, len);
+		
+		if (vad_state == SWITCH_VAD_STATE_TALKING) {
+
+			uint8_t *buf = context->send_buf + LWS_PRE;
+
+			switch_buffer_write(context->audio_buffer, data, len);
+
+			if (switch_buffer_inuse(context->audio_buffer) > AUDIO_BLOCK_SIZE && !whisper_reconnect_pending(context)) {
+				rlen = switch_buffer_read(context->audio_buffer, buf, AUDIO_BLOCK_SIZE);
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Sending data %d %d\n", rlen, context->started);
+	
+				if (whisper_atomic_get(context->started) != WS_STATE_STARTED) {
+					/* the next frame asks again, after the retry interval */
+					whisper_atomic_set(context->reconnect, ASR_RECONNECT_IDLE);
+					whisper_fire_event(context, "whisper::asr_connection_error");
+					return SWITCH_STATUS_BREAK; 
+				}
+
+				if (whisper_send_audio(context, buf, rlen) != SWITCH_STATUS_SUCCESS) {
+					return SWITCH_STATUS_BREAK;
+				}
+			} 
+
+			if (context->speculative_pause_ms && frame_ms && whisper_spec_track(context, score, frame_ms) != SWITCH_STATUS_SUCCESS) {
+				return SWITCH_STATUS_BREAK;
+			}
+		}
+
+		if (vad_state == SWITCH_VAD_STATE_STOP_TALKING || whisper_flag_test(context, ASRFLAG_TIMEOUT)) {
+			switch_status_t ws_status;
+
+			whisper_fire_event(context, "whisper::asr_stop_talking");
+			whisper_tap_event(context->tap, whisper_flag_test(context, ASRFLAG_TIMEOUT) ? "timeout" : "stop_talking", NULL);
+
+			if (whisper_reconnect_pending(context) || whisper_atomic_get(context->started) != WS_STATE_STARTED) {
+				/* no connection to send eof on, the utterance is lost and its tail must not start the next one */
+				switch_buffer_zero(context->audio_buffer);
+				whisper_fire_event(context, "whisper::asr_connection_error");
+				return SWITCH_STATUS_BREAK;
+			}
+
+			/* stop detection before eof goes out so a fast reply finds the result pending */
+			whisper_atomic_set(context->pending_time, switch_micro_time_now());
+			if (!whisper_flag_transition(context, ASRFLAG_READY, ASRFLAG_READY, ASRFLAG_RESULT_PENDING)) {
+				return SWITCH_STATUS_SUCCESS;
+			}
+			switch_vad_reset(context->vad);
+
+			ws_status = whisper_get_final_transcription(context, whisper_spec_finish(context));
+			
+			if (ws_status != SWITCH_STATUS_SUCCESS) {
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Sendig data for transcription failed\n");
+				whisper_flag_transition(context, ASRFLAG_RESULT_PENDING, ASRFLAG_RESULT_PENDING, ASRFLAG_READY);
+				return SWITCH_STATUS_BREAK;
+			}
+		} else if (vad_state == SWITCH_VAD_STATE_START_TALKING) {
+			
+			whisper_fire_event(context, "whisper::asr_start_talking");
+			whisper_tap_event(context->tap, "start_talking", NULL);
+
+			context->speech_time = switch_micro_time_now();
+			whisper_flag_set(context, ASRFLAG_START_OF_SPEECH);
+		}
+	}
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static switch_status_t whisper_pause(switch_asr_handle_t *ah)
+{
+	whisper_t *context = (whisper_t *) ah->private_info;
+
+	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "asr_pause attempt on CLOSED asr handle\n");
+		return SWITCH_STATUS_FALSE;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Pausing\n");
+
+	whisper_atomic_set(context->flags, 0);
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static switch_status_t whisper_resume(switch_asr_handle_t *ah)
+{
+	whisper_t *context = (whisper_t *) ah->private_info;
+
+	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "asr_resume attempt on CLOSED asr handle\n");
+		return SWITCH_STATUS_FALSE;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Resuming\n");
+	whisper_reset_vad(context);
+	
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static switch_status_t whisper_check_results(switch_asr_handle_t *ah, switch_asr_flag_t *flags)
+{
+	whisper_t *context = (whisper_t *) ah->private_info;
+	uint32_t state;
+
+	/* after close the arena may already belong to another session */
+	if (!context || switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
+		return SWITCH_STATUS_BREAK;
+	}
+
+	state = whisper_atomic_get(context->flags);
+	if ((state & ASRFLAG_RESULT_PENDING)) {
+		/* polled every frame, so the deadline holds to the frame rather than the watchdog interval */
+		if (!whisper_result_expire(context, switch_micro_time_now())) {
+			return SWITCH_STATUS_BREAK;
+		}
+		state = whisper_atomic_get(context->flags);
+	}
+
+
+	if ((state & ASRFLAG_RETURNED_RESULT)) {
+		return SWITCH_STATUS_BREAK;
+	}
+
+	if (!(state & ASRFLAG_RETURNED_START_OF_SPEECH) && (state & ASRFLAG_START_OF_SPEECH)) {
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	if (!(state & ASRFLAG_RESULT_READY) && !(state & ASRFLAG_NOINPUT_TIMEOUT)) {
+		if ((state & ASRFLAG_INPUT_TIMERS) && !(state & ASRFLAG_START_OF_SPEECH) &&
+				context->no_input_timeout >= 0 &&
 				(switch_micro_time_now() - context->no_input_time) / 1000 >= context->no_input_timeout) {
 			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "NO INPUT TIMEOUT %" SWITCH_TIME_T_FMT "ms\n", (switch_micro_time_now() - context->no_input_time) / 1000);
-			switch_set_flag(context, ASRFLAG_NOINPUT_TIMEOUT);
-		} else if (!switch_test_flag(context, ASRFLAG_TIMEOUT) && switch_test_flag(context, ASRFLAG_START_OF_SPEECH) && context->speech_timeout > 0 && (switch_micro_time_now() - context->speech_time) / 1000 >= context->speech_timeout) {
+			whisper_flag_set(context, ASRFLAG_NOINPUT_TIMEOUT);
+		} else if (!(state & ASRFLAG_TIMEOUT) && (state & ASRFLAG_START_OF_SPEECH) && context->speech_timeout > 0 && (switch_micro_time_now() - context->speech_time) / 1000 >= context->speech_timeout) {
 			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "SPEECH TIMEOUT %" SWITCH_TIME_T_FMT "ms\n", (switch_micro_time_now() - context->speech_time) / 1000);
-			if (switch_test_flag(context, ASRFLAG_START_OF_SPEECH)) {
-				switch_set_flag(context, ASRFLAG_TIMEOUT);
+			if ((state & ASRFLAG_START_OF_SPEECH)) {
+				whisper_flag_set(context, ASRFLAG_TIMEOUT);
 				return SWITCH_STATUS_FALSE;
-				//switch_set_flag(context, ASRFLAG_RESULT_READY);
+				//whisper_flag_set(context, ASRFLAG_RESULT_READY);
+			} else {
+				whisper_flag_set(context, ASRFLAG_NOINPUT_TIMEOUT);
+			}
+		}
+	}
+
+	return whisper_flag_test(context, ASRFLAG_RESULT_READY | ASRFLAG_NOINPUT_TIMEOUT) ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_BREAK;
+}
+
+static switch_status_t whisper_get_results(switch_asr_handle_t *ah, char **resultstr, switch_asr_flag_t *flags)
+{
+	whisper_t *context = (whisper_t *) ah->private_info;
+	switch_status_t status = SWITCH_STATUS_SUCCESS;
+	uint32_t state;
+
+	if (!context || switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	state = whisper_atomic_get(context->flags);
+	if ((state & ASRFLAG_RETURNED_RESULT)) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if ((state & (ASRFLAG_RESULT_TIMEOUT | ASRFLAG_CONNECTION_LOST))) {
+		/* set by the watchdog, a no-match the dialplan can tell apart */
+		const char *error = (state & ASRFLAG_RESULT_TIMEOUT) ? "result_timeout" : "connection_lost";
+
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Result: %s\n", error);
+
+		/* frees the socket now rather than at close, whisper_feed reconnects for the next utterance */
+		whisper_asr_drop(context);
+
+		*resultstr = switch_mprintf("{\"grammar\": \"%s\", \"text\": \"\", \"confidence\": 0, \"error\": \"%s\"}", context->grammar, error);
+
+		status = SWITCH_STATUS_SUCCESS;
+	} else if ((state & ASRFLAG_RESULT_READY)) {
+		int is_partial = context->partial-- > 0 ? 1 : 0;
+
+		//*resultstr = switch_mprintf("{\"grammar\": \"%s\", \"text\": \"%s\", \"confidence\": %f}", context->grammar, context->result_text, context->result_confidence);
+
+		/* the caller frees the result, the text itself lives in the session arena */
+		*resultstr = strdup(context->result_text);
+
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_NOTICE, "%sResult: %s\n", is_partial ? "Partial " : "Final ", *resultstr);
+
+		if (is_partial) {
+			status = SWITCH_STATUS_MORE_DATA;
+		} else {
+			status = SWITCH_STATUS_SUCCESS;
+		}
+	} else if ((state & ASRFLAG_NOINPUT_TIMEOUT)) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Result: NO INPUT\n");
+
+		*resultstr = switch_mprintf("{\"grammar\": \"%s\", \"text\": \"\", \"confidence\": 0, \"error\": \"no_input\"}", context->grammar);
+
+		status = SWITCH_STATUS_SUCCESS;
+	} else if (!(state & ASRFLAG_RETURNED_START_OF_SPEECH) && (state & ASRFLAG_START_OF_SPEECH)) {
+		whisper_flag_set(context, ASRFLAG_RETURNED_START_OF_SPEECH);
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Result: START OF SPEECH\n");
+		status = SWITCH_STATUS_BREAK;
+	} else {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_ERROR, "Unexpected call to asr_get_results - no results to return!\n");
+		status = SWITCH_STATUS_FALSE;
+	}
+
+	if (status == SWITCH_STATUS_SUCCESS) {
+		whisper_flag_transition(context, 0, ASRFLAG_READY, ASRFLAG_RETURNED_RESULT);
+	}
+
+	return status;
+}
+
+static switch_status_t whisper_start_input_timers(switch_asr_handle_t *ah)
+{
+	whisper_t *context = (whisper_t *) ah->private_info;
+
+	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "asr_start_input_timers attempt on CLOSED asr handle\n");
+		return SWITCH_STATUS_FALSE;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "start_input_timers\n");
+
+	if (!whisper_flag_test(context, ASRFLAG_INPUT_TIMERS)) {
+		context->no_input_time = switch_micro_time_now();
+		whisper_flag_set(context, ASRFLAG_INPUT_TIMERS);
+	} else {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_INFO, "Input timers already started\n");
+	}
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static void whisper_text_param(switch_asr_handle_t *ah, char *param, const char *val)
+{
+	whisper_t *context = (whisper_t *) ah->private_info;
+	const whisper_profile_t *profile;
+
+	if (!zstr(param) && !zstr(val)) {
+		int nval;
+		double fval;
+
+		/* the common case, no number parsing at all */
+		if (!strcasecmp("profile", param)) {
+			if ((profile = whisper_profile_find(context->settings, val))) {
+				whisper_apply_profile(context, profile);
+				switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "profile = %s\n", val);
+			} else {
+				switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_WARNING, "Unknown profile %s\n", val);
+			}
+			return;
+		}
+
+		if (!strcasecmp("language", param) || !strcasecmp("model", param)) {
+			whisper_set_route(context, param, val);
+			return;
+		}
+
+		nval = atoi(val);
+		fval = atof(val);
+
+		if (!strcasecmp("no-input-timeout", param) && switch_is_number(val)) {
+			context->no_input_timeout = nval;
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "no-input-timeout = %d\n", context->no_input_timeout);
+		} else if (!strcasecmp("speech-timeout", param) && switch_is_number(val)) {
+			context->speech_timeout = nval;
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "speech-timeout = %d\n", context->speech_timeout);
+		} else if (!strcasecmp("start-input-timers", param)) {
+			context->start_input_timers = switch_true(val);
+			if (context->start_input_timers) {
+				whisper_flag_set(context, ASRFLAG_INPUT_TIMERS);
 			} else {
-				switch_set_flag(context, ASRFLAG_NOINPUT_TIMEOUT);
+				whisper_flag_clear(context, ASRFLAG_INPUT_TIMERS);
+			}
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "start-input-timers = %d\n", context->start_input_timers);
+		} else if (!strcasecmp("vad-mode", param)) {
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "vad-mode = %s\n", val);
+			if (context->vad) switch_vad_set_mode(context->vad, nval);
+		} else if (!strcasecmp("vad-voice-ms", param) && nval > 0) {
+			context->voice_ms = nval;
+			switch_vad_set_param(context->vad, "voice_ms", nval);
+		} else if (!strcasecmp("vad-silence-ms", param) && nval > 0) {
+			context->silence_ms = context->cur_silence_ms = nval;
+			switch_vad_set_param(context->vad, "silence_ms", nval);
+		} else if (!strcasecmp("vad-thresh", param) && nval > 0) {
+			/* with vad-adaptive this is the lowest threshold used */
+			context->thresh = context->cur_thresh = nval;
+			switch_vad_set_param(context->vad, "thresh", nval);
+		} else if (!strcasecmp("vad-adaptive", param)) {
+			context->vad_adaptive = switch_true(val);
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "vad-adaptive = %d\n", context->vad_adaptive);
+		} else if (!strcasecmp("result-timeout-ms", param) && nval > 0) {
+			context->result_timeout_ms = nval;
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "result-timeout-ms = %d\n", nval);
+		} else if (!strcasecmp("speculative-pause-ms", param) && nval >= 0) {
+			/* 0 turns it off for this call */
+			context->speculative_pause_ms = nval;
+		} else if (!strcasecmp("channel-uuid", param)) {
+			context->channel_uuid = switch_core_strdup(ah->memory_pool, val);
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "channel-uuid = %s\n", val);
+		} else if (!strcasecmp("result", param)) {
+			context->result_text = switch_core_strdup(ah->memory_pool, val);
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "result = %s\n", val);
+		} else if (!strcasecmp("confidence", param) && fval >= 0.0) {
+			context->result_confidence = fval;
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "confidence = %f\n", fval);
+		} else if (!strcasecmp("partial", param) && switch_true(val)) {
+			context->partial = 3;
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "partial = %d\n", context->partial);
+		}
+	}
+}
+
+/* TTS Interface */
+
+/* After the service thread is joined, nothing adds to cancelled_bytes any more */
+static void whisper_speech_report_cancelled(whisper_tts_t *context)
+{
+	if (context->cancelled_bytes && context->samplerate) {
+		switch_size_t ms = context->cancelled_bytes * 1000 / (context->samplerate * sizeof(int16_t));
+		switch_core_session_t *session;
+
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "TTS cancelled %" SWITCH_SIZE_T_FMT " bytes (%" SWITCH_SIZE_T_FMT " ms)\n",
+						  context->cancelled_bytes, ms);
+
+		if (!zstr(context->channel_uuid) && (session = switch_core_session_locate(context->channel_uuid))) {
+			switch_channel_set_variable_printf(switch_core_session_get_channel(session), "whisper_tts_cancelled_ms", "%" SWITCH_SIZE_T_FMT, ms);
+			switch_core_session_rwunlock(session);
+		}
+
+		switch_mutex_lock(whisper_globals.stats_mutex);
+		whisper_globals.tts_cancelled_bytes += context->cancelled_bytes;
+		switch_mutex_unlock(whisper_globals.stats_mutex);
+	}
+}
+
+static void whisper_speech_release(whisper_tts_t *context)
+{
+	whisper_watch_remove(&context->watch);
+	ws_tts_close_connection(context);
+	whisper_speech_report_cancelled(context);
+
+	whisper_tts_queue_free(context->tx_head);
+	context->tx_head = context->tx_tail = NULL;
+
+	if (context->stage) {
+		whisper_stage_item_release(context->stage, &context->staged);
+		whisper_stage_release(&context->stage);
+	}
+
+	if ( context->audio_buffer ) {
+		switch_buffer_destroy(&context->audio_buffer);
+	}
+
+	if (switch_core_codec_ready(&context->decoder)) {
+		switch_core_codec_destroy(&context->decoder);
+	}
+
+	whisper_admit_release(&context->endpoint);
+	whisper_settings_release(&context->settings);
+	whisper_arena_destroy(&context->arena);
+}
+
+static switch_status_t whisper_speech_open(switch_speech_handle_t *sh, const char *voice_name, int rate, int channels, switch_speech_flag_t *flags)
+{
+	whisper_settings_t *settings = whisper_settings_acquire();
+	whisper_endpoint_t *endpoint;
+	whisper_arena_t *arena;
+	whisper_tts_t *context;
+	switch_status_t status = SWITCH_STATUS_FALSE;
+	switch_event_t *event = NULL;
+	char * tts_server = NULL;
+	char * session_uuid =  NULL;
+	switch_core_session_t *session;
+
+	if (!settings) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if (!(endpoint = whisper_admit("tts", settings->tts_server_url, settings->tts_max_sessions, settings, sh->memory_pool))) {
+		whisper_settings_release(&settings);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if (!(arena = whisper_arena_create(&whisper_globals.tts_slabs))) {
+		whisper_admit_release(&endpoint);
+		whisper_settings_release(&settings);
+		return SWITCH_STATUS_MEMERR;
+	}
+
+	context = whisper_arena_alloc(arena, sizeof(whisper_tts_t));
+	context->arena = arena;
+	context->endpoint = endpoint;
+	context->settings = settings;
+
+	/* check if session is associated w/ this memory pool */
+	session = switch_core_memory_pool_get_data(sh->memory_pool, "__session");
+	if (session) {
+		session_uuid = switch_core_session_get_uuid(session);
+		/* only when something was prefetched for this channel */
+		context->stage = whisper_stage_get(session, 0);
+	}
+	
+	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "session-uuid = %s\n", session_uuid);
+	switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, "whisper::tts_open");
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "WHISPER-voice", voice_name);
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "WHISPER-uuid", session_uuid);
+	switch_event_fire(&event);
+
+    if ( voice_name ) {
+        context->voice = whisper_arena_strdup(arena, voice_name);
+    } else {
+        context->voice = "default";
+    }
+
+	context->samplerate = sh->samplerate;
+	
+	context->pool = sh->memory_pool;
+	context->rx_request_id = 1;
+
+	context->high_water = settings->tts_high_water;
+	context->low_water = settings->tts_low_water;
+	context->chunk_chars = settings->tts_chunk_max_chars;
+	context->pipeline_depth = settings->tts_pipeline_depth;
+
+	switch_mutex_init(&context->mutex, SWITCH_MUTEX_NESTED, sh->memory_pool);
+
+	/* reading pauses at the high-water mark, so one more decoded rx chunk always fits */
+	switch_buffer_create_partition(sh->memory_pool, &context->audio_buffer, whisper_arena_alloc(arena, context->high_water + TTS_DECODE_BUFFER_SIZE),
+								   context->high_water + TTS_DECODE_BUFFER_SIZE);
+
+	context->encoding = settings->tts_encoding;
+	context->frame_ms = settings->tts_frame_ms;
+	context->native_rate = settings->tts_sample_rate && !strcasecmp(context->encoding, "L16") ? settings->tts_sample_rate : context->samplerate;
+
+	if (strcasecmp(context->encoding, "L16")) {
+		if (switch_core_codec_init(&context->decoder, context->encoding, NULL, NULL, context->native_rate, context->frame_ms, 1,
+								   SWITCH_CODEC_FLAG_ENCODE | SWITCH_CODEC_FLAG_DECODE, NULL, sh->memory_pool) != SWITCH_STATUS_SUCCESS) {
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_ERROR, "Unable to load %s decoder at %dHz, using L16\n",
+							  context->encoding, context->native_rate);
+			context->encoding = "L16";
+		} else {
+			context->decode_buf = whisper_arena_alloc(arena, TTS_DECODE_BUFFER_SIZE);
+		}
+	}
+
+	sh->private_info = context;
+
+	tts_server = whisper_arena_strdup(arena, settings->tts_server_url);
+
+	status = ws_tts_setup_connection(tts_server, context, sh->memory_pool);
+
+	if (status == SWITCH_STATUS_SUCCESS && whisper_send_speech_config(context) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Unable to send TTS config to websocket server\n");
+		status = SWITCH_STATUS_FALSE;
+	}
+
+	if (status != SWITCH_STATUS_SUCCESS) {
+		sh->private_info = NULL;
+		whisper_speech_release(context);
+	} else {
+		whisper_watch_add(&context->watch, WATCH_TTS, context);
+	}
+
+	return status;
+}
+
+static switch_status_t whisper_speech_close(switch_speech_handle_t *sh, switch_speech_flag_t *flags)
+{
+	whisper_tts_t *context = (whisper_tts_t *) sh->private_info;
+
+	if (!context) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	whisper_speech_release(context);
+	sh->private_info = NULL;
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* More audio may still come for the prompt: not finished, connection up, server not stalled */
+static switch_bool_t whisper_tts_streaming(whisper_tts_t *context)
+{
+	switch_time_t rx_time = whisper_atomic_get(context->rx_time);
+
+	return whisper_atomic_get(context->started) == WS_STATE_STARTED && !whisper_atomic_get(context->wc_error) &&
+		whisper_atomic_get(context->rx_request_id) <= whisper_atomic_get(context->request_id) &&
+		rx_time && switch_micro_time_now() - rx_time < (switch_time_t) WATCHDOG_TTS_STALL_MS * 1000;
+}
+
+static switch_status_t whisper_speech_feed_tts(switch_speech_handle_t *sh, char *text, switch_speech_flag_t *flags)
+{
+	whisper_tts_t *context = (whisper_tts_t *)sh->private_info;
+
+	if (switch_true(switch_core_get_variable("mod_whisper_tts_must_have_channel_uuid")) && zstr(context->channel_uuid)) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if (!zstr(text)) {
+		context->text = switch_core_strdup(sh->memory_pool, text);
+	}
+
+	if (context->stage) {
+		whisper_stage_item_release(context->stage, &context->staged);
+
+		/* prefetched, play it without asking the server */
+		if ((context->staged = whisper_stage_find(context->stage, context->voice, context->text, context->samplerate))) {
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "TTS prompt staged, playing it directly\n");
+			context->staged_pos = 0;
+			__atomic_add_fetch(&whisper_globals.tts_prefetch_hits, 1, __ATOMIC_RELAXED);
+			return SWITCH_STATUS_SUCCESS;
+		}
+		__atomic_add_fetch(&whisper_globals.tts_prefetch_misses, 1, __ATOMIC_RELAXED);
+	}
+
+	if (zstr(context->text)) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	whisper_atomic_set(context->rx_time, switch_micro_time_now());
+
+	/* the service thread writes it, a sentence at a time for long texts */
+	if (whisper_send_speech_text(context, context->text) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "Unable to queue TTS request\n");
+		return SWITCH_STATUS_FALSE;
+	}
+
+	while ( (!context->audio_buffer || switch_buffer_inuse(context->audio_buffer) == 0) && whisper_tts_streaming(context) ) {
+		usleep(30000);
+	}
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static switch_status_t whisper_speech_read_tts(switch_speech_handle_t *sh, void *data, switch_size_t *datalen, switch_speech_flag_t *flags)
+{
+	whisper_tts_t *context = (whisper_tts_t *)sh->private_info;
+	size_t bytes_read;
+
+	/* a server that cannot produce the channel rate is resampled by the core */
+	sh->native_rate = context->native_rate;
+
+	if (context->staged) {
+		uint32_t native_rate = context->native_rate;
+		switch_status_t status = whisper_stage_read(context->stage, context->staged, &context->staged_pos, data, datalen, &native_rate);
+
+		sh->native_rate = native_rate;
+
+		if (status == SWITCH_STATUS_BREAK) {
+			/* still being synthesized in the background */
+			memset(data, 0, *datalen);
+			return SWITCH_STATUS_SUCCESS;
+		}
+		if (status != SWITCH_STATUS_SUCCESS) {
+			whisper_stage_item_release(context->stage, &context->staged);
+		}
+		return status;
+	}
+
+	switch_mutex_lock(context->mutex);
+	bytes_read = switch_buffer_read(context->audio_buffer, data, *datalen);
+
+	if (context->rx_paused && !context->rx_resume && switch_buffer_inuse(context->audio_buffer) <= context->low_water) {
+		context->rx_resume = 1;
+		whisper_tts_wake(context);
+	}
+	switch_mutex_unlock(context->mutex);
+	
+	if ( bytes_read ) {
+		*datalen = bytes_read ;
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	/* buffer ran dry while the prompt is still streaming, play silence rather than cut it short */
+	if (whisper_tts_streaming(context)) {
+		if (context->prefetch) {
+			/* nobody is listening, the prefetch thread waits instead */
+			return SWITCH_STATUS_BREAK;
+		}
+		memset(data, 0, *datalen);
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	return SWITCH_STATUS_FALSE;
+}
+
+static void whisper_speech_flush_tts(switch_speech_handle_t *sh)
+{
+	whisper_tts_t *context = (whisper_tts_t *) sh->private_info;
+	uint32_t cancel_id = 0;
+
+	if (context->staged) {
+		/* barge-in on a staged prompt, nothing to cancel on the server */
+		whisper_stage_item_release(context->stage, &context->staged);
+		return;
+	}
+
+	if ( context->audio_buffer ) {
+		switch_mutex_lock(context->mutex);
+		context->cancelled_bytes += switch_buffer_inuse(context->audio_buffer);
+	    switch_buffer_zero(context->audio_buffer);
+
+		if (context->rx_paused && !context->rx_resume) {
+			context->rx_resume = 1;
+			whisper_tts_wake(context);
+		}
+
+		/* barge-in: sentences not sent yet are dropped, the server stops synthesizing the rest */
+		whisper_tts_drop_queued(context);
+		if (context->rx_request_id <= context->request_id && context->cancel_id < context->request_id) {
+			cancel_id = context->cancel_id = context->request_id;
+		}
+		switch_mutex_unlock(context->mutex);
+	}
+
+	if (cancel_id && whisper_atomic_get(context->started) == WS_STATE_STARTED) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Cancelling TTS request %u\n", cancel_id);
+
+		if (whisper_cancel_speech_synthesis(context, cancel_id) != SWITCH_STATUS_SUCCESS) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Unable to send TTS cancel to websocket server\n");
+		}
+
+		switch_mutex_lock(whisper_globals.stats_mutex);
+		whisper_globals.tts_cancel_count++;
+		switch_mutex_unlock(whisper_globals.stats_mutex);
+	}
+}
+
+static void whisper_speech_text_param_tts(switch_speech_handle_t *sh, char *param, const char *val)
+{
+	whisper_tts_t *context = (whisper_tts_t *)sh->private_info;
+	if (!zstr(param) && !zstr(val)) {
+		if (!strcasecmp("channel-uuid", param)) {
+			context->channel_uuid = switch_core_strdup(sh->memory_pool, val);
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "channel-uuid = %s\n", val);
+		}
+	}
+}
+
+static void whisper_speech_numeric_param_tts(switch_speech_handle_t *sh, char *param, int val)
+{
+}
+
+static void whisper_speech_float_param_tts(switch_speech_handle_t *sh, char *param, double val)
+{
+}
+
+/* TTS prefetch: one background connection synthesizes a channel's upcoming prompts into its stage */
+
+#define PREFETCH_READ_SIZE 4096
+#define PREFETCH_POLL_MS 10
+#define PREFETCH_SHUTDOWN_MS (WS_HANDSHAKE_TIMEOUT_MS + 1000)
+
+typedef struct {
+	switch_memory_pool_t *pool;
+	whisper_stage_t *stage;
+	char *uuid;
+	char *voice;
+	uint32_t rate;
+	uint32_t count;
+	char *texts[STAGE_MAX_ITEMS];
+	whisper_stage_item_t *items[STAGE_MAX_ITEMS];
+} whisper_prefetch_t;
+
+static switch_bool_t whisper_prefetch_wanted(whisper_prefetch_t *job)
+{
+	return whisper_atomic_get(whisper_globals.running) && !whisper_stage_closed(job->stage);
+}
+
+/* Reads one prompt into its stage item, SWITCH_FALSE if it did not complete */
+static switch_bool_t whisper_prefetch_one(whisper_prefetch_t *job, switch_speech_handle_t *sh, uint32_t i)
+{
+	whisper_tts_t *context = (whisper_tts_t *) sh->private_info;
+	switch_speech_flag_t flags = SWITCH_SPEECH_FLAG_NONE;
+	uint8_t buf[PREFETCH_READ_SIZE];
+	switch_size_t len;
+	switch_status_t status;
+
+	if (whisper_atomic_get(context->started) != WS_STATE_STARTED || whisper_speech_feed_tts(sh, job->texts[i], &flags) != SWITCH_STATUS_SUCCESS) {
+		return SWITCH_FALSE;
+	}
+
+	while (whisper_prefetch_wanted(job)) {
+		len = sizeof(buf);
+		status = whisper_speech_read_tts(sh, buf, &len, &flags);
+
+		if (status == SWITCH_STATUS_BREAK) {
+			switch_yield(PREFETCH_POLL_MS * 1000);
+		} else if (status != SWITCH_STATUS_SUCCESS) {
+			/* the end of the prompt, unless the connection went away */
+			return whisper_atomic_get(context->started) == WS_STATE_STARTED;
+		} else if (whisper_stage_append(job->stage, job->items[i], buf, len, sh->native_rate) != SWITCH_STATUS_SUCCESS) {
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(job->uuid), SWITCH_LOG_WARNING, "TTS stage full, not prefetching \"%s\"\n", job->texts[i]);
+			break;
+		}
+	}
+
+	/* tell the server to skip the rest before the next prompt */
+	whisper_speech_flush_tts(sh);
+
+	return SWITCH_FALSE;
+}
+
+/* Shutdown: drops the connections prefetch threads read from, so none of them waits on a server */
+static void whisper_prefetch_abort(void)
+{
+	whisper_watch_t *watch;
+
+	switch_mutex_lock(whisper_globals.watch_mutex);
+	for (watch = whisper_globals.watch_list; watch; watch = watch->next) {
+		whisper_tts_t *context = (whisper_tts_t *) watch->context;
+
+		if (watch->kind == WATCH_TTS && context->prefetch && whisper_atomic_get(context->started) == WS_STATE_STARTED) {
+			whisper_atomic_set(context->started, WS_STATE_DESTROY);
+			whisper_tts_wake(context);
+		}
+	}
+	switch_mutex_unlock(whisper_globals.watch_mutex);
+}
+
+static void *SWITCH_THREAD_FUNC whisper_prefetch_run(switch_thread_t *thread, void *obj)
+{
+	whisper_prefetch_t *job = (whisper_prefetch_t *) obj;
+	switch_memory_pool_t *pool = job->pool;
+	switch_speech_handle_t sh = { 0 };
+	switch_speech_flag_t flags = SWITCH_SPEECH_FLAG_NONE;
+	switch_bool_t opened;
+	uint32_t i, staged = 0;
+
+	sh.memory_pool = pool;
+	sh.samplerate = sh.rate = job->rate;
+
+	opened = whisper_speech_open(&sh, job->voice, job->rate, 1, &flags) == SWITCH_STATUS_SUCCESS;
+
+	if (opened) {
+		whisper_tts_t *context = (whisper_tts_t *) sh.private_info;
+
+		context->prefetch = SWITCH_TRUE;
+		context->channel_uuid = job->uuid;
+	} else {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(job->uuid), SWITCH_LOG_WARNING, "Unable to open a TTS connection to prefetch %u prompts\n", job->count);
+	}
+
+	for (i = 0; i < job->count; i++) {
+		switch_bool_t ok = opened && whisper_prefetch_wanted(job) && whisper_prefetch_one(job, &sh, i);
+
+		if (ok) {
+			staged++;
+		}
+		whisper_stage_finish(job->stage, &job->items[i], ok);
+	}
+
+	if (opened) {
+		whisper_speech_close(&sh, &flags);
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(job->uuid), SWITCH_LOG_DEBUG, "TTS prefetch staged %u of %u prompts\n", staged, job->count);
+
+	whisper_stage_release(&job->stage);
+	__atomic_sub_fetch(&whisper_globals.prefetch_threads, 1, __ATOMIC_ACQ_REL);
+	switch_core_destroy_memory_pool(&pool);
+
+	return NULL;
+}
+
+/* data is "<voice>|<text>|<text>...", prompts already staged are skipped */
+static switch_status_t whisper_prefetch_start(switch_core_session_t *session, const char *data, uint32_t *queued)
+{
+	whisper_settings_t *settings = whisper_settings_acquire();
+	switch_codec_implementation_t read_impl = { 0 };
+	switch_memory_pool_t *pool = NULL;
+	switch_threadattr_t *thd_attr = NULL;
+	switch_thread_t *thread;
+	whisper_prefetch_t *job;
+	char *mydata, *argv[STAGE_MAX_ITEMS + 1] = { 0 };
+	int argc, i;
+
+	*queued = 0;
+
+	if (!settings) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if (!settings->tts_prefetch_max_bytes || switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS) {
+		whisper_settings_release(&settings);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	job = switch_core_alloc(pool, sizeof(*job));
+	job->pool = pool;
+	job->uuid = switch_core_strdup(pool, switch_core_session_get_uuid(session));
+	job->stage = whisper_stage_get(session, settings->tts_prefetch_max_bytes);
+	whisper_settings_release(&settings);
+
+	/* speak opens the TTS handle at the read codec rate */
+	switch_core_session_get_read_impl(session, &read_impl);
+	job->rate = read_impl.actual_samples_per_second ? read_impl.actual_samples_per_second : 8000;
+
+	mydata = switch_core_strdup(pool, data);
+	argc = switch_separate_string(mydata, '|', argv, (sizeof(argv) / sizeof(argv[0])));
+	job->voice = argc > 0 && !zstr(argv[0]) ? argv[0] : "default";
+
+	for (i = 1; job->stage && i < argc; i++) {
+		if (!zstr(argv[i]) && (job->items[job->count] = whisper_stage_add(job->stage, job->voice, argv[i], job->rate))) {
+			job->texts[job->count++] = argv[i];
+		}
+	}
+
+	if (!job->count) {
+		whisper_stage_release(&job->stage);
+		switch_core_destroy_memory_pool(&pool);
+		/* everything asked for is staged already */
+		return argc > 1 ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_FALSE;
+	}
+
+	__atomic_add_fetch(&whisper_globals.prefetch_threads, 1, __ATOMIC_ACQ_REL);
+	switch_threadattr_create(&thd_attr, pool);
+	switch_threadattr_detach_set(thd_attr, 1);
+	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+
+	if (switch_thread_create(&thread, thd_attr, whisper_prefetch_run, job, pool) != SWITCH_STATUS_SUCCESS) {
+		for (i = 0; i < (int) job->count; i++) {
+			whisper_stage_finish(job->stage, &job->items[i], SWITCH_FALSE);
+		}
+		whisper_stage_release(&job->stage);
+		__atomic_sub_fetch(&whisper_globals.prefetch_threads, 1, __ATOMIC_ACQ_REL);
+		switch_core_destroy_memory_pool(&pool);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	*queued = job->count;
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+#define WHISPER_PREFETCH_SYNTAX "<voice>|<text>[|<text>...]"
+
+SWITCH_STANDARD_APP(whisper_prefetch_app)
+{
+	uint32_t queued;
+
+	if (zstr(data)) {
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Usage: whisper_tts_prefetch %s\n", WHISPER_PREFETCH_SYNTAX);
+		return;
+	}
+
+	if (whisper_prefetch_start(session, data, &queued) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "TTS prefetch not started, no prompts or tts-prefetch-max-bytes is 0\n");
+	}
+}
+
+/* Builds a new settings snapshot from whisper.conf and publishes it, live sessions keep theirs */
+static switch_status_t load_config(void)
+{
+	char *cf = "whisper.conf";
+	switch_xml_t cfg, xml = NULL, param, settings_tag;
+	switch_status_t status = SWITCH_STATUS_SUCCESS;
+	whisper_settings_t *settings;
+
+	if (!(settings = whisper_settings_create())) {
+		return SWITCH_STATUS_MEMERR;
+	}
+
+	if (!(xml = switch_xml_open_cfg(cf, &cfg, NULL))) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Open of %s failed\n", cf);
+		status = SWITCH_STATUS_FALSE;
+		goto done;
+	}
+
+
+	if ((settings_tag = switch_xml_child(cfg, "settings"))) {
+		for (param = switch_xml_child(settings_tag, "param"); param; param = param->next) {
+			char *var = (char *) switch_xml_attr_soft(param, "name");
+			char *val = (char *) switch_xml_attr_soft(param, "value");
+			if (!strcasecmp(var, "asr-server-url")) {
+				settings->asr_server_url = switch_core_strdup(settings->pool, val);
+			}
+			if (!strcasecmp(var, "tts-server-url")) {
+				settings->tts_server_url = switch_core_strdup(settings->pool, val);
+			}
+			if (!strcasecmp(var, "return-json")) {
+				settings->return_json = atoi(val);
+			}
+			if (!strcasecmp(var, "auto-reload")) {
+				settings->auto_reload = switch_true(val);
+			}
+			if (whisper_profile_param(&settings->defaults, var, val)) {
+				continue;
+			}
+			if (!strcasecmp(var, "asr-max-sessions")) {
+				settings->asr_max_sessions = atoi(val) > 0 ? atoi(val) : 0;
+			}
+			if (!strcasecmp(var, "tts-max-sessions")) {
+				settings->tts_max_sessions = atoi(val) > 0 ? atoi(val) : 0;
+			}
+			if (!strcasecmp(var, "admit-queue-size")) {
+				settings->admit_queue_size = atoi(val) > 0 ? atoi(val) : 0;
+			}
+			if (!strcasecmp(var, "admit-timeout-ms")) {
+				settings->admit_timeout_ms = atoi(val) > 0 ? atoi(val) : 0;
+			}
+			if (!strcasecmp(var, "asr-mux-connections")) {
+				int n = atoi(val);
+
+				settings->asr_mux_connections = n > 0 ? (n > MUX_MAX_CONNECTIONS ? MUX_MAX_CONNECTIONS : n) : 0;
+			}
+			if (!strcasecmp(var, "asr-batch-window-ms")) {
+				int n = atoi(val);
+
+				settings->asr_batch_window_ms = n > 0 ? (n > MUX_BATCH_WINDOW_MAX_MS ? MUX_BATCH_WINDOW_MAX_MS : n) : 0;
+			}
+			if (!strcasecmp(var, "asr-pace-catchup")) {
+				int n = atoi(val);
+
+				settings->asr_pace_catchup = n > 0 ? (n > PACE_CATCHUP_MAX ? PACE_CATCHUP_MAX : n) : 0;
+			}
+			if (!strcasecmp(var, "ws-thread-cpus") && !zstr(val)) {
+				settings->ws_cpus = switch_core_alloc(settings->pool, sizeof(int) * WS_CPU_MAX);
+				settings->ws_cpu_count = 0;
+				if (!whisper_cpu_list_parse(val, whisper_ws_cpu_add, settings)) {
+					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Invalid ws-thread-cpus '%s', websocket threads are not pinned\n", val);
+					settings->ws_cpu_count = 0;
+				}
+			}
+			if (!strcasecmp(var, "ws-ping-interval")) {
+				settings->ws_ping_interval = atoi(val) > 0 ? atoi(val) : 0;
+			}
+			if (!strcasecmp(var, "ws-ping-timeout")) {
+				int secs = atoi(val);
+				if (secs > 0) {
+					settings->ws_ping_timeout = secs;
+				}
+			}
+			if (!strcasecmp(var, "tcp-keepalive")) {
+				settings->tcp_keepalive = atoi(val) > 0 ? atoi(val) : 0;
+			}
+			if (!strcasecmp(var, "tcp-nodelay")) {
+				settings->tcp_nodelay = switch_true(val);
+			}
+			if (!strcasecmp(var, "tls-ca-file") && !zstr(val)) {
+				settings->tls_ca_file = switch_core_strdup(settings->pool, val);
+			}
+			if (!strcasecmp(var, "tls-insecure")) {
+				settings->tls_insecure = switch_true(val);
+			}
+			if (!strcasecmp(var, "tts-encoding")) {
+				if (!strcasecmp(val, "ulaw") || !strcasecmp(val, "mulaw")) {
+					val = "PCMU";
+				} else if (!strcasecmp(val, "alaw")) {
+					val = "PCMA";
+				}
+				/* websocket chunks are not packet boundaries, only one byte or sample per unit decodes at any split */
+				if (!strcasecmp(val, "L16") || !strcasecmp(val, "PCMU") || !strcasecmp(val, "PCMA")) {
+					settings->tts_encoding = switch_core_strdup(settings->pool, val);
+				} else {
+					switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "tts-encoding %s is not supported, using L16\n", val);
+				}
+			}
+			if (!strcasecmp(var, "tts-sample-rate")) {
+				settings->tts_sample_rate = atoi(val);
+			}
+			if (!strcasecmp(var, "tts-frame-ms")) {
+				int ms = atoi(val);
+				if (ms > 0) {
+					settings->tts_frame_ms = ms;
+				}
+			}
+			if (!strcasecmp(var, "tts-buffer-high-water")) {
+				int size = atoi(val);
+				if (size > 0) {
+					settings->tts_high_water = size;
+				}
+			}
+			if (!strcasecmp(var, "tts-buffer-low-water")) {
+				int size = atoi(val);
+				if (size >= 0) {
+					settings->tts_low_water = size;
+				}
+			}
+			if (!strcasecmp(var, "tts-chunk-max-chars")) {
+				int chars = atoi(val);
+				if (chars >= 0) {
+					settings->tts_chunk_max_chars = chars && chars < TTS_CHUNK_MIN_CHARS ? TTS_CHUNK_MIN_CHARS : chars;
+				}
+			}
+			if (!strcasecmp(var, "tts-pipeline-depth")) {
+				int depth = atoi(val);
+				if (depth > 0) {
+					settings->tts_pipeline_depth = depth > TTS_PIPELINE_DEPTH_MAX ? TTS_PIPELINE_DEPTH_MAX : depth;
+				}
+			}
+			if (!strcasecmp(var, "record-dir") && !zstr(val)) {
+				settings->record_dir = switch_core_strdup(settings->pool, val);
+			}
+			if (!strcasecmp(var, "record-percent")) {
+				int pct = atoi(val);
+
+				settings->record_percent = pct < 0 ? 0 : pct > 100 ? 100 : pct;
+			}
+			if (!strcasecmp(var, "arena-cache-slabs")) {
+				int slabs = atoi(val);
+				if (slabs >= 0) {
+					settings->arena_cache_slabs = slabs;
+				}
+			}
+			if (!strcasecmp(var, "grammar-max-size")) {
+				int size = atoi(val);
+				if (size > 0) {
+					settings->grammar_max_size = size;
+				}
+			}
+			if (!strcasecmp(var, "tts-prefetch-max-bytes")) {
+				int size = atoi(val);
+				if (size >= 0) {
+					settings->tts_prefetch_max_bytes = size;
+				}
+			}
+		}
+	}
+
+	if (settings->tts_low_water >= settings->tts_high_water) {
+		settings->tts_low_water = settings->tts_high_water / 2;
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "tts-buffer-low-water must be below the high-water mark, using %" SWITCH_SIZE_T_FMT "\n",
+						  settings->tts_low_water);
+	}
+
+	load_profiles(cfg, settings);
+	load_routes(cfg, settings);
+	load_grammars(cfg, settings);
+
+  done:
+	/* a failed reload keeps the running snapshot, only the first load publishes defaults */
+	if (status == SWITCH_STATUS_SUCCESS || !whisper_globals.settings) {
+		whisper_slab_pool_resize(&whisper_globals.asr_slabs, ASR_SLAB_SIZE, settings->arena_cache_slabs);
+		whisper_slab_pool_resize(&whisper_globals.tts_slabs, whisper_tts_slab_size(settings->tts_high_water), settings->arena_cache_slabs);
+		whisper_settings_publish(settings);
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Whisper settings version %u loaded\n", settings->version);
+	} else {
+		whisper_settings_release(&settings);
+	}
+
+	if (xml) {
+		switch_xml_free(xml);
+	}
+
+	return status;
+}
+
+static switch_status_t do_load(void)
+{
+	switch_status_t status;
+
+	switch_mutex_lock(MUTEX);
+	status = load_config();
+	switch_mutex_unlock(MUTEX);
+
+	return status;
+}
+
+static void event_handler(switch_event_t *event)
+{
+	whisper_settings_t *settings = whisper_settings_acquire();
+	int auto_reload = settings && settings->auto_reload;
+
+	whisper_settings_release(&settings);
+
+	if (auto_reload) {
+		do_load();
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Whisper Reloaded\n");
+	} else {
+		switch_xml_t cfg, xml;
+
+		if ((xml = switch_xml_open_cfg("whisper.conf", &cfg, NULL))) {
+			switch_mutex_lock(MUTEX);
+			settings = whisper_settings_acquire();
+			load_grammars(cfg, settings);
+			whisper_settings_release(&settings);
+			switch_mutex_unlock(MUTEX);
+			switch_xml_free(xml);
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Whisper grammars reloaded\n");
+		}
+	}
+}
+
+/* Replay */
+
+typedef struct {
+	const char *event;
+	uint32_t audio_ms;
+	const char *text;
+} whisper_replay_event_t;
+
+static ks_json_t *whisper_replay_load_sidecar(const char *wav)
+{
+	switch_size_t len = strlen(wav);
+	char *path, *data = NULL;
+	ks_json_t *json = NULL;
+	FILE *fp;
+	long size;
+
+	path = len > 4 && !strcasecmp(wav + len - 4, ".wav") ? switch_mprintf("%.*s.json", (int) len - 4, wav) : switch_mprintf("%s.json", wav);
+
+	if ((fp = fopen(path, "rb"))) {
+		if (!fseek(fp, 0, SEEK_END) && (size = ftell(fp)) > 0 && !fseek(fp, 0, SEEK_SET)) {
+			switch_zmalloc(data, size + 1);
+			if (fread(data, 1, size, fp) == (size_t) size) {
+				json = ks_json_parse(data);
+			}
+			switch_safe_free(data);
+		}
+		fclose(fp);
+	}
+
+	switch_safe_free(path);
+
+	return json;
+}
+
+static void whisper_replay_note(whisper_replay_event_t *events, uint32_t *n, const char *event, uint32_t audio_ms, const char *text)
+{
+	if (*n < REPLAY_MAX_EVENTS) {
+		events[*n].event = event;
+		events[*n].audio_ms = audio_ms;
+		events[*n].text = text;
+		(*n)++;
+	}
+}
+
+/*
+ * Feeds a tap recording through whisper_feed/check_results/get_results the way the core does,
+ * with a loopback server answering from the sidecar, and compares the endpointing against it.
+ * Wall-clock input timers are disabled unless running in real time.
+ */
+static void whisper_replay(const char *file, switch_bool_t realtime, const char *profile, uint32_t tolerance_ms, uint32_t loops,
+						   switch_stream_handle_t *stream)
+{
+	switch_memory_pool_t *pool = NULL;
+	switch_asr_handle_t ah = { 0 };
+	switch_file_handle_t fh = { 0 };
+	switch_asr_flag_t flags = 0;
+	whisper_loopback_t loopback = { 0 };
+	whisper_replay_event_t *expected, *observed;
+	uint32_t nexpected = 0, nobserved = 0, nreplies = 0, mismatches = 0, rate = 8000, audio_ms = 0, frames = 0, i, loop;
+	ks_json_t *sidecar, *list, *report, *jevents, *jmismatch;
+	switch_time_t started, t0, dt, feed_total = 0, feed_max = 0;
+	switch_size_t frame_samples, samples;
+	whisper_t *context;
+	int16_t *frame;
+	char *str;
+
+	if (switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS) {
+		stream->write_function(stream, "-ERR memory\n");
+		return;
+	}
+
+	expected = switch_core_alloc(pool, sizeof(*expected) * REPLAY_MAX_EVENTS);
+	observed = switch_core_alloc(pool, sizeof(*observed) * REPLAY_MAX_EVENTS);
+
+	if ((sidecar = whisper_replay_load_sidecar(file))) {
+		rate = ks_json_get_object_number_int(sidecar, "rate", rate);
+
+		if ((list = ks_json_get_object_item(sidecar, "events"))) {
+			int n = ks_json_get_array_size(list), j;
+
+			loopback.replies = switch_core_alloc(pool, sizeof(char *) * (n + 1));
+
+			for (j = 0; j < n; j++) {
+				ks_json_t *ev = ks_json_get_array_item(list, j);
+				const char *name = ks_json_get_object_string(ev, "event", "");
+				const char *text = ks_json_get_object_string(ev, "text", "");
+				uint32_t ms = ks_json_get_object_number_int(ev, "audio_ms", 0);
+
+				if (!strcmp(name, "result") || !strcmp(name, "speculative_result") || !strcmp(name, "dropped_result")) {
+					loopback.replies[nreplies++] = text;
+				}
+
+				if (!strcmp(name, "start_talking") || !strcmp(name, "result")) {
+					whisper_replay_note(expected, &nexpected, name, ms, text);
+				} else if (!strcmp(name, "stop_talking") || !strcmp(name, "timeout")) {
+					whisper_replay_note(expected, &nexpected, "stop_talking", ms, NULL);
+				}
+			}
+		}
+	}
+	loopback.nreplies = nreplies;
+
+	if (switch_core_file_open(&fh, file, 1, rate, SWITCH_FILE_FLAG_READ | SWITCH_FILE_DATA_SHORT, pool) != SWITCH_STATUS_SUCCESS) {
+		stream->write_function(stream, "-ERR unable to open %s\n", file);
+		goto end;
+	}
+
+	frame_samples = rate * REPLAY_FRAME_MS / 1000;
+	frame = switch_core_alloc(pool, frame_samples * sizeof(int16_t));
+
+	switch_core_memory_pool_set_data(pool, "__whisper_loopback", &loopback);
+	ah.memory_pool = pool;
+	ah.native_rate = ah.rate = ah.samplerate = rate;
+	switch_set_flag(&ah, SWITCH_ASR_FLAG_AUTO_RESUME);
+
+	if (whisper_open(&ah, "L16", rate, NULL, &flags) != SWITCH_STATUS_SUCCESS) {
+		stream->write_function(stream, "-ERR unable to open the recognizer\n");
+		switch_core_file_close(&fh);
+		goto end;
+	}
+
+	context = (whisper_t *) ah.private_info;
+
+	if (!zstr(profile)) {
+		whisper_text_param(&ah, "profile", profile);
+	}
+	if (!realtime) {
+		whisper_text_param(&ah, "start-input-timers", "false");
+		whisper_text_param(&ah, "speech-timeout", "0");
+	}
+
+	started = switch_micro_time_now();
+
+	for (loop = 0; loop < loops; loop++) {
+		if (loop) {
+			unsigned int pos = 0;
+
+			/* later loops only measure the feed path */
+			switch_core_file_seek(&fh, &pos, 0, SEEK_SET);
+			loopback.next = 0;
+		}
+
+		while ((samples = frame_samples) && switch_core_file_read(&fh, frame, &samples) == SWITCH_STATUS_SUCCESS && samples) {
+			uint32_t before = whisper_atomic_get(context->flags), after;
+			char *result = NULL;
+
+			t0 = switch_time_now();
+			whisper_feed(&ah, frame, samples * sizeof(int16_t), &flags);
+			dt = switch_time_now() - t0;
+
+			feed_total += dt;
+			if (dt > feed_max) {
+				feed_max = dt;
+			}
+			frames++;
+			audio_ms += samples * 1000 / rate;
+
+			after = whisper_atomic_get(context->flags);
+			if (!loop && !(before & (ASRFLAG_RESULT_PENDING | ASRFLAG_RESULT_READY)) && (after & (ASRFLAG_RESULT_PENDING | ASRFLAG_RESULT_READY))) {
+				whisper_replay_note(observed, &nobserved, "stop_talking", audio_ms, NULL);
+			}
+
+			if (whisper_check_results(&ah, &flags) == SWITCH_STATUS_SUCCESS) {
+				switch_status_t status = whisper_get_results(&ah, &result, &flags);
+
+				if (!loop && status == SWITCH_STATUS_BREAK) {
+					whisper_replay_note(observed, &nobserved, "start_talking", audio_ms, NULL);
+				} else if (!loop && status == SWITCH_STATUS_SUCCESS) {
+					whisper_replay_note(observed, &nobserved, "result", audio_ms, switch_core_strdup(pool, switch_str_nil(result)));
+				}
+				switch_safe_free(result);
+			}
+
+			if (realtime) {
+				switch_yield(REPLAY_FRAME_MS * 1000);
+			}
+		}
+	}
+
+	whisper_close(&ah, &flags);
+	switch_core_file_close(&fh);
+
+	report = ks_json_create_object();
+	ks_json_add_string_to_object(report, "file", file);
+	ks_json_add_string_to_object(report, "mode", realtime ? "realtime" : "fast");
+	ks_json_add_number_to_object(report, "frames", frames);
+	ks_json_add_number_to_object(report, "audio_ms", audio_ms);
+	ks_json_add_number_to_object(report, "elapsed_ms", (double) (switch_micro_time_now() - started) / 1000);
+	ks_json_add_number_to_object(report, "feed_us_avg", frames ? (double) feed_total / frames : 0);
+	ks_json_add_number_to_object(report, "feed_us_max", (double) feed_max);
+	ks_json_add_number_to_object(report, "audio_bytes_sent", (double) loopback.audio_bytes);
+
+	jevents = ks_json_create_array();
+	jmismatch = ks_json_create_array();
+
+	for (i = 0; i < nobserved || i < nexpected; i++) {
+		whisper_replay_event_t *o = i < nobserved ? &observed[i] : NULL, *e = i < nexpected ? &expected[i] : NULL;
+		ks_json_t *item = ks_json_create_object();
+		const char *why = NULL;
+
+		if (!o || !e) {
+			why = o ? "unexpected" : "missing";
+		} else if (strcmp(o->event, e->event)) {
+			why = "event";
+		} else if ((o->audio_ms > e->audio_ms ? o->audio_ms - e->audio_ms : e->audio_ms - o->audio_ms) > tolerance_ms) {
+			why = "timing";
+		} else if (o->text && e->text && strcmp(o->text, e->text)) {
+			why = "text";
+		}
+
+		if (o) {
+			ks_json_add_string_to_object(item, "event", o->event);
+			ks_json_add_number_to_object(item, "audio_ms", o->audio_ms);
+			if (o->text) {
+				ks_json_add_string_to_object(item, "text", o->text);
 			}
 		}
+		if (e) {
+			ks_json_add_string_to_object(item, "expected", e->event);
+			ks_json_add_number_to_object(item, "expected_ms", e->audio_ms);
+		}
+
+		if (why) {
+			ks_json_add_string_to_object(item, "mismatch", why);
+			ks_json_add_item_to_array(jmismatch, ks_json_create_number(i));
+			mismatches++;
+		}
+
+		ks_json_add_item_to_array(jevents, item);
+	}
+
+	ks_json_add_item_to_object(report, "events", jevents);
+	ks_json_add_item_to_object(report, "mismatches", jmismatch);
+	if (sidecar) {
+		if (mismatches) {
+			ks_json_add_false_to_object(report, "pass");
+		} else {
+			ks_json_add_true_to_object(report, "pass");
+		}
 	}
 
-	return switch_test_flag(context, ASRFLAG_RESULT_READY) || switch_test_flag(context, ASRFLAG_NOINPUT_TIMEOUT) ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_BREAK;
-}
+	if ((str = ks_json_print_unformatted(report))) {
+		stream->write_function(stream, "%s\n", str);
+		free(str);
+	}
+	ks_json_delete(&report);
+
+  end:
+	if (sidecar) {
+		ks_json_delete(&sidecar);
+	}
+	switch_core_destroy_memory_pool(&pool);
+}
+
+/* Bench */
+
+typedef struct {
+	switch_asr_handle_t ah;
+	switch_asr_flag_t flags;
+	whisper_loopback_t loopback;
+	whisper_t *context;
+	uint32_t samples;
+	int16_t *speech;
+	int16_t *silence;
+	uint8_t *frame;
+	switch_buffer_t *tts_buffer;
+} whisper_bench_t;
+
+typedef void (*whisper_bench_op_t)(whisper_bench_t *bench);
 
-static switch_status_t whisper_get_results(switch_asr_handle_t *ah, char **resultstr, switch_asr_flag_t *flags)
+static const char *whisper_bench_reply = "{\"text\": \"bench result\", \"confidence\": 0.9}";
+
+static uint64_t whisper_bench_ns(void)
 {
-	whisper_t *context = (whisper_t *) ah->private_info;
-	switch_status_t status = SWITCH_STATUS_SUCCESS;
+	struct timespec ts;
 
-	if (switch_test_flag(context, ASRFLAG_RETURNED_RESULT) || switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
-		return SWITCH_STATUS_FALSE;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	if (switch_test_flag(context, ASRFLAG_RESULT_READY)) {
-		int is_partial = context->partial-- > 0 ? 1 : 0;
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-		//*resultstr = switch_mprintf("{\"grammar\": \"%s\", \"text\": \"%s\", \"confidence\": %f}", context->grammar, context->result_text, context->result_confidence);
+/* Process-wide, so only meaningful on an otherwise idle switch */
+static int64_t whisper_bench_heap(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	return (int64_t) mallinfo2().uordblks;
+#else
+	return 0;
+#endif
+}
 
-		*resultstr = context->result_text;
+/*
+ * Allocation counter of a harness that wraps malloc (whisper_bench_main.c), the switch
+ * itself does not define it and allocs_per_op is left out of the report.
+ */
+uint64_t whisper_bench_allocs(void) __attribute__((weak));
 
-		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_NOTICE, "%sResult: %s\n", is_partial ? "Partial " : "Final ", *resultstr);
+/* A wsi the harness's lws_write stub accepts; without one the wire stages are left out, lws_write needs a live connection */
+struct lws *whisper_bench_wsi(void) __attribute__((weak));
 
-		if (is_partial) {
-			status = SWITCH_STATUS_MORE_DATA;
-		} else {
-			status = SWITCH_STATUS_SUCCESS;
-		}
-	} else if (switch_test_flag(context, ASRFLAG_NOINPUT_TIMEOUT)) {
-		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Result: NO INPUT\n");
+static int whisper_bench_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
 
-		*resultstr = switch_mprintf("{\"grammar\": \"%s\", \"text\": \"\", \"confidence\": 0, \"error\": \"no_input\"}", context->grammar);
+	return x < y ? -1 : x > y;
+}
 
-		status = SWITCH_STATUS_SUCCESS;
-	} else if (!switch_test_flag(context, ASRFLAG_RETURNED_START_OF_SPEECH) && switch_test_flag(context, ASRFLAG_START_OF_SPEECH)) {
-		switch_set_flag(context, ASRFLAG_RETURNED_START_OF_SPEECH);
-		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Result: START OF SPEECH\n");
-		status = SWITCH_STATUS_BREAK;
-	} else {
-		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_ERROR, "Unexpected call to asr_get_results - no results to return!\n");
-		status = SWITCH_STATUS_FALSE;
-	}
+/* VAD decision and the adaptive score, what every frame pays before anything is sent */
+static void whisper_bench_vad(whisper_bench_t *bench)
+{
+	switch_vad_process(bench->context->vad, bench->speech, bench->samples);
+	whisper_vad_score(bench->context, bench->speech, bench->samples);
+}
 
-	if (status == SWITCH_STATUS_SUCCESS) {
-		switch_set_flag(context, ASRFLAG_RETURNED_RESULT);
-		switch_clear_flag(context, ASRFLAG_READY);
+/* An utterance ended by the bench audio is resumed at once, like SWITCH_ASR_FLAG_AUTO_RESUME */
+static void whisper_bench_feed(whisper_bench_t *bench, int16_t *data)
+{
+	if (!whisper_flag_test(bench->context, ASRFLAG_READY)) {
+		whisper_reset_vad(bench->context);
 	}
+	whisper_feed(&bench->ah, data, bench->samples * sizeof(int16_t), &bench->flags);
+}
 
-	return status;
+static void whisper_bench_feed_silence(whisper_bench_t *bench)
+{
+	whisper_bench_feed(bench, bench->silence);
 }
 
-static switch_status_t whisper_start_input_timers(switch_asr_handle_t *ah)
+static void whisper_bench_feed_speech(whisper_bench_t *bench)
 {
-	whisper_t *context = (whisper_t *) ah->private_info;
+	whisper_bench_feed(bench, bench->speech);
+}
 
-	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "asr_start_input_timers attempt on CLOSED asr handle\n");
-		return SWITCH_STATUS_FALSE;
-	}
+/* The talking branch of whisper_feed without the VAD: buffer write, block read into send_buf, send */
+static void whisper_bench_asr_send(whisper_bench_t *bench)
+{
+	whisper_t *context = bench->context;
+	uint8_t *buf = context->send_buf + LWS_PRE;
 
-	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "start_input_timers\n");
+	switch_buffer_write(context->audio_buffer, bench->speech, bench->samples * sizeof(int16_t));
 
-	if (!switch_test_flag(context, ASRFLAG_INPUT_TIMERS)) {
-		switch_set_flag(context, ASRFLAG_INPUT_TIMERS);
-		context->no_input_time = switch_micro_time_now();
-	} else {
-		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_INFO, "Input timers already started\n");
+	if (switch_buffer_inuse(context->audio_buffer) > AUDIO_BLOCK_SIZE) {
+		whisper_send_audio(context, buf, switch_buffer_read(context->audio_buffer, buf, AUDIO_BLOCK_SIZE));
 	}
-
-	return SWITCH_STATUS_SUCCESS;
 }
 
-static void whisper_text_param(switch_asr_handle_t *ah, char *param, const char *val)
+/* asr_send on a per-call connection: LWS_PRE framing and lws_write, with pacing the header, queue and the service thread's write */
+static void whisper_bench_wire_send(whisper_bench_t *bench)
 {
-	whisper_t *context = (whisper_t *) ah->private_info;
-
-	if (!zstr(param) && !zstr(val)) {
-		int nval = atoi(val);
-		double fval = atof(val);
+	whisper_t *context = bench->context;
 
-		if (!strcasecmp("no-input-timeout", param) && switch_is_number(val)) {
-			context->no_input_timeout = nval;
-			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "no-input-timeout = %d\n", context->no_input_timeout);
-		} else if (!strcasecmp("speech-timeout", param) && switch_is_number(val)) {
-			context->speech_timeout = nval;
-			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "speech-timeout = %d\n", context->speech_timeout);
-		} else if (!strcasecmp("start-input-timers", param)) {
-			context->start_input_timers = switch_true(val);
-			if (context->start_input_timers) {
-				switch_set_flag(context, ASRFLAG_INPUT_TIMERS);
-			} else {
-				switch_clear_flag(context, ASRFLAG_INPUT_TIMERS);
-			}
-			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "start-input-timers = %d\n", context->start_input_timers);
-		} else if (!strcasecmp("vad-mode", param)) {
-			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "vad-mode = %s\n", val);
-			if (context->vad) switch_vad_set_mode(context->vad, nval);
-		} else if (!strcasecmp("vad-voice-ms", param) && nval > 0) {
-			context->voice_ms = nval;
-			switch_vad_set_param(context->vad, "voice_ms", nval);
-		} else if (!strcasecmp("vad-silence-ms", param) && nval > 0) {
-			context->silence_ms = nval;
-			switch_vad_set_param(context->vad, "silence_ms", nval);
-		} else if (!strcasecmp("vad-thresh", param) && nval > 0) {
-			context->thresh = nval;
-			switch_vad_set_param(context->vad, "thresh", nval);
-		} else if (!strcasecmp("channel-uuid", param)) {
-			context->channel_uuid = switch_core_strdup(ah->memory_pool, val);
-			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "channel-uuid = %s\n", val);
-		} else if (!strcasecmp("result", param)) {
-			context->result_text = switch_core_strdup(ah->memory_pool, val);
-			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "result = %s\n", val);
-		} else if (!strcasecmp("confidence", param) && fval >= 0.0) {
-			context->result_confidence = fval;
-			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "confidence = %f\n", fval);
-		} else if (!strcasecmp("partial", param) && switch_true(val)) {
-			context->partial = 3;
-			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "partial = %d\n", context->partial);
-		}
+	/* runs faster than real time, every block is due at once */
+	context->pace.epoch = 0;
+	whisper_bench_asr_send(bench);
+	if (context->pace.catchup) {
+		whisper_pace_write_next(context);
 	}
 }
 
-/* TTS Interface */
-
-static switch_status_t whisper_speech_open(switch_speech_handle_t *sh, const char *voice_name, int rate, int channels, switch_speech_flag_t *flags)
+/* eof, the reply going through whisper_asr_receive_text, get_results and the resume */
+static void whisper_bench_result(whisper_bench_t *bench)
 {
-	whisper_tts_t *context = switch_core_alloc(sh->memory_pool, sizeof(whisper_tts_t));
-	switch_status_t status = SWITCH_STATUS_FALSE;
-	switch_event_t *event = NULL;
-	char * tts_server = NULL;
-	char * session_uuid =  NULL;
+	char *result = NULL;
+
+	bench->loopback.next = 0;
+	whisper_flag_transition(bench->context, ASRFLAG_READY, ASRFLAG_READY, ASRFLAG_RESULT_PENDING);
+	whisper_get_final_transcription(bench->context, ASR_REPLY_FINAL);
+	whisper_get_results(&bench->ah, &result, &bench->flags);
+	switch_safe_free(result);
+	whisper_reset_vad(bench->context);
+}
 
-	/* check if session is associated w/ this memory pool */
-	switch_core_session_t *session = switch_core_memory_pool_get_data(sh->memory_pool, "__session");
-	if (session) {
-		session_uuid = switch_core_session_get_uuid(session);
-	}
-	
-	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "session-uuid = %s\n", session_uuid);
-	switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, "whisper::tts_open");
-	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "WHISPER-voice", voice_name);
-	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "WHISPER-uuid", session_uuid);
-	switch_event_fire(&event);
+/* One server chunk in and one frame out of a TTS buffer kept at low-water */
+static void whisper_bench_tts_buffer(whisper_bench_t *bench)
+{
+	switch_size_t bytes = bench->samples * sizeof(int16_t);
 
-	switch_assert(context);
+	switch_buffer_write(bench->tts_buffer, bench->speech, bytes);
+	switch_buffer_read(bench->tts_buffer, bench->frame, bytes);
+}
 
-    if ( voice_name ) {
-        context->voice = switch_core_strdup(sh->memory_pool, voice_name);
-    } else {
-        context->voice = "default";
-    }
+static void whisper_bench_run(whisper_bench_t *bench, const char *stage, whisper_bench_op_t op, uint32_t rate, uint32_t frame_ms, uint32_t ops,
+							  uint64_t *ns, ks_json_t *results)
+{
+	uint64_t overflows, allocs = 0, total = 0, t0;
+	uint32_t i, warmup = ops / 10 < BENCH_WARMUP ? ops / 10 : BENCH_WARMUP;
+	ks_json_t *item;
+	int64_t heap;
 
-	context->samplerate = sh->samplerate;
-	
-	context->pool = sh->memory_pool;
+	for (i = 0; i < warmup; i++) {
+		op(bench);
+	}
 
-	switch_buffer_create_dynamic(&context->audio_buffer, SPEECH_BUFFER_SIZE, SPEECH_BUFFER_SIZE, SPEECH_BUFFER_SIZE_MAX);
+	overflows = whisper_atomic_get(whisper_globals.asr_slabs.overflows);
+	heap = whisper_bench_heap();
+	if (whisper_bench_allocs) {
+		allocs = whisper_bench_allocs();
+	}
 
-	sh->private_info = context;
+	for (i = 0; i < ops; i++) {
+		t0 = whisper_bench_ns();
+		op(bench);
+		ns[i] = whisper_bench_ns() - t0;
+		total += ns[i];
+	}
 
-	tts_server = switch_core_strdup(whisper_globals.pool, whisper_globals.tts_server_url);
+	heap = whisper_bench_heap() - heap;
+	if (whisper_bench_allocs) {
+		allocs = whisper_bench_allocs() - allocs;
+	}
+	overflows = whisper_atomic_get(whisper_globals.asr_slabs.overflows) - overflows;
 
-	status = ws_tts_setup_connection(tts_server, context, whisper_globals.pool);
+	qsort(ns, ops, sizeof(*ns), whisper_bench_cmp);
 
-	return status;
+	item = ks_json_create_object();
+	ks_json_add_string_to_object(item, "stage", stage);
+	ks_json_add_number_to_object(item, "rate", rate);
+	if (frame_ms) {
+		ks_json_add_number_to_object(item, "frame_ms", frame_ms);
+	}
+	ks_json_add_number_to_object(item, "ops", ops);
+	ks_json_add_number_to_object(item, "ns_avg", (double) total / ops);
+	ks_json_add_number_to_object(item, "ns_p50", (double) ns[ops / 2]);
+	ks_json_add_number_to_object(item, "ns_p99", (double) ns[(uint64_t) ops * 99 / 100]);
+	ks_json_add_number_to_object(item, "ns_max", (double) ns[ops - 1]);
+	ks_json_add_number_to_object(item, "heap_bytes_per_op", (double) heap / ops);
+	if (whisper_bench_allocs) {
+		ks_json_add_number_to_object(item, "allocs_per_op", (double) allocs / ops);
+	}
+	ks_json_add_number_to_object(item, "arena_overflows_per_op", (double) overflows / ops);
+	ks_json_add_item_to_array(results, item);
 }
 
-static switch_status_t whisper_speech_close(switch_speech_handle_t *sh, switch_speech_flag_t *flags)
+/* One loopback recognizer per rate and frame size, fresh so no stage inherits another's VAD state */
+static switch_status_t whisper_bench_point(uint32_t rate, uint32_t frame_ms, uint32_t iterations, switch_bool_t results_stage, uint64_t *ns,
+										   ks_json_t *results)
 {
-	whisper_tts_t *context = (whisper_tts_t *) sh->private_info;
-
-	ws_tts_close_connection(context);
+	switch_memory_pool_t *pool = NULL;
+	whisper_bench_t bench = { { 0 } };
+	switch_size_t tts_size = TTS_LOW_WATER_DEFAULT + TTS_DECODE_BUFFER_SIZE;
+	uint32_t i, result_ops;
 
-	if ( context->audio_buffer ) {
-		switch_buffer_destroy(&context->audio_buffer);
+	if (switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS) {
+		return SWITCH_STATUS_MEMERR;
 	}
 
-	return SWITCH_STATUS_SUCCESS;
-}
+	bench.samples = rate * frame_ms / 1000;
+	bench.speech = switch_core_alloc(pool, bench.samples * sizeof(int16_t));
+	bench.silence = switch_core_alloc(pool, bench.samples * sizeof(int16_t));
+	bench.frame = switch_core_alloc(pool, bench.samples * sizeof(int16_t));
 
-static switch_status_t whisper_speech_feed_tts(switch_speech_handle_t *sh, char *text, switch_speech_flag_t *flags)
-{
-	whisper_tts_t *context = (whisper_tts_t *)sh->private_info;
+	/* loud enough for the VAD at any threshold the settings allow */
+	for (i = 0; i < bench.samples; i++) {
+		bench.speech[i] = (int16_t) (8000 * sin(2 * M_PI * 300 * i / rate) + 4000 * sin(2 * M_PI * 1100 * i / rate));
+	}
+
+	switch_buffer_create_partition(pool, &bench.tts_buffer, switch_core_alloc(pool, tts_size), tts_size);
+	while (switch_buffer_inuse(bench.tts_buffer) < TTS_LOW_WATER_DEFAULT) {
+		switch_buffer_write(bench.tts_buffer, bench.silence, bench.samples * sizeof(int16_t));
+	}
 
-	unsigned char buffer[LWS_SEND_BUFFER_PRE_PADDING + strlen(text) + LWS_SEND_BUFFER_POST_PADDING];
-	unsigned char *p = &buffer[LWS_SEND_BUFFER_PRE_PADDING];
+	bench.loopback.replies = &whisper_bench_reply;
+	bench.loopback.nreplies = 1;
+	switch_core_memory_pool_set_data(pool, "__whisper_loopback", &bench.loopback);
+	bench.ah.memory_pool = pool;
+	bench.ah.native_rate = bench.ah.rate = bench.ah.samplerate = rate;
 
-	if (switch_true(switch_core_get_variable("mod_whisper_tts_must_have_channel_uuid")) && zstr(context->channel_uuid)) {
+	if (whisper_open(&bench.ah, "L16", rate, NULL, &bench.flags) != SWITCH_STATUS_SUCCESS) {
+		switch_core_destroy_memory_pool(&pool);
 		return SWITCH_STATUS_FALSE;
 	}
 
-	if (!zstr(text)) {
-		context->text = switch_core_strdup(sh->memory_pool, text);
+	bench.context = (whisper_t *) bench.ah.private_info;
+	whisper_text_param(&bench.ah, "start-input-timers", "false");
+	whisper_text_param(&bench.ah, "speech-timeout", "0");
+
+	whisper_bench_run(&bench, "vad", whisper_bench_vad, rate, frame_ms, iterations, ns, results);
+	whisper_reset_vad(bench.context);
+	whisper_bench_run(&bench, "feed_silence", whisper_bench_feed_silence, rate, frame_ms, iterations, ns, results);
+	whisper_reset_vad(bench.context);
+	whisper_bench_run(&bench, "feed_speech", whisper_bench_feed_speech, rate, frame_ms, iterations, ns, results);
+	whisper_reset_vad(bench.context);
+	whisper_bench_run(&bench, "asr_send", whisper_bench_asr_send, rate, frame_ms, iterations, ns, results);
+
+	if (whisper_bench_wsi) {
+		whisper_loopback_t *loopback = bench.context->loopback;
+		uint32_t catchup = bench.context->pace.catchup;
+		int started = whisper_atomic_get(bench.context->started);
+
+		/* a live per-call connection as far as the send path can tell */
+		bench.context->loopback = NULL;
+		bench.context->wsi = whisper_bench_wsi();
+		whisper_atomic_set(bench.context->started, WS_STATE_STARTED);
+		bench.context->pace.catchup = 0;
+		whisper_bench_run(&bench, "ws_send", whisper_bench_wire_send, rate, frame_ms, iterations, ns, results);
+		bench.context->pace.catchup = 1;
+		whisper_bench_run(&bench, "ws_send_paced", whisper_bench_wire_send, rate, frame_ms, iterations, ns, results);
+		bench.context->pace.catchup = catchup;
+		whisper_atomic_set(bench.context->started, started);
+		bench.context->wsi = NULL;
+		bench.context->loopback = loopback;
 	}
+	whisper_bench_run(&bench, "tts_buffer", whisper_bench_tts_buffer, rate, frame_ms, iterations, ns, results);
 
-	memcpy(p, context->text, strlen(context->text));
+	if (results_stage) {
+		/* logs every result, so far fewer of them */
+		result_ops = iterations / BENCH_RESULT_EVERY > 10 ? iterations / BENCH_RESULT_EVERY : 10;
+		if (result_ops > iterations) {
+			result_ops = iterations;
+		}
+		whisper_reset_vad(bench.context);
+		whisper_bench_run(&bench, "result", whisper_bench_result, rate, 0, result_ops, ns, results);
+	}
 
-	if (lws_write(context->wsi, p, strlen(context->text), LWS_WRITE_TEXT) < 0) {
-		fprintf(stderr, "Error writing to socket\n");
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "Unable to write message\n");
-		return -1;
-	}		
+	whisper_close(&bench.ah, &bench.flags);
+	switch_core_destroy_memory_pool(&pool);
 
-	while ( (!context->audio_buffer || switch_buffer_inuse(context->audio_buffer) == 0) && context->started == WS_STATE_STARTED ) {
-		usleep(30000);
-	}
 	return SWITCH_STATUS_SUCCESS;
 }
 
-static switch_status_t whisper_speech_read_tts(switch_speech_handle_t *sh, void *data, switch_size_t *datalen, switch_speech_flag_t *flags)
+static uint32_t whisper_bench_list(const char *arg, uint32_t *out, uint32_t min, uint32_t max)
 {
-	whisper_tts_t *context = (whisper_tts_t *)sh->private_info;
-	size_t bytes_read;
-	
-	if ( (bytes_read = switch_buffer_read(context->audio_buffer, data, *datalen)) ) {
-		*datalen = bytes_read ;
-		return SWITCH_STATUS_SUCCESS;
+	char *mydata = strdup(arg), *argv[BENCH_MAX_POINTS] = { 0 };
+	int argc = switch_separate_string(mydata, ',', argv, BENCH_MAX_POINTS), i;
+	uint32_t n = 0;
+
+	for (i = 0; i < argc; i++) {
+		int v = atoi(argv[i]);
+
+		if (v >= (int) min && v <= (int) max) {
+			out[n++] = v;
+		}
 	}
-	return SWITCH_STATUS_FALSE;
+
+	switch_safe_free(mydata);
+
+	return n;
 }
 
-static void whisper_speech_flush_tts(switch_speech_handle_t *sh)
+/*
+ * Times the per-frame paths on loopback recognizers: VAD, whisper_feed in silence and in speech,
+ * the buffer/send step on its own, result handling and the TTS buffer, for every rate and frame size.
+ * The ws_send stages need the standalone harness, which stubs lws_write.
+ */
+static void whisper_bench(uint32_t iterations, const char *rates_arg, const char *frames_arg, switch_stream_handle_t *stream)
 {
-	whisper_tts_t *context = (whisper_tts_t *) sh->private_info;
+	uint32_t rates[BENCH_MAX_POINTS] = { 8000, 16000 }, frames[BENCH_MAX_POINTS] = { 10, 20, 40 };
+	uint32_t nrates = 2, nframes = 3, r, f;
+	ks_json_t *report, *results;
+	switch_time_t started = switch_micro_time_now();
+	uint64_t *ns;
+	char *str;
+
+	if (rates_arg && !(nrates = whisper_bench_list(rates_arg, rates, 8000, 48000))) {
+		stream->write_function(stream, "-ERR rates are 8000 to 48000\n");
+		return;
+	}
+	if (frames_arg && !(nframes = whisper_bench_list(frames_arg, frames, 10, 100))) {
+		stream->write_function(stream, "-ERR frames are 10 to 100 ms\n");
+		return;
+	}
 
-	if ( context->audio_buffer ) {
-	    switch_buffer_zero(context->audio_buffer);
+	if (!(ns = malloc(sizeof(*ns) * iterations))) {
+		stream->write_function(stream, "-ERR memory\n");
+		return;
 	}
-}
 
-static void whisper_speech_text_param_tts(switch_speech_handle_t *sh, char *param, const char *val)
-{
-	whisper_tts_t *context = (whisper_tts_t *)sh->private_info;
-	if (!zstr(param) && !zstr(val)) {
-		if (!strcasecmp("channel-uuid", param)) {
-			context->channel_uuid = switch_core_strdup(sh->memory_pool, val);
-			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "channel-uuid = %s\n", val);
+	report = ks_json_create_object();
+	results = ks_json_create_array();
+
+	for (r = 0; r < nrates; r++) {
+		for (f = 0; f < nframes; f++) {
+			if (whisper_bench_point(rates[r], frames[f], iterations, f == 0, ns, results) != SWITCH_STATUS_SUCCESS) {
+				stream->write_function(stream, "-ERR unable to open a recognizer at %uHz\n", rates[r]);
+				goto end;
+			}
 		}
 	}
-}
 
-static void whisper_speech_numeric_param_tts(switch_speech_handle_t *sh, char *param, int val)
-{
-}
+	ks_json_add_number_to_object(report, "iterations", iterations);
+	ks_json_add_number_to_object(report, "block_size", AUDIO_BLOCK_SIZE);
+	ks_json_add_number_to_object(report, "elapsed_ms", (double) (switch_micro_time_now() - started) / 1000);
+	ks_json_add_item_to_object(report, "results", results);
+	results = NULL;
 
-static void whisper_speech_float_param_tts(switch_speech_handle_t *sh, char *param, double val)
-{
+	if ((str = ks_json_print_unformatted(report))) {
+		stream->write_function(stream, "%s\n", str);
+		free(str);
+	}
+
+  end:
+	if (results) {
+		ks_json_delete(&results);
+	}
+	ks_json_delete(&report);
+	free(ns);
 }
 
-static switch_status_t load_config(void)
+#define WHISPER_API_SYNTAX "status | reload | routes | prefetch <uuid> " WHISPER_PREFETCH_SYNTAX " | replay <file.wav> [fast|realtime] [profile=<name>] [tolerance=<ms>] [loops=<n>] | bench [iterations=<n>] [rates=<hz,...>] [frames=<ms,...>]"
+
+SWITCH_STANDARD_API(whisper_api_function)
 {
-	char *cf = "whisper.conf";
-	switch_xml_t cfg, xml = NULL, param, settings;
-	switch_status_t status = SWITCH_STATUS_SUCCESS;
+	whisper_settings_t *settings;
 
-	if (!(xml = switch_xml_open_cfg(cf, &cfg, NULL))) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Open of %s failed\n", cf);
-		status = SWITCH_STATUS_FALSE;
-		goto done;
+	if (zstr(cmd)) {
+		stream->write_function(stream, "-USAGE: %s\n", WHISPER_API_SYNTAX);
+		return SWITCH_STATUS_SUCCESS;
 	}
 
-
-	if ((settings = switch_xml_child(cfg, "settings"))) {
-		for (param = switch_xml_child(settings, "param"); param; param = param->next) {
-			char *var = (char *) switch_xml_attr_soft(param, "name");
-			char *val = (char *) switch_xml_attr_soft(param, "value");
-			if (!strcasecmp(var, "asr-server-url")) {
-				whisper_globals.asr_server_url = switch_core_strdup(whisper_globals.pool, val);
-			}
-			if (!strcasecmp(var, "tts-server-url")) {
-				whisper_globals.tts_server_url = switch_core_strdup(whisper_globals.pool, val);
+	if (!strncasecmp(cmd, "replay ", 7)) {
+		char *mydata = strdup(cmd + 7), *argv[8] = { 0 };
+		int argc = switch_separate_string(mydata, ' ', argv, (sizeof(argv) / sizeof(argv[0]))), i;
+		switch_bool_t realtime = SWITCH_FALSE;
+		uint32_t tolerance_ms = REPLAY_TOLERANCE_MS_DEFAULT, loops = 1;
+		const char *profile = NULL;
+
+		for (i = 1; i < argc; i++) {
+			if (!strcasecmp(argv[i], "realtime")) {
+				realtime = SWITCH_TRUE;
+			} else if (!strncasecmp(argv[i], "profile=", 8)) {
+				profile = argv[i] + 8;
+			} else if (!strncasecmp(argv[i], "tolerance=", 10)) {
+				tolerance_ms = atoi(argv[i] + 10);
+			} else if (!strncasecmp(argv[i], "loops=", 6) && atoi(argv[i] + 6) > 0) {
+				loops = atoi(argv[i] + 6);
 			}
-			if (!strcasecmp(var, "return-json")) {
-				whisper_globals.return_json = atoi(val);
+		}
+
+		if (argc < 1 || zstr(argv[0])) {
+			stream->write_function(stream, "-USAGE: %s\n", WHISPER_API_SYNTAX);
+		} else {
+			whisper_replay(argv[0], realtime, profile, tolerance_ms, loops, stream);
+		}
+
+		switch_safe_free(mydata);
+	} else if (!strcasecmp(cmd, "bench") || !strncasecmp(cmd, "bench ", 6)) {
+		char *mydata = strdup(cmd + 5), *argv[8] = { 0 };
+		int argc = switch_separate_string(mydata, ' ', argv, (sizeof(argv) / sizeof(argv[0]))), i;
+		uint32_t iterations = BENCH_ITERATIONS_DEFAULT;
+		const char *rates = NULL, *frames = NULL;
+
+		for (i = 0; i < argc; i++) {
+			if (!strncasecmp(argv[i], "iterations=", 11) && atoi(argv[i] + 11) > 0) {
+				iterations = atoi(argv[i] + 11) < BENCH_ITERATIONS_MAX ? atoi(argv[i] + 11) : BENCH_ITERATIONS_MAX;
+			} else if (!strncasecmp(argv[i], "rates=", 6)) {
+				rates = argv[i] + 6;
+			} else if (!strncasecmp(argv[i], "frames=", 7)) {
+				frames = argv[i] + 7;
 			}
 		}
-	}
 
-  done:
-	if (!whisper_globals.asr_server_url) {
-		whisper_globals.asr_server_url = switch_core_strdup(whisper_globals.pool, "ws://127.0.0.1:2700");
-	}
-	if (!whisper_globals.tts_server_url) {
-		whisper_globals.tts_server_url = switch_core_strdup(whisper_globals.pool, "ws://127.0.0.1:2600");
-	}
-	if (xml) {
-		switch_xml_free(xml);
-	}
+		whisper_bench(iterations, rates, frames, stream);
 
-	return status;
-}
+		switch_safe_free(mydata);
+	} else if (!strncasecmp(cmd, "prefetch ", 9)) {
+		char *mydata = strdup(cmd + 9), *texts;
+		switch_core_session_t *psession = NULL;
+		uint32_t queued;
 
-static void do_load(void)
-{
-	switch_mutex_lock(MUTEX);
-	load_config();
-	switch_mutex_unlock(MUTEX);
-}
+		if ((texts = strchr(mydata, ' '))) {
+			*texts++ = '\0';
+		}
 
-static void event_handler(switch_event_t *event)
-{
-	if (whisper_globals.auto_reload) {
-		do_load();
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Whisper Reloaded\n");
+		if (zstr(texts)) {
+			stream->write_function(stream, "-USAGE: %s\n", WHISPER_API_SYNTAX);
+		} else if (!(psession = switch_core_session_locate(mydata))) {
+			stream->write_function(stream, "-ERR no such channel %s\n", mydata);
+		} else if (whisper_prefetch_start(psession, texts, &queued) != SWITCH_STATUS_SUCCESS) {
+			stream->write_function(stream, "-ERR prefetch not started\n");
+		} else {
+			stream->write_function(stream, "+OK %u prompts queued\n", queued);
+		}
+
+		if (psession) {
+			switch_core_session_rwunlock(psession);
+		}
+		switch_safe_free(mydata);
+	} else if (!strcasecmp(cmd, "status")) {
+		whisper_status_report(stream);
+	} else if (!strcasecmp(cmd, "routes")) {
+		whisper_routes_report(stream);
+	} else if (!strcasecmp(cmd, "reload")) {
+		if (do_load() != SWITCH_STATUS_SUCCESS) {
+			stream->write_function(stream, "-ERR reload failed, keeping the current settings\n");
+		} else if ((settings = whisper_settings_acquire())) {
+			stream->write_function(stream, "+OK settings version %u\n", settings->version);
+			whisper_settings_release(&settings);
+		}
+	} else {
+		stream->write_function(stream, "-USAGE: %s\n", WHISPER_API_SYNTAX);
 	}
+
+	return SWITCH_STATUS_SUCCESS;
 }
 
 SWITCH_MODULE_LOAD_FUNCTION(mod_whisper_load)
 {
 	switch_asr_interface_t *asr_interface;
 	switch_speech_interface_t *speech_interface;
+	switch_api_interface_t *api_interface;
+	switch_application_interface_t *app_interface;
 
 	switch_mutex_init(&MUTEX, SWITCH_MUTEX_NESTED, pool);
 
 	whisper_globals.pool = pool;
+	whisper_globals.grammar_max_size = GRAMMAR_MAX_SIZE_DEFAULT;
+	switch_mutex_init(&whisper_globals.settings_mutex, SWITCH_MUTEX_NESTED, pool);
+	/* plain mutex, waiters sleep on it with a condition */
+	switch_mutex_init(&whisper_globals.endpoint_mutex, SWITCH_MUTEX_DEFAULT, pool);
+	switch_core_hash_init(&whisper_globals.endpoints);
+	switch_core_hash_init(&whisper_globals.route_stats);
+	whisper_slab_pool_init(&whisper_globals.asr_slabs, ASR_SLAB_SIZE, ARENA_CACHE_SLABS_DEFAULT, pool);
+	whisper_slab_pool_init(&whisper_globals.tts_slabs, whisper_tts_slab_size(TTS_HIGH_WATER_DEFAULT), ARENA_CACHE_SLABS_DEFAULT, pool);
+	switch_mutex_init(&whisper_globals.stats_mutex, SWITCH_MUTEX_NESTED, pool);
+	switch_mutex_init(&whisper_globals.watch_mutex, SWITCH_MUTEX_NESTED, pool);
+	switch_mutex_init(&whisper_globals.tls_mutex, SWITCH_MUTEX_NESTED, pool);
+	switch_core_hash_init(&whisper_globals.tls_sessions);
+	whisper_cpu_nodes_load();
+	whisper_atomic_set(whisper_globals.running, 1);
+	switch_mutex_init(&whisper_globals.grammar_mutex, SWITCH_MUTEX_NESTED, pool);
+	whisper_grammar_cache_flush();
 
 	// ks_init();
 
@@ -741,8 +3935,15 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_whisper_load)
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Couldn't bind!\n");
 	}
 
+	whisper_mux_init(pool);
+	whisper_stage_init(pool);
 	do_load();
 
+	if (whisper_tap_start(pool) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Unable to start the ASR tap writer, recording is disabled\n");
+	}
+	whisper_reconnect_start(pool);
+
 	*module_interface = switch_loadable_module_create_module_interface(pool, modname);
 
 	asr_interface = switch_loadable_module_create_interface(*module_interface, SWITCH_ASR_INTERFACE);
@@ -771,21 +3972,83 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_whisper_load)
 	speech_interface->speech_numeric_param_tts = whisper_speech_numeric_param_tts;
 	speech_interface->speech_float_param_tts = whisper_speech_float_param_tts;
 
+	SWITCH_ADD_APP(app_interface, "whisper_tts_prefetch", "Prefetch TTS prompts", "Synthesize the listed prompts in the background so a later speak of them starts at once",
+				   whisper_prefetch_app, WHISPER_PREFETCH_SYNTAX, SAF_NONE);
+
+	SWITCH_ADD_API(api_interface, "whisper", "Whisper control", whisper_api_function, WHISPER_API_SYNTAX);
+	switch_console_set_complete("add whisper status");
+	switch_console_set_complete("add whisper reload");
+	switch_console_set_complete("add whisper routes");
+	switch_console_set_complete("add whisper prefetch ::console::list_uuid");
+	switch_console_set_complete("add whisper replay");
+	switch_console_set_complete("add whisper bench");
+
 
 	return SWITCH_STATUS_SUCCESS;
 }
 
 SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_whisper_shutdown)
 {
+	uint32_t waited, threads;
+
 	// ks_pool_close(&whisper_globals.ks_pool);
 	// ks_shutdown();
 
+	/* the loader joins the runtime thread after this returns */
+	whisper_atomic_set(whisper_globals.running, 0);
 	switch_event_unbind(&NODE);
+
+	whisper_tap_stop();
+	whisper_reconnect_stop();
+	whisper_mux_shutdown();
+
+	/* prefetch threads notice running == 0 at the next read, one still connecting only after its handshake */
+	for (waited = 0; whisper_atomic_get(whisper_globals.prefetch_threads) && waited < PREFETCH_SHUTDOWN_MS; waited += PREFETCH_POLL_MS) {
+		whisper_prefetch_abort();
+		switch_yield(PREFETCH_POLL_MS * 1000);
+	}
+
+	if ((threads = whisper_atomic_get(whisper_globals.prefetch_threads))) {
+		/* they still run this code and use the state below */
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "%u TTS prefetch threads still running, keeping mod_whisper loaded\n", threads);
+		return SWITCH_STATUS_NOUNLOAD;
+	}
+
+	/* stages of channels still up are freed here, the channel destroy hook goes with the module */
+	whisper_stage_shutdown();
+
+	/* every connection saved its session by now */
+	ws_tls_session_flush();
+	switch_core_hash_destroy(&whisper_globals.tls_sessions);
+
+	switch_mutex_lock(whisper_globals.grammar_mutex);
+	whisper_grammar_cache_destroy();
+	switch_mutex_unlock(whisper_globals.grammar_mutex);
+
+	whisper_slab_pool_destroy(&whisper_globals.asr_slabs);
+	whisper_slab_pool_destroy(&whisper_globals.tts_slabs);
+
+	switch_mutex_lock(whisper_globals.endpoint_mutex);
+	switch_core_hash_destroy(&whisper_globals.endpoints);
+	switch_core_hash_destroy(&whisper_globals.route_stats);
+	switch_mutex_unlock(whisper_globals.endpoint_mutex);
+
+	switch_console_set_complete("del whisper");
+
+	switch_mutex_lock(whisper_globals.settings_mutex);
+	whisper_settings_release(&whisper_globals.settings);
+	switch_mutex_unlock(whisper_globals.settings_mutex);
+
 	return SWITCH_STATUS_SUCCESS;
 }
 
 SWITCH_MODULE_RUNTIME_FUNCTION(mod_whisper_runtime)
 {
+	while (whisper_atomic_get(whisper_globals.running)) {
+		whisper_watchdog_scan();
+		switch_yield(WATCHDOG_INTERVAL_MS * 1000);
+	}
+
 	return SWITCH_STATUS_TERM;
 }
 
@@ -1,27 +1,578 @@
 #ifndef MOD_WHISPER_H
 #define MOD_WHISPER_H
 
-#include <httpd.h>
-#include <http_config.h>
-#include <http_protocol.h>
-#include <http_log.h>
-#include <ap_config.h>
-
-// 模块配置结构
-typedef struct {
-	char *asr_path;     // ASR路径
-	char *tts_path;     // TTS路径
-	int asr_port;       // ASR端口
-	int tts_port;       // TTS端口
-} whisper_config;
-
-// 处理函数声明
-static int handle_asr_request(request_rec *r);
-static int handle_tts_request(request_rec *r);
-
-// 配置相关函数声明
-static void *create_whisper_config(apr_pool_t *pool, char *context);
-static const char *set_whisper_path(cmd_parms *cmd, void *cfg, const char *arg);
-static const char *set_whisper_port(cmd_parms *cmd, void *cfg, const char *arg);
+#include <switch.h>
+#include <libks/ks.h>
+#include <libwebsockets.h>
+
+#define AUDIO_BLOCK_SIZE 3200
+#define SPEECH_BUFFER_SIZE 49152
+#define SPEECH_BUFFER_SIZE_MAX 4 * 1024 * 1024
+#define RX_BUFFER_SIZE 16000
+#define WS_TIMEOUT_MS 50
+
+// TTS 缓冲区水位, 超过高水位暂停从 socket 读取, 低于低水位恢复
+#define TTS_HIGH_WATER_DEFAULT 192000
+#define TTS_LOW_WATER_DEFAULT 64000
+
+// 长文本按句切分成多个请求流水线发送, 最多 tts-pipeline-depth 个未完成; 首段在第一个分句处就切开
+#define TTS_CHUNK_MAX_CHARS_DEFAULT 80
+#define TTS_CHUNK_MIN_CHARS 6
+#define TTS_PIPELINE_DEPTH_DEFAULT 2
+#define TTS_PIPELINE_DEPTH_MAX 16
+
+// 解码后的音频是收到数据的两倍 (PCMU/PCMA)
+#define TTS_DECODE_BUFFER_SIZE (RX_BUFFER_SIZE * 2)
+#define TTS_FRAME_MS_DEFAULT 20
+
+// 自适应 VAD: 最小值统计估计噪声底, 阈值 = max(vad-thresh, 噪声底 * 比例)
+#define VAD_ADAPTIVE_WINDOW_MS 500
+#define VAD_ADAPTIVE_RATIO_Q4 40          // 2.5 倍, Q4 定点
+#define VAD_ADAPTIVE_MAX_THRESH 4000
+#define VAD_ADAPTIVE_CONFIDENT_MS 600
+#define VAD_ADAPTIVE_MIN_SILENCE_MS 300
+
+// 推测性结果: 每个发给服务器的 finalize/eof 请求在环中占一格, 回复按顺序对应
+#define ASR_REPLY_RING_SIZE 8
+
+typedef enum {
+	ASR_REPLY_NONE,
+	ASR_REPLY_FINAL,      // eof 的回复, 即最终结果
+	ASR_REPLY_DROP,       // 已经用推测结果作答, 丢弃
+	ASR_REPLY_SPEC,       // finalize 的回复, 缓存起来
+	ASR_REPLY_PROMOTED,   // 回复前已确认说话结束, 作为最终结果
+	ASR_REPLY_DISCARD     // 推测后用户继续说话, 丢弃
+} whisper_reply_kind_t;
+
+// 语法缓存
+#define GRAMMAR_MAX_SIZE_DEFAULT 65536
+#define GRAMMAR_ADHOC_CACHE_MAX 64    // detect_speech 直接给出的语法最多缓存这么多个, 超出时淘汰最久未用的
+
+// 会话内存块: ASR 固定大小, TTS 按缓冲区水位计算
+#define ASR_SLAB_SIZE (32 * 1024)
+#define ARENA_CACHE_SLABS_DEFAULT 64
+#define ASR_AUDIO_BUFFER_SIZE (AUDIO_BLOCK_SIZE * 2)
+
+typedef enum {
+	ASRFLAG_READY = (1 << 0),
+	ASRFLAG_INPUT_TIMERS = (1 << 1),
+	ASRFLAG_START_OF_SPEECH = (1 << 2),
+	ASRFLAG_RETURNED_START_OF_SPEECH = (1 << 3),
+	ASRFLAG_NOINPUT_TIMEOUT = (1 << 4),
+	ASRFLAG_RESULT = (1 << 5),
+	ASRFLAG_RETURNED_RESULT = (1 << 6),
+	ASRFLAG_TIMEOUT = (1 << 7),
+	ASRFLAG_RESULT_PENDING = (1 << 8),
+	ASRFLAG_RESULT_READY = (1 << 9),
+	ASRFLAG_RESULT_TIMEOUT = (1 << 10),
+	ASRFLAG_CONNECTION_LOST = (1 << 11)
+} whisper_flag_t;
+
+typedef enum {
+	WS_STATE_INIT,
+	WS_STATE_STARTED,
+	WS_STATE_DESTROY
+} ws_state_t;
+
+// 预编译的语法/热词, 按名字缓存, 所有会话共享
+typedef struct whisper_grammar {
+	char *name;
+	char *id;           // 服务器端注册的ID或内容哈希
+	char *message;      // 预先生成的 JSON 请求
+	switch_size_t size; // 语法内容长度
+	switch_memory_pool_t *pool;               // 临时语法自己的内存池, 配置的语法为 NULL
+	struct whisper_grammar *prev, *next;      // 临时语法的 LRU 链表, 表头最近使用
+} whisper_grammar_t;
+
+// 回收的内存块池, 每个会话从中取一块, 关闭时整块归还
+typedef struct {
+	switch_mutex_t *mutex;
+	switch_size_t slab_size;
+	void **free;
+	uint32_t nfree;
+	uint32_t max_free;
+	uint32_t in_use;
+	uint64_t overflows;
+} whisper_slab_pool_t;
+
+typedef struct whisper_arena_chunk {
+	struct whisper_arena_chunk *next;
+} whisper_arena_chunk_t;
+
+// 会话内存: 从内存块中顺序分配, 超出部分单独 malloc, 销毁时一次性释放
+typedef struct {
+	whisper_slab_pool_t *slabs;
+	uint8_t *base;
+	switch_size_t slab_size;
+	switch_size_t size;
+	volatile switch_size_t used;
+	whisper_arena_chunk_t *volatile overflow;
+} whisper_arena_t;
+
+// 准入控制: 每个服务器地址的并发上限, 满了以后按优先级排队, 超时或队列满立即失败
+#define ADMIT_QUEUE_SIZE_DEFAULT 16
+#define ADMIT_TIMEOUT_MS_DEFAULT 2000
+
+typedef struct whisper_admit_waiter {
+	struct whisper_admit_waiter *next;
+	int priority;                 // 通道变量 whisper_priority, 大的优先
+	int granted;                  // 释放者直接把名额转给等待者
+	switch_thread_cond_t *cond;
+} whisper_admit_waiter_t;
+
+typedef struct {
+	const char *kind;             // "asr" 或 "tts"
+	char *url;
+	uint32_t max_sessions;        // 0 表示不限制
+	uint32_t active;
+	uint32_t waiting;
+	uint64_t rejected;
+	whisper_admit_waiter_t *queue;
+} whisper_endpoint_t;
+
+// 路由: 按通道变量或参数 whisper_model / whisper_language 选择 ASR 服务器组, 未匹配的用 asr-server-url
+#define ROUTE_DEFAULT_NAME "default"
+#define ROUTE_LATENCY_BUCKETS 8       // 50ms 起每档翻倍, 最后一档不设上限
+#define ROUTE_DEGRADED_MS 30000       // 结果超时后路由标记为降级的时长
+
+typedef struct {
+	const char *name;
+	const char *url;
+	const char *language;         // 发给服务器的语言, 为空时用会话的 language
+	const char *fallback;         // 本路由降级时改用的路由
+	uint32_t max_sessions;        // 0 表示沿用 asr-max-sessions
+} whisper_route_t;
+
+// 每个路由的 eof 到结果的延迟统计, 按名字保存在全局表中, 重新加载不清零
+typedef struct {
+	char *name;
+	char *url;
+	volatile uint32_t sessions;
+	volatile uint64_t results;
+	volatile uint64_t latency_total_ms;
+	volatile uint32_t latency_max_ms;
+	volatile uint64_t latency_hist[ROUTE_LATENCY_BUCKETS];
+	volatile uint64_t timeouts;
+	volatile switch_time_t degraded_until;
+} whisper_route_stats_t;
+
+typedef struct whisper_tap whisper_tap_t;
+typedef struct whisper_tts_chunk whisper_tts_chunk_t;
+typedef struct whisper_local whisper_local_t;
+typedef struct whisper_stage whisper_stage_t;
+typedef struct whisper_stage_item whisper_stage_item_t;
+
+// 看门狗: 模块运行时线程定期检查所有会话, 等待结果和握手都有期限, 连接断开时立即结束等待
+#define WATCHDOG_INTERVAL_MS 200
+#define ASR_RESULT_TIMEOUT_MS_DEFAULT 15000   // asr-result-timeout-ms, 可按 profile 或参数覆盖
+#define ASR_RECONNECT_INTERVAL_MS 1000         // 连接断开后重连线程重连的最小间隔
+#define ASR_RECONNECT_WORKERS 4                // 重连线程数, 即同时握手的连接数上限, 运行时线程只做看门狗
+#define ASR_RECONNECT_POLL_MS 50
+#define WATCHDOG_TTS_STALL_MS 10000
+#define WS_HANDSHAKE_TIMEOUT_MS 5000
+
+// 节奏发送: 音频块带采集时间 (会话打开以来的媒体时间), 按实时节奏发出, 落后时最多以 asr-pace-catchup 倍速追赶
+#define PACE_CATCHUP_MAX 8
+
+typedef struct whisper_pace_frame whisper_pace_frame_t;
+
+typedef struct {
+	uint32_t catchup;             // 0 为不限速, 收到即发
+	switch_time_t epoch;          // 媒体时间 0 对应的时钟, 每句话的第一个块重新对齐
+	switch_time_t next;           // 追赶时下一个块最早的发送时间
+} whisper_pace_t;
+
+// websocket 服务线程绑核 (ws-thread-cpus): 优先用媒体线程当前所在的核, 其次同一 NUMA 节点上负载最低的核
+#define WS_CPU_MAX 1024
+#define WS_NUMA_NODE_MAX 64
+
+typedef struct {
+	volatile uint32_t threads;       // 当前绑在此核上的服务线程
+	volatile uint64_t opened;
+	volatile uint64_t rx_msgs;
+	volatile uint64_t cpu_us;        // 已退出线程累计的 CPU 时间
+	volatile uint64_t local;         // 与媒体线程同核
+	volatile uint64_t same_node;     // 与媒体线程同 NUMA 节点
+} whisper_cpu_stats_t;
+
+// 分片的回复在服务线程中拼成一条再处理, 超过上限的整条丢弃
+#define WS_MESSAGE_MAX (1024 * 1024)
+
+typedef struct {
+	uint8_t *buf;
+	switch_size_t len, size;
+	int drop;                       // 超长, 丢弃到最后一个分片
+} whisper_ws_rx_t;
+
+// 会话复用的文本缓冲, 只在遇到更长的内容时扩大
+typedef struct {
+	char *data;
+	switch_size_t size;
+} whisper_text_buf_t;
+
+// 保活默认值, 空闲的 NAT 映射通常在一分钟内被回收
+#define WS_PING_INTERVAL_DEFAULT 20
+#define WS_PING_TIMEOUT_DEFAULT 10
+#define WS_KEEPALIVE_PROBES 3
+
+typedef enum {
+	WATCH_ASR,
+	WATCH_TTS
+} whisper_watch_kind_t;
+
+// 重连在重连线程进行, 媒体线程只提出请求; WANTED/RUNNING 期间媒体线程不碰连接
+typedef enum {
+	ASR_RECONNECT_IDLE,
+	ASR_RECONNECT_WANTED,   // 媒体线程发现连接断开
+	ASR_RECONNECT_RUNNING,  // 重连线程正在重连
+	ASR_RECONNECT_FAILED,   // 重连失败, 由媒体线程报告并复位
+	ASR_RECONNECT_DONE      // 重连成功, 媒体线程清空旧连接的回复队列后复位
+} whisper_reconnect_state_t;
+
+typedef struct whisper_watch {
+	struct whisper_watch *next;
+	struct whisper_watch *prev;
+	whisper_watch_kind_t kind;
+	void *context;                // NULL 表示未登记
+	switch_time_t opened;
+} whisper_watch_t;
+typedef struct whisper_mux whisper_mux_t;
+
+// 回放: 按 20ms 一帧驱动 ASR 状态机, 事件时间按音频时间计算, 偏差在容差内算一致
+#define REPLAY_FRAME_MS 20
+#define REPLAY_TOLERANCE_MS_DEFAULT 100
+#define REPLAY_MAX_EVENTS 256
+
+// 基准测试: 每个阶段按 (采样率, 帧长) 组合在本地替身会话上循环执行, 输出每次操作的耗时分布
+#define BENCH_ITERATIONS_DEFAULT 5000
+#define BENCH_ITERATIONS_MAX 1000000
+#define BENCH_WARMUP 200
+#define BENCH_RESULT_EVERY 50         // result 阶段每这么多帧算一句
+#define BENCH_MAX_POINTS 8            // rates= / frames= 最多几个值
+
+// 回放用的本地替身服务器: 不建立连接, 每个 finalize/eof 请求按录制顺序同步回复一条
+typedef struct {
+	const char **replies;
+	uint32_t nreplies;
+	uint32_t next;
+	switch_size_t audio_bytes;
+} whisper_loopback_t;
+
+// VAD/超时参数组, 加载时解析一次, 呼叫时按名字选用 (通道变量 whisper_profile 或 profile 参数)
+typedef struct {
+	const char *name;
+	uint32_t vad_thresh;
+	uint32_t vad_silence_ms;
+	uint32_t vad_voice_ms;
+	int no_input_timeout;
+	int speech_timeout;
+	switch_bool_t vad_adaptive;
+	uint32_t speculative_pause_ms;
+	uint32_t result_timeout_ms;
+} whisper_profile_t;
+
+// 运行时配置快照: 创建后只读, 重新加载时整体替换. 会话打开时取得引用, 关闭时释放, 最后一个引用释放时销毁
+typedef struct {
+	switch_memory_pool_t *pool;
+	volatile uint32_t refs;
+	uint32_t version;
+
+	char *asr_server_url;
+	char *tts_server_url;
+	int return_json;
+	int auto_reload;
+
+	whisper_profile_t defaults;     // <settings> 中的值, 也是各 profile 的初始值
+	switch_hash_t *profiles;
+	switch_hash_t *routes;
+
+	char *tts_encoding;
+	int tts_sample_rate;
+	int tts_frame_ms;
+	switch_size_t tts_high_water;
+	switch_size_t tts_low_water;
+	uint32_t tts_chunk_max_chars;   // 0 为整段文本一个请求
+	uint32_t tts_pipeline_depth;
+
+	uint32_t asr_max_sessions;
+	uint32_t tts_max_sessions;
+	uint32_t admit_queue_size;
+	uint32_t admit_timeout_ms;
+	uint32_t asr_mux_connections;   // 0 为每个会话一条连接, 否则每个地址共享这么多条
+	uint32_t asr_pace_catchup;      // 0 关闭节奏发送
+	uint32_t asr_batch_window_ms;   // 多路复用时 eof 最多等这么久与其他会话合并成一个请求, 0 为关闭
+	int *ws_cpus;                   // ws-thread-cpus, 未设置时不绑核
+	uint32_t ws_cpu_count;
+
+	uint32_t ws_ping_interval;      // 秒, 空闲这么久发 websocket ping, 0 为关闭
+	uint32_t ws_ping_timeout;       // 秒, ping 之后这么久仍无数据即判定对端失效并断开
+	uint32_t tcp_keepalive;         // 秒, TCP keepalive 空闲时间, 0 为关闭
+	switch_bool_t tcp_nodelay;
+	char *tls_ca_file;              // wss 服务器证书的 CA, 未设置时使用系统 CA
+	switch_bool_t tls_insecure;     // 接受自签名证书且不检查主机名, 仅用于测试
+
+	uint32_t arena_cache_slabs;
+	switch_size_t grammar_max_size;
+	switch_size_t tts_prefetch_max_bytes;   // 每个通道预合成暂存的上限, 0 为关闭预合成
+
+	char *record_dir;               // 录音旁路目录
+	uint32_t record_percent;        // 随机抽样比例, 通道变量 whisper_record 优先
+} whisper_settings_t;
+
+struct whisper_globals {
+	switch_memory_pool_t *pool;
+
+	switch_mutex_t *settings_mutex;
+	whisper_settings_t *settings;
+	uint32_t settings_version;
+
+	switch_mutex_t *grammar_mutex;
+	switch_memory_pool_t *grammar_pool;
+	switch_hash_t *grammar_cache;
+	switch_hash_t *grammar_adhoc;     // 按内容索引, 数量受 GRAMMAR_ADHOC_CACHE_MAX 限制
+	whisper_grammar_t *adhoc_head, *adhoc_tail;
+	uint32_t adhoc_count;
+	switch_size_t grammar_max_size;   // 只在 grammar_mutex 下读写
+
+	whisper_slab_pool_t asr_slabs;
+	whisper_slab_pool_t tts_slabs;
+
+	switch_mutex_t *endpoint_mutex;
+	switch_hash_t *endpoints;
+	switch_hash_t *route_stats;     // endpoint_mutex 保护
+
+	switch_mutex_t *stats_mutex;
+	uint32_t tts_cancel_count;
+	switch_size_t tts_cancelled_bytes;
+	uint32_t asr_spec_hits;
+	uint32_t asr_spec_misses;
+
+	switch_mutex_t *watch_mutex;
+	whisper_watch_t *watch_list;
+	uint32_t asr_sessions;          // watch_mutex 保护
+	uint32_t tts_sessions;
+	volatile int running;
+	volatile uint64_t result_timeouts;
+	volatile uint64_t connections_lost;
+	volatile uint64_t handshake_timeouts;
+	volatile uint64_t tts_stalls;
+
+	// TLS 会话缓存, 按 主机:端口 保存, 每个连接关闭时存入, 下一个连接用来恢复会话
+	switch_mutex_t *tls_mutex;
+	switch_hash_t *tls_sessions;
+	volatile uint64_t tls_connections;
+	volatile uint64_t tls_resumed;
+
+	volatile uint64_t local_connections;   // unix:// 本机传输
+	volatile uint64_t local_ring_full;     // 共享内存环满, 丢弃的音频块
+
+	volatile uint64_t paced_blocks;
+	volatile uint64_t paced_late_blocks;   // 入队时已落后采集时钟一个块以上, 即媒体线程卡顿
+	volatile uint64_t paced_lag_max_ms;
+
+	// 跨会话 eof 合并
+	volatile uint64_t asr_batches;
+	volatile uint64_t asr_batched_eofs;
+	volatile uint64_t asr_batch_wait_us;       // 每个 eof 在窗口中等待的时间之和
+	volatile uint64_t asr_batch_wait_max_us;
+
+	// TTS 预合成
+	volatile uint64_t tts_prefetch_hits;
+	volatile uint64_t tts_prefetch_misses;
+	volatile switch_size_t tts_staged_bytes;
+	volatile uint32_t prefetch_threads;
+
+	switch_thread_t *reconnect_threads[ASR_RECONNECT_WORKERS];
+	volatile uint32_t reconnects_wanted;   // 处于 WANTED 的会话数, 为 0 时重连线程不扫描
+
+	int16_t cpu_node[WS_CPU_MAX];   // 每个核所在的 NUMA 节点, -1 为未知
+	whisper_cpu_stats_t ws_cpu[WS_CPU_MAX];
+};
+
+extern struct whisper_globals whisper_globals;
+
+typedef struct {
+	kws_t *ws;
+	char *text;
+	char *voice;
+	char *channel_uuid;
+	int samplerate;
+	switch_buffer_t *audio_buffer;
+
+	// 与服务器协商的输出格式, L16 且采样率一致时不做任何转换
+	char *encoding;
+	int frame_ms;
+	int native_rate;
+	switch_codec_t decoder;
+	uint8_t *decode_buf;
+	switch_mutex_t *mutex;
+	switch_memory_pool_t *pool;
+	whisper_arena_t *arena;
+	switch_thread_t *thread;
+	whisper_endpoint_t *endpoint;
+	whisper_settings_t *settings;
+
+	// 每个提示音一个请求ID, 服务器按顺序每个请求返回一条二进制消息
+	uint32_t request_id;      // 最后分配的请求, 即当前提示音的最后一段
+	uint32_t rx_request_id;   // 正在接收音频的请求
+	uint32_t cancel_id;       // 此ID及之前请求的音频被丢弃
+	uint32_t tx_sent_id;      // 已经写出的请求, 服务线程在 mutex 下更新
+	whisper_tts_chunk_t *tx_head, *tx_tail;   // 待写出的请求和控制消息, mutex 保护
+	uint32_t chunk_chars;
+	uint32_t pipeline_depth;
+	switch_size_t cancelled_bytes;
+
+	switch_size_t high_water;
+	switch_size_t low_water;
+	int rx_paused;
+	int rx_resume;
+	volatile switch_time_t rx_time;   // 最近一次请求或收到音频的时间, 看门狗据此判断卡住
+	whisper_watch_t watch;
+
+	// 预合成: 通道的暂存区, 命中时从 staged 播放而不发请求. prefetch 为后台合成用的句柄
+	whisper_stage_t *stage;
+	whisper_stage_item_t *staged;
+	switch_size_t staged_pos;
+	switch_bool_t prefetch;
+
+	struct lws_context *lws_context;
+	struct lws_context_creation_info lws_info;
+	struct lws_client_connect_info lws_ccinfo;
+	lws_retry_bo_t lws_retry;       // ping/pong 空闲策略, 连接存活期间 lws 一直引用
+	int ws_cpu;                     // 服务线程绑定的核, -1 为不绑
+	whisper_local_t *local;         // unix:// 服务器, 此时不使用 lws
+	struct lws *wsi;
+	volatile int wc_error;
+	volatile int wc_connected;
+	volatile int started;
+} whisper_tts_t;
+
+typedef struct {
+	volatile uint32_t flags;  // whisper_flag_t, 只能通过下面的原子操作修改
+	char *result_text;
+	double result_confidence;
+	uint32_t thresh;
+	uint32_t silence_ms;
+	uint32_t voice_ms;
+	int no_input_timeout;
+	int speech_timeout;
+	switch_bool_t start_input_timers;
+	switch_time_t no_input_time;
+	switch_time_t speech_time;
+	char *grammar;
+	char *channel_uuid;
+	int partial;
+	switch_vad_t *vad;
+	const whisper_profile_t *profile;
+	whisper_tap_t *tap;
+	whisper_loopback_t *loopback;
+	const char *language;
+	const char *model;
+	const char *asr_url;          // 当前连接的服务器
+	const whisper_route_t *route; // NULL 为 asr-server-url
+	uint32_t result_timeout_ms;
+	switch_time_t reconnect_time;
+	volatile int reconnect;       // whisper_reconnect_state_t
+	volatile int media_cpu;       // 请求重连时媒体线程所在的核, 新的服务线程按它绑核
+	whisper_route_stats_t *route_stats;
+	volatile switch_time_t final_time;  // 最近一次 eof 请求的时间, 用于延迟统计
+	volatile switch_time_t pending_time;  // 进入 RESULT_PENDING 的时间, 看门狗据此判断超时
+	whisper_watch_t watch;
+
+	// 自适应端点检测, 每帧只做一次求和和比较
+	switch_bool_t vad_adaptive;
+	uint32_t rate;
+	uint32_t noise_floor;
+	uint32_t window_min;
+	uint32_t window_ms;
+	uint32_t speech_level;
+	uint32_t speech_ms;
+	uint32_t cur_thresh;
+	uint32_t cur_silence_ms;
+
+	// 推测性结果, 停顿 speculative_pause_ms 后先发 finalize
+	uint32_t speculative_pause_ms;
+	uint32_t pause_ms;
+	switch_bool_t spec_active;
+	uint32_t spec_slot;
+	volatile int spec_ready;
+	char *spec_text;
+	// 回复文本: spec_buf/final_buf 存可能成为结果的回复, 其余的只在 drop_buf 中打日志, 不再占用会话内存块
+	whisper_text_buf_t spec_buf;
+	whisper_text_buf_t final_buf;
+	whisper_text_buf_t drop_buf;
+	volatile int reply_kind[ASR_REPLY_RING_SIZE];
+	volatile uint32_t reply_tx;
+	volatile uint32_t reply_rx;
+
+	switch_buffer_t *audio_buffer;
+	uint8_t *send_buf;        // LWS_PRE + AUDIO_BLOCK_SIZE, 直接在此组帧发送
+	uint64_t fed_samples;     // 媒体时钟: 会话打开以来送入的样本数, 包括静音
+	uint32_t audio_seq;
+
+	// 节奏发送时每呼叫连接的发送队列, 媒体线程入队, 服务线程按 due 时间写出
+	whisper_pace_t pace;
+	switch_mutex_t *pace_mutex;
+	whisper_pace_frame_t *pace_head, *pace_tail;
+	switch_memory_pool_t *pool;
+	whisper_arena_t *arena;
+	switch_thread_t *thread;
+	whisper_endpoint_t *endpoint;
+	whisper_settings_t *settings;
+
+	struct lws_context *lws_context;
+	struct lws_context_creation_info lws_info;
+	struct lws_client_connect_info lws_ccinfo;
+	lws_retry_bo_t lws_retry;
+	int ws_cpu;
+	whisper_local_t *local;
+	struct lws *wsi;
+	whisper_mux_t *mux;
+	whisper_ws_rx_t rx;             // 每呼叫连接上分片的回复
+	void *mux_stream;
+	volatile int wc_error;
+	volatile int wc_connected;
+	volatile int started;
+} whisper_t;
+
+/*
+ * ASR 会话状态机: 媒体线程和 websocket 线程通过 CAS 修改 flags, 互不加锁.
+ * whisper_flag_transition 只有在 require 中的位全部置位时才生效, 一次性清除 clear 并设置 set.
+ */
+#define whisper_atomic_get(var) __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+#define whisper_atomic_set(var, val) __atomic_store_n(&(var), (val), __ATOMIC_RELEASE)
+#define whisper_flag_test(ctx, flag) (whisper_atomic_get((ctx)->flags) & (flag))
+#define whisper_flag_set(ctx, flag) __atomic_fetch_or(&(ctx)->flags, (uint32_t)(flag), __ATOMIC_ACQ_REL)
+#define whisper_flag_clear(ctx, flag) __atomic_fetch_and(&(ctx)->flags, ~(uint32_t)(flag), __ATOMIC_ACQ_REL)
+
+static inline switch_bool_t whisper_flag_transition(whisper_t *context, uint32_t require, uint32_t clear, uint32_t set)
+{
+	uint32_t old = whisper_atomic_get(context->flags), new;
+
+	do {
+		if ((old & require) != require) {
+			return SWITCH_FALSE;
+		}
+		new = (old & ~clear) | set;
+	} while (!__atomic_compare_exchange_n(&context->flags, &old, new, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	return SWITCH_TRUE;
+}
+
+switch_status_t whisper_slab_pool_init(whisper_slab_pool_t *slabs, switch_size_t slab_size, uint32_t max_free, switch_memory_pool_t *pool);
+void whisper_slab_pool_resize(whisper_slab_pool_t *slabs, switch_size_t slab_size, uint32_t max_free);
+void whisper_slab_pool_destroy(whisper_slab_pool_t *slabs);
+whisper_arena_t *whisper_arena_create(whisper_slab_pool_t *slabs);
+void *whisper_arena_alloc(whisper_arena_t *arena, switch_size_t size);
+char *whisper_arena_strndup(whisper_arena_t *arena, const char *str, switch_size_t len);
+char *whisper_arena_strdup(whisper_arena_t *arena, const char *str);
+void whisper_arena_destroy(whisper_arena_t **arena);
+
+whisper_settings_t *whisper_settings_acquire(void);
+void whisper_settings_release(whisper_settings_t **settings);
+void whisper_route_stats_record(whisper_route_stats_t *stats, switch_time_t latency);
+
+int callback_ws_tts(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
+int callback_ws_asr(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
 
 #endif
@@ -0,0 +1,260 @@
+#!/usr/bin/env python3
+"""
+Reference server for the mod_whisper unix:// transport (see whisper_local.h).
+
+    asr-server-url  unix:///run/whisper/asr.sock
+    tts-server-url  unix:///run/whisper/tts.sock
+
+One SOCK_SEQPACKET connection per session. The first packet is
+{"open":"asr"|"tts","version":1,"ring_size":N} carrying, via SCM_RIGHTS,
+a memfd and two eventfds: the server sleeps on the first and writes the
+second to wake the module. After mapping the memfd the server answers
+{"ready":true}; from then on every packet is one JSON/text message, the
+same messages a websocket server gets as text frames.
+
+Shared memory:
+    0    magic "WHL1", version, ring_size
+    64   to_server ring: head (u32)      written by the module
+    128                  tail, waiting   written by the server
+    192  to_client ring: head (u32)      written by the server
+    256                  tail, waiting   written by the module
+    320  to_server data (ring_size), then to_client data (ring_size)
+
+Records: 16-byte header {len, flags, ts_ms, seq} and the payload, padded to
+16 bytes. A record never wraps, a PAD record (flags 1) skips to the start.
+On the TTS ring flags 2 (END) marks the last record of a request, like the
+final websocket fragment. Whoever publishes a record or frees room writes
+the other side's eventfd if its waiting flag is set.
+
+Needs Python 3.10 (socket.recv_fds, os.eventfd_read/write).
+
+This server recognizes nothing: it answers every eof with the amount of
+audio it received, and synthesizes a tone per TTS request. Replace the
+ASR/TTS handlers with a real engine.
+"""
+
+import array
+import json
+import math
+import mmap
+import os
+import select
+import socket
+import struct
+import sys
+import threading
+
+MAGIC = 0x57484C31
+VERSION = 1
+HEADER = 320
+TO_SERVER = 64
+TO_CLIENT = 192
+REC_HEADER = 16
+REC_PAD = 1
+REC_END = 2
+MSG_MAX = 65536
+
+
+def align(n):
+    return (n + 15) & ~15
+
+
+class Ring:
+    def __init__(self, shm, ctrl, data, size):
+        self.shm = shm
+        self.head_off = ctrl
+        self.tail_off = ctrl + 64
+        self.waiting_off = ctrl + 68
+        self.data = data
+        self.size = size
+
+    def u32(self, off):
+        return struct.unpack_from("<I", self.shm, off)[0]
+
+    def set_u32(self, off, value):
+        struct.pack_into("<I", self.shm, off, value & 0xFFFFFFFF)
+
+    # consumer
+    def read(self):
+        head, tail = self.u32(self.head_off), self.u32(self.tail_off)
+        while head != tail:
+            off = self.data + (tail & (self.size - 1))
+            length, flags, ts_ms, seq = struct.unpack_from("<IIII", self.shm, off)
+            if not flags & REC_PAD:
+                yield flags, ts_ms, bytes(self.shm[off + REC_HEADER:off + REC_HEADER + length])
+            tail = (tail + REC_HEADER + align(length)) & 0xFFFFFFFF
+            self.set_u32(self.tail_off, tail)
+
+    # producer, False when there is no room yet
+    def write(self, payload, flags=0, ts_ms=0, seq=0):
+        head, tail = self.u32(self.head_off), self.u32(self.tail_off)
+        need = REC_HEADER + align(len(payload))
+        off = head & (self.size - 1)
+        room = self.size - off
+        if need > room:
+            if ((head + room - tail) & 0xFFFFFFFF) + need > self.size:
+                return False
+            struct.pack_into("<II", self.shm, self.data + off, room - REC_HEADER, REC_PAD)
+            head = (head + room) & 0xFFFFFFFF
+            off = 0
+        elif ((head - tail) & 0xFFFFFFFF) + need > self.size:
+            return False
+        struct.pack_into("<IIII", self.shm, self.data + off, len(payload), flags, ts_ms, seq)
+        self.shm[self.data + off + REC_HEADER:self.data + off + REC_HEADER + len(payload)] = payload
+        self.set_u32(self.head_off, head + need)
+        return True
+
+    def waiting(self):
+        return self.u32(self.waiting_off)
+
+
+def kick(efd):
+    try:
+        os.eventfd_write(efd, 1)
+    except BlockingIOError:
+        pass
+
+
+def clear(efd):
+    try:
+        os.eventfd_read(efd)
+    except BlockingIOError:
+        pass
+
+
+class Session:
+    def __init__(self, conn):
+        self.conn = conn
+        msg, fds, _, _ = socket.recv_fds(conn, MSG_MAX, 3)
+        if len(fds) != 3:
+            raise ValueError("open request without memfd and eventfds")
+        memfd, self.efd, self.client_efd = fds
+        self.hello = json.loads(msg)
+        size = self.hello["ring_size"]
+        self.shm = mmap.mmap(memfd, HEADER + 2 * size)
+        os.close(memfd)
+        os.set_blocking(self.efd, False)
+        os.set_blocking(self.client_efd, False)
+        magic, version, ring_size = struct.unpack_from("<III", self.shm, 0)
+        if magic != MAGIC or version != VERSION or ring_size != size:
+            raise ValueError("unexpected shared memory header")
+        self.rx = Ring(self.shm, TO_SERVER, HEADER, size)
+        self.tx = Ring(self.shm, TO_CLIENT, HEADER + size, size)
+        self.send({"ready": True})
+
+    def send(self, obj):
+        self.conn.send(json.dumps(obj).encode())
+
+    def close(self):
+        for fd in (self.efd, self.client_efd):
+            os.close(fd)
+        self.shm.close()
+        self.conn.close()
+
+
+class AsrSession(Session):
+    def run(self):
+        audio = 0
+        while True:
+            for flags, ts_ms, payload in self.rx.read():
+                audio += len(payload)
+
+            # announce the sleep, the module kicks efd for the next record
+            self.rx.set_u32(self.rx.waiting_off, 1)
+            idle = self.rx.u32(self.rx.head_off) == self.rx.u32(self.rx.tail_off)
+            readable, _, _ = select.select([self.conn, self.efd], [], [], 0.02 if idle else 0)
+            self.rx.set_u32(self.rx.waiting_off, 0)
+            if self.efd in readable:
+                clear(self.efd)
+            if self.conn in readable:
+                msg = self.conn.recv(MSG_MAX)
+                if not msg:
+                    return
+                req = json.loads(msg)
+                if isinstance(req, dict) and (req.get("eof") or req.get("finalize")):
+                    # drain first, eof follows the audio it ends
+                    for flags, ts_ms, payload in self.rx.read():
+                        audio += len(payload)
+                    self.send({"text": "%d bytes of audio" % audio})
+                    if req.get("eof"):
+                        audio = 0
+
+
+class TtsSession(Session):
+    def run(self):
+        rate = 8000
+        pending = []
+        request_id = 0
+        cancelled = 0
+        while True:
+            readable, _, _ = select.select([self.conn, self.efd], [], [], 0.02)
+            if self.efd in readable:
+                clear(self.efd)
+            if self.conn in readable:
+                msg = self.conn.recv(MSG_MAX)
+                if not msg:
+                    return
+                try:
+                    req = json.loads(msg)
+                except ValueError:
+                    req = msg.decode()
+                if isinstance(req, dict) and "config" in req:
+                    rate = req["config"].get("sample_rate") or rate
+                    self.send({"config": {"sample_rate": rate}})
+                elif isinstance(req, dict) and req.get("cancel"):
+                    cancelled = max(cancelled, req.get("request_id", 0))
+                else:
+                    request_id += 1
+                    pending.append((request_id, self.tone(rate, req)))
+
+            # fill the ring as far as it goes, the module frees room as it plays
+            while pending:
+                rid, records = pending[0]
+                if rid <= cancelled:
+                    records[:] = [(b"", REC_END)]
+                payload, flags = records[0]
+                if not self.tx.write(payload, flags):
+                    break
+                records.pop(0)
+                if not records:
+                    pending.pop(0)
+            if self.tx.waiting():
+                kick(self.client_efd)
+
+    @staticmethod
+    def tone(rate, text):
+        samples = int(rate * min(0.1 * len(str(text)), 5.0))
+        pcm = array.array("h", (int(3000 * math.sin(2 * math.pi * 440 * i / rate)) for i in range(samples)))
+        data = pcm.tobytes()
+        records = [(data[i:i + 8000], 0) for i in range(0, len(data), 8000)]
+        return records + [(b"", REC_END)]
+
+
+def serve(path):
+    if os.path.exists(path):
+        os.unlink(path)
+    listener = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+    listener.bind(path)
+    listener.listen(128)
+
+    def handle(conn):
+        session = None
+        try:
+            session = Session(conn)
+            session.__class__ = AsrSession if session.hello.get("open") == "asr" else TtsSession
+            session.run()
+        except Exception as e:
+            print("session error: %s" % e, file=sys.stderr)
+        finally:
+            if session:
+                session.close()
+            else:
+                conn.close()
+
+    while True:
+        conn, _ = listener.accept()
+        threading.Thread(target=handle, args=(conn,), daemon=True).start()
+
+
+if __name__ == "__main__":
+    serve(sys.argv[1] if len(sys.argv) > 1 else "/run/whisper/asr.sock")
@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+"""
+Local wss:// stand-in: terminates TLS with a self-signed certificate and
+relays the bytes to a plain ws:// server, so the module's TLS path (wss://
+urls, tls-ca-file, session resumption) can be tried against any test server.
+
+    whisper_tls_proxy.py [--listen 127.0.0.1:8443] [--cert-dir .] 127.0.0.1:8080
+
+    tts-server-url  wss://localhost:8443/tts
+    tls-ca-file     <cert-dir>/cert.pem
+
+The certificate is created on first use (CN and subjectAltName localhost,
+127.0.0.1) with the openssl command line tool. Point tls-ca-file at it to
+run with verification on; tls-insecure=true is only needed for a
+certificate the module cannot verify.
+
+Every handshake is logged with whether the TLS session was resumed, the
+same count whisper status shows as tls_resumed.
+
+Needs Python 3.8 and openssl.
+"""
+
+import argparse
+import os
+import select
+import socket
+import ssl
+import subprocess
+import sys
+import threading
+
+BUF = 65536
+
+
+def host_port(value):
+    host, _, port = value.rpartition(":")
+    return host or "127.0.0.1", int(port)
+
+
+def make_cert(cert_dir):
+    cert = os.path.join(cert_dir, "cert.pem")
+    key = os.path.join(cert_dir, "key.pem")
+    if not (os.path.exists(cert) and os.path.exists(key)):
+        subprocess.check_call([
+            "openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes", "-days", "365",
+            "-subj", "/CN=localhost", "-addext", "subjectAltName=DNS:localhost,IP:127.0.0.1",
+            "-keyout", key, "-out", cert], stderr=subprocess.DEVNULL)
+        print("created %s, use it as tls-ca-file" % cert, file=sys.stderr)
+    return cert, key
+
+
+def relay(client, upstream):
+    try:
+        while True:
+            # bytes already decrypted inside the SSL object never show up in select
+            readable = [client] if client.pending() else []
+            if not readable:
+                readable, _, _ = select.select([client, upstream], [], [])
+            for src in readable:
+                data = src.recv(BUF)
+                if not data:
+                    return
+                (upstream if src is client else client).sendall(data)
+    except OSError:
+        pass
+    finally:
+        client.close()
+        upstream.close()
+
+
+def handle(ctx, conn, addr, target):
+    try:
+        client = ctx.wrap_socket(conn, server_side=True)
+    except (ssl.SSLError, OSError) as e:
+        print("%s:%d handshake failed: %s" % (addr[0], addr[1], e), file=sys.stderr)
+        conn.close()
+        return
+    print("%s:%d %s %s" % (addr[0], addr[1], client.version(),
+                           "resumed" if client.session_reused else "full handshake"), file=sys.stderr)
+    try:
+        upstream = socket.create_connection(target)
+    except OSError as e:
+        print("upstream %s:%d: %s" % (target[0], target[1], e), file=sys.stderr)
+        client.close()
+        return
+    relay(client, upstream)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[1])
+    parser.add_argument("--listen", default="127.0.0.1:8443")
+    parser.add_argument("--cert-dir", default=".")
+    parser.add_argument("target", help="host:port of the ws:// server")
+    args = parser.parse_args()
+
+    cert, key = make_cert(args.cert_dir)
+    ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    ctx.load_cert_chain(cert, key)
+
+    listener = socket.create_server(host_port(args.listen), backlog=128)
+
+    target = host_port(args.target)
+    while True:
+        conn, addr = listener.accept()
+        threading.Thread(target=handle, args=(ctx, conn, addr, target), daemon=True).start()
+
+
+if __name__ == "__main__":
+    main()
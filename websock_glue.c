@@ -1,6 +1,18 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* sched_getcpu, RUSAGE_THREAD */
+#endif
 #include "mod_whisper.h"
 #include "websock_glue.h"
+#include "whisper_tap.h"
+#include "whisper_mux.h"
+#include "whisper_local.h"
 #include <libwebsockets.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/resource.h>
+#endif
 
 // libwebsocket protocols
 static struct lws_protocols ws_tts_protocols[] = {
@@ -34,38 +46,830 @@ static struct lws_protocols ws_asr_protocols[] = {
 	{ NULL, NULL, 0, 0 } /* end */
 };
 
+//Client options shared by the TTS, ASR and mux connections
+
+typedef struct {
+	switch_size_t len;
+	uint8_t blob[1];
+} ws_tls_session_t;
+
+#if defined(LWS_WITH_TLS_SESSIONS)
+/* Serialized session from a closing connection, keyed by lws' vhost:host:port tag */
+static int ws_tls_session_store(struct lws_context *cx, struct lws_tls_session_dump *info)
+{
+	ws_tls_session_t *session, *old;
+
+	if (!(session = malloc(sizeof(*session) + info->blob_len))) {
+		return 1;
+	}
+	session->len = info->blob_len;
+	memcpy(session->blob, info->blob, info->blob_len);
+
+	switch_mutex_lock(whisper_globals.tls_mutex);
+	if ((old = switch_core_hash_find(whisper_globals.tls_sessions, info->tag))) {
+		switch_core_hash_delete(whisper_globals.tls_sessions, info->tag);
+		free(old);
+	}
+	switch_core_hash_insert(whisper_globals.tls_sessions, info->tag, session);
+	switch_mutex_unlock(whisper_globals.tls_mutex);
+
+	return 0;
+}
+
+/* lws frees the blob once it has parsed it */
+static int ws_tls_session_fetch(struct lws_context *cx, struct lws_tls_session_dump *info)
+{
+	ws_tls_session_t *session;
+	int r = 1;
+
+	switch_mutex_lock(whisper_globals.tls_mutex);
+	if ((session = switch_core_hash_find(whisper_globals.tls_sessions, info->tag)) && (info->blob = malloc(session->len))) {
+		memcpy(info->blob, session->blob, session->len);
+		info->blob_len = session->len;
+		r = 0;
+	}
+	switch_mutex_unlock(whisper_globals.tls_mutex);
+
+	return r;
+}
+#endif
+
+/* Keepalive and TLS options for a client context, from the settings the connection opens with */
+void ws_client_context_init(struct lws_context_creation_info *info, whisper_settings_t *settings)
+{
+	/* lws only creates the client SSL_CTX with it */
+	info->options |= LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+
+	if (settings->tcp_keepalive) {
+		info->ka_time = settings->tcp_keepalive;
+		info->ka_probes = WS_KEEPALIVE_PROBES;
+		info->ka_interval = settings->tcp_keepalive > WS_KEEPALIVE_PROBES ? settings->tcp_keepalive / WS_KEEPALIVE_PROBES : 1;
+	}
+
+	/* without it lws verifies against OpenSSL's default paths, the system store */
+	if (settings->tls_ca_file) {
+		info->client_ssl_ca_filepath = settings->tls_ca_file;
+	}
+}
+
+/* Call after lws_parse_uri with ccinfo->context set, retry has to outlive the connection */
+void ws_client_connect_init(struct lws_client_connect_info *ccinfo, lws_retry_bo_t *retry, const char *prot, whisper_settings_t *settings)
+{
+	if (strcmp(prot, "ws")) {
+		ccinfo->ssl_connection = LCCSCF_USE_SSL;
+		if (settings->tls_insecure) {
+			/* explicit opt-in, open to anyone on the path */
+			ccinfo->ssl_connection |= LCCSCF_ALLOW_SELFSIGNED | LCCSCF_SKIP_SERVER_CERT_HOSTNAME_CHECK;
+		}
+#if defined(LWS_WITH_TLS_SESSIONS)
+		{
+			struct lws_vhost *vh = lws_get_vhost_by_name(ccinfo->context, "default");
+
+			/* a miss is a full handshake */
+			if (vh) {
+				lws_tls_session_dump_load(vh, ccinfo->address, (uint16_t) ccinfo->port, ws_tls_session_fetch, NULL);
+			}
+		}
+#endif
+	} else {
+		ccinfo->ssl_connection = 0;
+	}
+
+	if (settings->ws_ping_interval) {
+		memset(retry, 0, sizeof(*retry));
+		/* lws pings after this much silence and hangs up if nothing at all comes back */
+		retry->secs_since_valid_ping = settings->ws_ping_interval;
+		retry->secs_since_valid_hangup = settings->ws_ping_interval + settings->ws_ping_timeout;
+		ccinfo->retry_and_idle_policy = retry;
+	}
+}
+
+void ws_client_established(struct lws *wsi, switch_bool_t nodelay)
+{
+	int fd = lws_get_socket_fd(wsi), on = nodelay ? 1 : 0;
+
+	if (fd >= 0 && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on))) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Unable to set TCP_NODELAY=%d on the websocket\n", on);
+	}
+
+	if (lws_is_ssl(wsi)) {
+		__atomic_add_fetch(&whisper_globals.tls_connections, 1, __ATOMIC_RELAXED);
+#if defined(LWS_WITH_TLS_SESSIONS)
+		if (lws_tls_session_is_reused(wsi)) {
+			__atomic_add_fetch(&whisper_globals.tls_resumed, 1, __ATOMIC_RELAXED);
+		}
+#endif
+	}
+}
+
+/* Before lws_context_destroy, once the service thread is joined */
+void ws_tls_session_save(struct lws_client_connect_info *ccinfo)
+{
+#if defined(LWS_WITH_TLS_SESSIONS)
+	struct lws_vhost *vh;
+
+	/* a ticket sent after the handshake is only there by now */
+	if ((ccinfo->ssl_connection & LCCSCF_USE_SSL) && ccinfo->context && (vh = lws_get_vhost_by_name(ccinfo->context, "default"))) {
+		lws_tls_session_dump_save(vh, ccinfo->address, (uint16_t) ccinfo->port, ws_tls_session_store, NULL);
+	}
+#endif
+}
+
+void ws_tls_session_flush(void)
+{
+	switch_hash_index_t *hi;
+	void *val;
+
+	switch_mutex_lock(whisper_globals.tls_mutex);
+	while ((hi = switch_core_hash_first(whisper_globals.tls_sessions))) {
+		const void *key;
+
+		switch_core_hash_this(hi, &key, NULL, &val);
+		switch_core_hash_delete(whisper_globals.tls_sessions, (const char *) key);
+		free(val);
+		switch_safe_free(hi);
+	}
+	switch_mutex_unlock(whisper_globals.tls_mutex);
+}
+
+//Service thread placement
+
+/* Set by a thread that connects on behalf of a media thread, -1 when it connects for itself */
+static __thread int ws_cpu_hint = -1;
+
+int ws_thread_cpu_current(void)
+{
+#ifdef __linux__
+	return sched_getcpu();
+#else
+	return -1;
+#endif
+}
+
+void ws_thread_cpu_hint(int cpu)
+{
+	ws_cpu_hint = cpu;
+}
+
+/*
+ * Before the service thread starts: the core the media thread runs on when listed (the hinted one
+ * when another thread connects for it), else the least loaded listed core on its NUMA node, else
+ * the least loaded listed core. -1 leaves it to the scheduler.
+ */
+int ws_thread_cpu_pick(whisper_settings_t *settings)
+{
+	int here, node = -1, best = -1, best_node = -1;
+	uint32_t i, load, best_load = 0, best_node_load = 0;
+
+	if (!settings->ws_cpu_count) {
+		return -1;
+	}
+
+	here = ws_cpu_hint >= 0 ? ws_cpu_hint : ws_thread_cpu_current();
+	if (here >= 0 && here < WS_CPU_MAX) {
+		node = whisper_globals.cpu_node[here];
+	}
+
+	for (i = 0; i < settings->ws_cpu_count; i++) {
+		int cpu = settings->ws_cpus[i];
+
+		if (cpu == here) {
+			__atomic_add_fetch(&whisper_globals.ws_cpu[cpu].local, 1, __ATOMIC_RELAXED);
+			return cpu;
+		}
+
+		load = whisper_atomic_get(whisper_globals.ws_cpu[cpu].threads);
+		if (best < 0 || load < best_load) {
+			best = cpu;
+			best_load = load;
+		}
+		if (node >= 0 && whisper_globals.cpu_node[cpu] == node && (best_node < 0 || load < best_node_load)) {
+			best_node = cpu;
+			best_node_load = load;
+		}
+	}
+
+	if (best_node >= 0) {
+		__atomic_add_fetch(&whisper_globals.ws_cpu[best_node].same_node, 1, __ATOMIC_RELAXED);
+		return best_node;
+	}
+
+	return best;
+}
+
+/* First thing in a service thread */
+void ws_thread_enter(int cpu)
+{
+	if (cpu < 0) {
+		return;
+	}
+
+	if (switch_core_thread_set_cpu_affinity(cpu) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Unable to pin the websocket thread to cpu %d\n", cpu);
+	}
+
+	__atomic_add_fetch(&whisper_globals.ws_cpu[cpu].threads, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&whisper_globals.ws_cpu[cpu].opened, 1, __ATOMIC_RELAXED);
+}
+
+/* Last thing in a service thread, its CPU time goes to the core it was pinned to */
+void ws_thread_exit(int cpu)
+{
+#ifdef __linux__
+	struct rusage ru;
+#endif
+
+	if (cpu < 0) {
+		return;
+	}
+
+#ifdef __linux__
+	if (!getrusage(RUSAGE_THREAD, &ru)) {
+		uint64_t us = (uint64_t) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+
+		__atomic_add_fetch(&whisper_globals.ws_cpu[cpu].cpu_us, us, __ATOMIC_RELAXED);
+	}
+#endif
+
+	__atomic_sub_fetch(&whisper_globals.ws_cpu[cpu].threads, 1, __ATOMIC_RELAXED);
+}
+
+void ws_thread_rx(int cpu)
+{
+	if (cpu >= 0) {
+		__atomic_add_fetch(&whisper_globals.ws_cpu[cpu].rx_msgs, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Service thread, for each receive callback: SWITCH_TRUE once *in / *len hold a whole message.
+ * A message in one fragment is passed through, a longer one is collected in rx until its final fragment.
+ */
+switch_bool_t ws_rx_message(whisper_ws_rx_t *rx, struct lws *wsi, const void **in, size_t *len, const char *url)
+{
+	if (lws_is_first_fragment(wsi)) {
+		if (lws_is_final_fragment(wsi)) {
+			return SWITCH_TRUE;
+		}
+		rx->len = 0;
+		rx->drop = 0;
+	}
+
+	if (!rx->drop && rx->len + *len > rx->size) {
+		switch_size_t size = rx->size ? rx->size : RX_BUFFER_SIZE;
+		uint8_t *buf;
+
+		while (size < rx->len + *len) {
+			size *= 2;
+		}
+		if (size > WS_MESSAGE_MAX || !(buf = realloc(rx->buf, size))) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Reply from %s over %d bytes, dropped\n", url, WS_MESSAGE_MAX);
+			rx->drop = 1;
+		} else {
+			rx->buf = buf;
+			rx->size = size;
+		}
+	}
+
+	if (!rx->drop) {
+		memcpy(rx->buf + rx->len, *in, *len);
+		rx->len += *len;
+	}
+
+	if (rx->drop || !lws_is_final_fragment(wsi)) {
+		return SWITCH_FALSE;
+	}
+
+	*in = rx->buf;
+	*len = rx->len;
+	rx->len = 0;
+
+	return SWITCH_TRUE;
+}
+
+void ws_rx_free(whisper_ws_rx_t *rx)
+{
+	switch_safe_free(rx->buf);
+	rx->len = rx->size = 0;
+}
+
 //TTS Functions
+
+/* The usual speech rates, anything else in a config reply is a broken server */
+static switch_bool_t ws_tts_rate_supported(int rate)
+{
+	switch (rate) {
+	case 8000:
+	case 11025:
+	case 16000:
+	case 22050:
+	case 24000:
+	case 32000:
+	case 44100:
+	case 48000:
+		return SWITCH_TRUE;
+	default:
+		return SWITCH_FALSE;
+	}
+}
+
+static void ws_tts_handle_config(whisper_tts_t *context, const char *text, size_t len)
+{
+	char *str = NULL;
+	ks_json_t *json = NULL, *config;
+	int rate;
+
+	switch_zmalloc(str, len + 1);
+	memcpy(str, text, len);
+
+	if ((json = ks_json_parse(str)) && ks_json_get_object_item(json, "cancelled")) {
+		/* cancel ack, sent after the last audio of the cancelled requests */
+		uint32_t id = (uint32_t) ks_json_get_object_number_int(json, "cancelled", 0);
+
+		switch_mutex_lock(context->mutex);
+		if (id >= context->rx_request_id && id <= context->request_id) {
+			whisper_atomic_set(context->rx_request_id, id + 1);
+		}
+		switch_mutex_unlock(context->mutex);
+
+		/* room for the next chunk in the pipeline */
+		whisper_tts_wake(context);
+		goto end;
+	}
+
+	if (!json || !(config = ks_json_get_object_item(json, "config"))) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_WARNING, "Unexpected TTS text message: %s\n", str);
+		goto end;
+	}
+
+	rate = ks_json_get_object_number_int(config, "sample_rate", context->native_rate);
+	if (!ws_tts_rate_supported(rate)) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_ERROR, "TTS server answered an unsupported rate %d, keeping %dHz\n",
+						  rate, context->native_rate);
+		rate = context->native_rate;
+	}
+	context->native_rate = rate;
+
+	if (strcasecmp(context->encoding, "L16") && context->native_rate != context->samplerate) {
+		/* the decoder was set up for the rate we asked for */
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_ERROR, "TTS server answered %s at %dHz, expected %dHz\n",
+						  context->encoding, context->native_rate, context->samplerate);
+		context->native_rate = context->samplerate;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "TTS server format %s %dHz\n", context->encoding, context->native_rate);
+
+  end:
+	ks_json_delete(&json);
+	free(str);
+}
+
+/*
+ * Long prompts are split at sentence ends so the server can start on the first
+ * sentence at once. The first chunk of a prompt also ends at the first clause,
+ * later ones only at sentences unless they run past the size limit.
+ */
+struct whisper_tts_chunk {
+	struct whisper_tts_chunk *next;
+	uint32_t id;                    /* 0 for control messages, which the server does not answer with audio */
+	switch_size_t len;
+	uint8_t data[];                 /* text starts LWS_PRE in */
+};
+
+typedef enum {
+	TTS_BREAK_NONE,
+	TTS_BREAK_CLAUSE,
+	TTS_BREAK_SENTENCE,
+	TTS_BREAK_CLOSER               /* closing quote or bracket, stays with the punctuation before it */
+} whisper_tts_break_t;
+
+/* One UTF-8 character, invalid bytes count as one character each */
+static int whisper_utf8_next(const uint8_t *p, uint32_t *cp)
+{
+	int n, i;
+
+	if (*p < 0x80) {
+		*cp = *p;
+		return 1;
+	} else if ((*p & 0xe0) == 0xc0) {
+		*cp = *p & 0x1f;
+		n = 2;
+	} else if ((*p & 0xf0) == 0xe0) {
+		*cp = *p & 0x0f;
+		n = 3;
+	} else if ((*p & 0xf8) == 0xf0) {
+		*cp = *p & 0x07;
+		n = 4;
+	} else {
+		*cp = *p;
+		return 1;
+	}
+
+	for (i = 1; i < n; i++) {
+		if ((p[i] & 0xc0) != 0x80) {
+			*cp = *p;
+			return 1;
+		}
+		*cp = (*cp << 6) | (p[i] & 0x3f);
+	}
+
+	return n;
+}
+
+/* next is the text after cp, ASCII punctuation only counts before a space so "3.14" stays whole */
+static whisper_tts_break_t whisper_tts_break(uint32_t cp, const uint8_t *next)
+{
+	switch (cp) {
+	case 0x3002:   /* 。 */
+	case 0xff01:   /* ！ */
+	case 0xff1f:   /* ？ */
+	case 0xff1b:   /* ； */
+	case 0x2026:   /* … */
+	case '\n':
+		return TTS_BREAK_SENTENCE;
+	case 0xff0c:   /* ， */
+	case 0x3001:   /* 、 */
+	case 0xff1a:   /* ： */
+		return TTS_BREAK_CLAUSE;
+	case 0x201d:   /* ” */
+	case 0x2019:   /* ’ */
+	case 0x300d:   /* 」 */
+	case 0x300f:   /* 』 */
+	case 0xff09:   /* ） */
+	case 0x3011:   /* 】 */
+	case ')':
+	case '"':
+	case '\'':
+		return TTS_BREAK_CLOSER;
+	case '.':
+	case '!':
+	case '?':
+	case ';':
+		return !*next || *next == ' ' || *next == '\t' || *next == '\r' ? TTS_BREAK_SENTENCE : TTS_BREAK_NONE;
+	case ',':
+	case ':':
+		return !*next || *next == ' ' ? TTS_BREAK_CLAUSE : TTS_BREAK_NONE;
+	default:
+		return TTS_BREAK_NONE;
+	}
+}
+
+/* Byte length of the next chunk of text, at most max_chars characters where the text allows */
+static switch_size_t whisper_tts_chunk_len(const char *text, uint32_t max_chars, switch_bool_t first)
+{
+	const uint8_t *start = (const uint8_t *) text, *p = start;
+	switch_size_t clause = 0, space = 0;
+	whisper_tts_break_t kind;
+	uint32_t chars = 0, cp;
+
+	while (*p) {
+		p += whisper_utf8_next(p, &cp);
+		chars++;
+		kind = whisper_tts_break(cp, p);
+
+		if (kind == TTS_BREAK_SENTENCE || kind == TTS_BREAK_CLAUSE) {
+			if (chars >= TTS_CHUNK_MIN_CHARS && (kind == TTS_BREAK_SENTENCE || first)) {
+				const uint8_t *q;
+
+				/* take trailing punctuation, closing quotes and spaces along */
+				while (*p) {
+					q = p + whisper_utf8_next(p, &cp);
+					if (cp != ' ' && whisper_tts_break(cp, q) == TTS_BREAK_NONE) {
+						break;
+					}
+					p = q;
+				}
+				return p - start;
+			}
+			clause = p - start;
+		} else if (cp == ' ') {
+			space = p - start;
+		}
+
+		if (chars >= max_chars) {
+			return clause ? clause : space ? space : (switch_size_t) (p - start);
+		}
+	}
+
+	return p - start;
+}
+
+static whisper_tts_chunk_t *whisper_tts_chunk_new(uint32_t id, const char *text, switch_size_t len)
+{
+	whisper_tts_chunk_t *chunk = malloc(sizeof(*chunk) + LWS_PRE + len);
+
+	if (chunk) {
+		chunk->next = NULL;
+		chunk->id = id;
+		chunk->len = len;
+		memcpy(chunk->data + LWS_PRE, text, len);
+	}
+
+	return chunk;
+}
+
+/* Service thread: the next queued message that may go out, requests only while fewer than tts-pipeline-depth are unanswered */
+static whisper_tts_chunk_t *whisper_tts_next_chunk(whisper_tts_t *context)
+{
+	whisper_tts_chunk_t *chunk = NULL;
+
+	switch_mutex_lock(context->mutex);
+	if (context->tx_head && (!context->tx_head->id || context->tx_sent_id + 1 < context->rx_request_id + context->pipeline_depth)) {
+		chunk = context->tx_head;
+		if (!(context->tx_head = chunk->next)) {
+			context->tx_tail = NULL;
+		}
+		if (chunk->id) {
+			context->tx_sent_id = chunk->id;
+		}
+	}
+	switch_mutex_unlock(context->mutex);
+
+	if (chunk && chunk->id) {
+		/* a request goes out, the stall timer runs from here */
+		whisper_atomic_set(context->rx_time, switch_micro_time_now());
+	}
+
+	return chunk;
+}
+
+static void whisper_tts_write_next(whisper_tts_t *context, struct lws *wsi)
+{
+	whisper_tts_chunk_t *chunk;
+
+	if (!(chunk = whisper_tts_next_chunk(context))) {
+		return;
+	}
+
+	if (lws_write(wsi, chunk->data + LWS_PRE, chunk->len, LWS_WRITE_TEXT) < (int) chunk->len) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_ERROR, "Unable to write TTS request\n");
+	}
+	free(chunk);
+
+	if (context->tx_head) {
+		lws_callback_on_writable(wsi);
+	}
+}
+
+/* Service thread: audio for the request being received, SWITCH_TRUE once the buffer reached high-water */
+static switch_bool_t whisper_tts_receive_audio(whisper_tts_t *context, const void *in, switch_size_t len)
+{
+	switch_bool_t paused = SWITCH_FALSE;
+
+	whisper_atomic_set(context->rx_time, switch_micro_time_now());
+
+	if (switch_core_codec_ready(&context->decoder)) {
+		uint32_t dlen = TTS_DECODE_BUFFER_SIZE, drate = context->native_rate;
+		unsigned int dflags = 0;
+
+		if (switch_core_codec_decode(&context->decoder, NULL, (void *) in, (uint32_t) len, context->native_rate,
+									 context->decode_buf, &dlen, &drate, &dflags) != SWITCH_STATUS_SUCCESS) {
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_ERROR, "Unable to decode %" SWITCH_SIZE_T_FMT " bytes of %s\n", len, context->encoding);
+			return SWITCH_FALSE;
+		}
+
+		in = context->decode_buf;
+		len = dlen;
+	}
+
+	switch_mutex_lock(context->mutex);
+	if (context->rx_request_id <= context->cancel_id) {
+		/* late audio for a cancelled prompt */
+		context->cancelled_bytes += len;
+	} else if (switch_buffer_write(context->audio_buffer, in, len) != len) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_ERROR, "TTS audio buffer overflow, %" SWITCH_SIZE_T_FMT " bytes in use\n",
+						  switch_buffer_inuse(context->audio_buffer));
+	}
+
+	if (!context->rx_paused && switch_buffer_inuse(context->audio_buffer) >= context->high_water) {
+		context->rx_paused = 1;
+		paused = SWITCH_TRUE;
+	}
+	switch_mutex_unlock(context->mutex);
+
+	return paused;
+}
+
+/* unix:// TTS server: the same messages, audio arrives in ring records */
+static void whisper_tts_local_text(void *obj, const char *text, switch_size_t len)
+{
+	ws_tts_handle_config((whisper_tts_t *) obj, text, len);
+}
+
+/* Records stay in the ring while the buffer is above high-water, that is the flow control */
+static switch_status_t whisper_tts_local_audio(void *obj, const uint8_t *data, switch_size_t len, uint32_t flags)
+{
+	whisper_tts_t *context = (whisper_tts_t *) obj;
+
+	switch_mutex_lock(context->mutex);
+	if (context->rx_paused) {
+		if (!context->rx_resume) {
+			switch_mutex_unlock(context->mutex);
+			return SWITCH_STATUS_BREAK;
+		}
+		context->rx_resume = 0;
+		context->rx_paused = 0;
+	}
+	switch_mutex_unlock(context->mutex);
+
+	if (len) {
+		whisper_tts_receive_audio(context, data, len);
+	}
+
+	if (flags & LOCAL_REC_END) {
+		whisper_atomic_set(context->rx_request_id, context->rx_request_id + 1);
+	}
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static void whisper_tts_local_writable(void *obj)
+{
+	whisper_tts_t *context = (whisper_tts_t *) obj;
+	whisper_tts_chunk_t *chunk;
+
+	while ((chunk = whisper_tts_next_chunk(context))) {
+		whisper_local_send_text(context->local, (const char *) chunk->data + LWS_PRE, chunk->len);
+		free(chunk);
+	}
+}
+
+static const whisper_local_ops_t whisper_tts_local_ops = {
+	whisper_tts_local_text,
+	whisper_tts_local_audio,
+	whisper_tts_local_writable
+};
+
+/* Wakes the TTS service thread: queued requests, or room in the buffer again */
+void whisper_tts_wake(whisper_tts_t *context)
+{
+	if (context->local) {
+		whisper_local_wake(context->local);
+	} else if (context->lws_context) {
+		lws_cancel_service(context->lws_context);
+	}
+}
+
+/* Caller holds context->mutex */
+static void whisper_tts_queue(whisper_tts_t *context, whisper_tts_chunk_t *first, whisper_tts_chunk_t *last, switch_bool_t urgent)
+{
+	if (urgent) {
+		last->next = context->tx_head;
+		context->tx_head = first;
+		if (!context->tx_tail) {
+			context->tx_tail = last;
+		}
+	} else {
+		if (context->tx_tail) {
+			context->tx_tail->next = first;
+		} else {
+			context->tx_head = first;
+		}
+		context->tx_tail = last;
+	}
+}
+
+/* Splits the prompt into requests, numbered on from the last one, and hands them to the service thread */
+switch_status_t whisper_send_speech_text(whisper_tts_t *context, const char *text)
+{
+	whisper_tts_chunk_t *first = NULL, *last = NULL, *chunk;
+	const char *p = text;
+	switch_size_t len;
+	uint32_t n = 0;
+
+	while (*p) {
+		len = context->chunk_chars ? whisper_tts_chunk_len(p, context->chunk_chars, n == 0) : strlen(p);
+
+		if (!(chunk = whisper_tts_chunk_new(0, p, len))) {
+			whisper_tts_queue_free(first);
+			return SWITCH_STATUS_MEMERR;
+		}
+		if (last) {
+			last->next = chunk;
+		} else {
+			first = chunk;
+		}
+		last = chunk;
+		n++;
+		p += len;
+	}
+
+	if (!first) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	switch_mutex_lock(context->mutex);
+	for (chunk = first; chunk; chunk = chunk->next) {
+		/* the watchdog reads it without the mutex */
+		chunk->id = context->request_id + 1;
+		whisper_atomic_set(context->request_id, chunk->id);
+	}
+	whisper_tts_queue(context, first, last, SWITCH_FALSE);
+	switch_mutex_unlock(context->mutex);
+
+	if (n > 1) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "TTS prompt split into %u requests\n", n);
+	}
+
+	whisper_tts_wake(context);
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* Caller holds context->mutex. Drops the requests not written yet, the server never saw their ids */
+void whisper_tts_drop_queued(whisper_tts_t *context)
+{
+	whisper_tts_chunk_t **pp = &context->tx_head, *chunk;
+
+	context->tx_tail = NULL;
+	while ((chunk = *pp)) {
+		if (chunk->id) {
+			*pp = chunk->next;
+			free(chunk);
+		} else {
+			context->tx_tail = chunk;
+			pp = &chunk->next;
+		}
+	}
+
+	whisper_atomic_set(context->request_id, context->tx_sent_id);
+}
+
+void whisper_tts_queue_free(whisper_tts_chunk_t *chunk)
+{
+	whisper_tts_chunk_t *next;
+
+	for (; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+}
+
 int callback_ws_tts(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len)
 {
 	whisper_tts_t *context = (whisper_tts_t *)lws_wsi_user(wsi);
 
     switch (reason) {
+		case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+			/* woken by the reader once the buffer drained below the low-water mark */
+			context = (whisper_tts_t *)lws_context_user(lws_get_context(wsi));
+			if (context && context->wsi) {
+				int resume, writable;
+
+				switch_mutex_lock(context->mutex);
+				if ((resume = context->rx_resume)) {
+					context->rx_resume = 0;
+					context->rx_paused = 0;
+				}
+				/* or by a new prompt */
+				writable = context->tx_head != NULL;
+				switch_mutex_unlock(context->mutex);
+
+				if (resume) {
+					lws_rx_flow_control(context->wsi, 1);
+				}
+				if (writable) {
+					lws_callback_on_writable(context->wsi);
+				}
+			}
+			break;
+		case LWS_CALLBACK_CLIENT_WRITEABLE:
+			whisper_tts_write_next(context, wsi);
+			break;
         case LWS_CALLBACK_CLIENT_ESTABLISHED:
 			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "WebSockets TTS client established. [%p]\n", (void *)wsi);
-			context->wc_connected = TRUE;
+			ws_client_established(wsi, context->settings->tcp_nodelay);
+			whisper_atomic_set(context->wc_connected, TRUE);
             break;
         case LWS_CALLBACK_CLIENT_RECEIVE:
 			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "WS receiving TTS data\n");
-
-			if (lws_frame_is_binary(context->wsi)) {
-				switch_buffer_write(context->audio_buffer, in, len);				
+			ws_thread_rx(context->ws_cpu);
+
+			if (lws_frame_is_binary(wsi)) {
+				if (whisper_tts_receive_audio(context, in, len)) {
+					lws_rx_flow_control(wsi, 0);
+				}
+
+				/* the connection stays open for the next prompt */
+				if (lws_is_final_fragment(wsi)) {
+					whisper_atomic_set(context->rx_request_id, context->rx_request_id + 1);
+					/* room for the next chunk in the pipeline */
+					if (context->tx_head) {
+						lws_callback_on_writable(wsi);
+					}
+				}
 			} else {
-				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "WebSockets RX: Frame not received in binary mode");
-			}
-
-			if (lws_is_final_fragment(context->wsi)) {
-				lws_close_reason(wsi, LWS_CLOSE_STATUS_NORMAL, (unsigned char *)"seeya", 5);
-				return -1;
+				ws_tts_handle_config(context, (const char *)in, len);
 			}
             break;
         case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
 			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Websocket TTS connection error\n");
-			context->wc_error = TRUE;
+			whisper_atomic_set(context->wc_error, TRUE);
 			return -1;
 		    break;        
 		case LWS_CALLBACK_CLIENT_CLOSED:
 			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Websocket TTS client connection closed.\n");
-			context->started = WS_STATE_DESTROY;
+			whisper_atomic_set(context->started, WS_STATE_DESTROY);
 			return -1;
 		    break;    
         default:
@@ -78,10 +882,19 @@ switch_status_t ws_tts_setup_connection(char * tts_server_uri, whisper_tts_t *te
 	int logs = LLL_USER | LLL_ERR | LLL_WARN;
 	const char *prot;
 
+	if (whisper_local_url(tts_server_uri)) {
+		/* co-located server, no websocket framing */
+		context->local = whisper_local_connect(tts_server_uri, "tts", &whisper_tts_local_ops, context, context->settings, &context->started);
+		whisper_atomic_set(context->wc_connected, context->local != NULL);
+		return context->local ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_FALSE;
+	}
+
 	context->lws_info.port = CONTEXT_PORT_NO_LISTEN;
 	context->lws_info.protocols = ws_tts_protocols;
 	context->lws_info.gid = -1;
 	context->lws_info.uid = -1;
+	context->lws_info.user = context;
+	ws_client_context_init(&context->lws_info, context->settings);
 
 	lws_set_log_level(logs, NULL);
 	
@@ -101,13 +914,8 @@ switch_status_t ws_tts_setup_connection(char * tts_server_uri, whisper_tts_t *te
 		return SWITCH_CAUSE_INVALID_URL;
 	}
 
-	if (!strcmp(prot, "ws")) {
-		context->lws_ccinfo.ssl_connection = 0;
-	} else {
-		context->lws_ccinfo.ssl_connection = 2;
-	}
-	
     context->lws_ccinfo.context = context->lws_context;
+	ws_client_connect_init(&context->lws_ccinfo, &context->lws_retry, prot, context->settings);
     context->lws_ccinfo.host = lws_canonical_hostname(context->lws_context);
     context->lws_ccinfo.origin = "origin";
 	context->lws_ccinfo.userdata = (whisper_tts_t *) context;
@@ -120,13 +928,9 @@ switch_status_t ws_tts_setup_connection(char * tts_server_uri, whisper_tts_t *te
 			return SWITCH_CAUSE_DESTINATION_OUT_OF_ORDER;
 	}
 
-	ws_tts_thread_launch(context, pool);
-
-	while (!(context->wc_connected || context->wc_error)) {
-		usleep(30000);
-	}
+	ws_tts_thread_launch(context, pool);
 
-	if (context->wc_error == TRUE) {
+	if (ws_wait_connected(&context->wc_connected, &context->wc_error) != SWITCH_STATUS_SUCCESS) {
 			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "Websocket connect failed\n");
 			return SWITCH_STATUS_FALSE;
 	}
@@ -136,74 +940,387 @@ switch_status_t ws_tts_setup_connection(char * tts_server_uri, whisper_tts_t *te
 
 void ws_tts_thread_launch(whisper_tts_t *tech_pvt, switch_memory_pool_t *pool)
 {
-	switch_thread_t *thread;
 	switch_threadattr_t *thd_attr = NULL;
 
+	/* joined on close, the context lives in the session arena */
 	switch_threadattr_create(&thd_attr, pool);
-	switch_threadattr_detach_set(thd_attr, 1);
 	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
-	tech_pvt->started = WS_STATE_STARTED;
-	switch_thread_create(&thread, thd_attr, ws_tts_thread_run, tech_pvt, pool);
+	tech_pvt->ws_cpu = ws_thread_cpu_pick(tech_pvt->settings);
+	whisper_atomic_set(tech_pvt->started, WS_STATE_STARTED);
+	switch_thread_create(&tech_pvt->thread, thd_attr, ws_tts_thread_run, tech_pvt, pool);
 }
 
 // thread for handling websocket connection
 void *SWITCH_THREAD_FUNC ws_tts_thread_run(switch_thread_t *thread, void *obj) {
 	whisper_tts_t *context = (whisper_tts_t *) obj;
-	do {
-		lws_service(context->lws_context, WS_TIMEOUT_MS);
-	} while (context->started == WS_STATE_STARTED);
+	int n = 0;
+
+	ws_thread_enter(context->ws_cpu);
+
+	while (whisper_atomic_get(context->started) == WS_STATE_STARTED && n >= 0) {
+		n = lws_service(context->lws_context, WS_TIMEOUT_MS);
+	}
+
+	/* a failed service loop leaves nobody reading the socket, readers must see it */
+	whisper_atomic_set(context->started, WS_STATE_DESTROY);
+	ws_thread_exit(context->ws_cpu);
     return NULL;
 }
 
 void ws_tts_close_connection(whisper_tts_t *tech_pvt) {
 	whisper_tts_t *context = (whisper_tts_t *) tech_pvt;
+	switch_status_t retval;
+
+	if (context->local) {
+		whisper_atomic_set(context->started, WS_STATE_DESTROY);
+		whisper_local_close(&context->local);
+		return;
+	}
 
+	if (!context->lws_context) {
+		return;
+	}
+
+	whisper_atomic_set(context->started, WS_STATE_DESTROY);
 	lws_cancel_service(context->lws_context);
-	context->started = WS_STATE_DESTROY;
+
+	/* the context is only destroyed once the thread is out of lws_service */
+	if (context->thread) {
+		switch_thread_join(&retval, context->thread);
+		context->thread = NULL;
+	}
+
+	ws_tls_session_save(&context->lws_ccinfo);
 	lws_context_destroy(context->lws_context);
+	context->lws_context = NULL;
 }
 
 //ASR Functions
+
+struct whisper_pace_frame {
+	struct whisper_pace_frame *next;
+	switch_time_t due;
+	enum lws_write_protocol proto;
+	switch_size_t len;
+	uint8_t data[];                 /* frame starts LWS_PRE in */
+};
+
+/* Media clock position in ms of the oldest buffered byte, or of the block of rlen bytes just read before it */
+static uint32_t whisper_media_ms(whisper_t *context, switch_size_t rlen)
+{
+	switch_size_t queued = rlen + (context->audio_buffer ? switch_buffer_inuse(context->audio_buffer) : 0);
+
+	if (!context->rate) {
+		return 0;
+	}
+
+	return (uint32_t) ((context->fed_samples - queued / sizeof(int16_t)) * 1000 / context->rate);
+}
+
+/*
+ * When a block captured at ts_ms may go out: at its place on the capture clock, and once behind
+ * no faster than catchup times real time. Media thread only, 0 when pacing is off.
+ */
+static switch_time_t whisper_pace_due(whisper_pace_t *pace, uint32_t ts_ms, uint32_t dur_ms)
+{
+	switch_time_t now = switch_micro_time_now(), due, lag;
+	uint64_t lag_ms, max;
+
+	if (!pace->catchup) {
+		return 0;
+	}
+
+	if (!pace->epoch) {
+		/* first block of the utterance goes now and anchors the clock */
+		pace->epoch = now - (switch_time_t) ts_ms * 1000;
+		pace->next = 0;
+	}
+
+	due = pace->epoch + (switch_time_t) ts_ms * 1000;
+
+	__atomic_add_fetch(&whisper_globals.paced_blocks, 1, __ATOMIC_RELAXED);
+	if ((lag = now - due) > (switch_time_t) dur_ms * 1000) {
+		__atomic_add_fetch(&whisper_globals.paced_late_blocks, 1, __ATOMIC_RELAXED);
+		lag_ms = lag / 1000;
+		max = whisper_atomic_get(whisper_globals.paced_lag_max_ms);
+		while (lag_ms > max && !__atomic_compare_exchange_n(&whisper_globals.paced_lag_max_ms, &max, lag_ms, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}
+
+	if (due < pace->next) {
+		due = pace->next;
+	}
+	pace->next = due + (switch_time_t) dur_ms * 1000 / pace->catchup;
+
+	return due;
+}
+
+/* Paced per-call connection: everything queues behind the audio and the service thread writes it */
+static switch_status_t whisper_pace_queue(whisper_t *context, enum lws_write_protocol proto, const uint8_t *header, const void *data, switch_size_t len, switch_time_t due)
+{
+	switch_size_t hlen = header ? MUX_HEADER_SIZE : 0;
+	whisper_pace_frame_t *frame;
+
+	if (whisper_atomic_get(context->started) != WS_STATE_STARTED) {
+		return SWITCH_STATUS_BREAK;
+	}
+
+	frame = malloc(sizeof(*frame) + LWS_PRE + hlen + len);
+	switch_assert(frame);
+	frame->next = NULL;
+	frame->due = due;
+	frame->proto = proto;
+	frame->len = hlen + len;
+	if (hlen) {
+		memcpy(frame->data + LWS_PRE, header, hlen);
+	}
+	memcpy(frame->data + LWS_PRE + hlen, data, len);
+
+	switch_mutex_lock(context->pace_mutex);
+	if (context->pace_tail) {
+		context->pace_tail->next = frame;
+	} else {
+		context->pace_head = frame;
+	}
+	context->pace_tail = frame;
+	switch_mutex_unlock(context->pace_mutex);
+
+	lws_cancel_service(context->lws_context);
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* Service thread: one frame per writeable callback, a timer for a head frame still ahead of its time */
+void whisper_pace_write_next(whisper_t *context)
+{
+	switch_time_t now = switch_micro_time_now(), wait = 0;
+	whisper_pace_frame_t *frame;
+	int more = 0;
+
+	switch_mutex_lock(context->pace_mutex);
+	if ((frame = context->pace_head) && frame->due > now) {
+		wait = frame->due - now;
+		frame = NULL;
+	} else if (frame) {
+		if (!(context->pace_head = frame->next)) {
+			context->pace_tail = NULL;
+		}
+		more = context->pace_head != NULL;
+	}
+	switch_mutex_unlock(context->pace_mutex);
+
+	if (wait) {
+		lws_set_timer_usecs(context->wsi, wait);
+		return;
+	}
+
+	if (frame) {
+		if (lws_write(context->wsi, frame->data + LWS_PRE, frame->len, frame->proto) < 0) {
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_ERROR, "Unable to write paced frame\n");
+		}
+		free(frame);
+	}
+
+	if (more) {
+		lws_callback_on_writable(context->wsi);
+	}
+}
+
+/* Whatever was not written goes with the connection, the service thread is gone */
+static void whisper_pace_flush(whisper_t *context)
+{
+	whisper_pace_frame_t *frame;
+
+	while ((frame = context->pace_head)) {
+		context->pace_head = frame->next;
+		free(frame);
+	}
+	context->pace_tail = NULL;
+	context->pace.epoch = 0;
+}
+
+/* Text and control messages on a per-call connection */
+static switch_status_t whisper_asr_send_string(whisper_t *context, char *text)
+{
+	if (context->local) {
+		return whisper_local_send_text(context->local, text, strlen(text));
+	}
+
+	if (context->pace.catchup) {
+		return whisper_pace_queue(context, LWS_WRITE_TEXT, NULL, text, strlen(text), 0);
+	}
+
+	return ws_send_text(context->wsi, text);
+}
+
+static switch_status_t whisper_asr_send_json(whisper_t *context, ks_json_t *req)
+{
+	char *text = ks_json_print_unformatted(req);
+	switch_status_t status;
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Sending json string to websocket server %s\n", text);
+	status = whisper_asr_send_string(context, text);
+	free(text);
+
+	return status;
+}
+
+/* Reply text into a buffer the session reuses, NULL when it cannot grow */
+static char *whisper_reply_copy(whisper_text_buf_t *buf, const char *in, size_t len)
+{
+	if (len + 1 > buf->size) {
+		char *data;
+
+		if (!(data = realloc(buf->data, len + 1))) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "No memory for a %" SWITCH_SIZE_T_FMT " byte ASR reply\n", (switch_size_t) len);
+			return NULL;
+		}
+		buf->data = data;
+		buf->size = len + 1;
+	}
+
+	memcpy(buf->data, in, len);
+	buf->data[len] = '\0';
+
+	return buf->data;
+}
+
+void whisper_reply_buffers_free(whisper_t *context)
+{
+	switch_safe_free(context->spec_buf.data);
+	switch_safe_free(context->final_buf.data);
+	switch_safe_free(context->drop_buf.data);
+	context->spec_buf.size = context->final_buf.size = context->drop_buf.size = 0;
+	context->spec_text = NULL;
+}
+
+/*
+ * Pops the kind of the reply just received, the media thread may retarget a SPEC slot until we claim it.
+ * A SPEC reply is kept in spec_buf: only one speculative request is live, so nothing overwrites it
+ * before the media thread promotes or discards it.
+ */
+static whisper_reply_kind_t whisper_take_reply(whisper_t *context, const char *in, size_t len)
+{
+	uint32_t rx = whisper_atomic_get(context->reply_rx);
+	int slot = rx % ASR_REPLY_RING_SIZE;
+	int kind;
+
+	if (rx == whisper_atomic_get(context->reply_tx)) {
+		/* unsolicited, treat it as a result like before */
+		return ASR_REPLY_FINAL;
+	}
+
+	whisper_atomic_set(context->reply_rx, rx + 1);
+	kind = whisper_atomic_get(context->reply_kind[slot]);
+
+	if (kind == ASR_REPLY_SPEC && (context->spec_text = whisper_reply_copy(&context->spec_buf, in, len))) {
+		/* publish before claiming, a failed retarget on the media side means the text is there */
+		whisper_atomic_set(context->spec_ready, 1);
+
+		if (__atomic_compare_exchange_n(&context->reply_kind[slot], &kind, ASR_REPLY_NONE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			return ASR_REPLY_SPEC;
+		}
+
+		whisper_atomic_set(context->spec_ready, 0);
+	}
+
+	return __atomic_exchange_n(&context->reply_kind[slot], ASR_REPLY_NONE, __ATOMIC_ACQ_REL);
+}
+
+/* A text reply from the server, the mux connection or the loopback stand-in */
+void whisper_asr_receive_text(whisper_t *context, const char *in, size_t len)
+{
+	switch_time_t sent;
+	char *text;
+
+	switch (whisper_take_reply(context, in, len)) {
+	case ASR_REPLY_SPEC:
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Speculative text: %s \n", context->spec_text);
+		whisper_tap_event(context->tap, "speculative_result", context->spec_text);
+		return;
+	case ASR_REPLY_DROP:
+	case ASR_REPLY_DISCARD:
+		if ((text = whisper_reply_copy(&context->drop_buf, in, len))) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Dropping text: %s \n", text);
+			whisper_tap_event(context->tap, "dropped_result", text);
+		}
+		return;
+	default:
+		break;
+	}
+
+	if ((sent = __atomic_exchange_n(&context->final_time, 0, __ATOMIC_ACQ_REL)) && context->route_stats) {
+		whisper_route_stats_record(context->route_stats, switch_micro_time_now() - sent);
+	}
+
+	/* the media thread may still be copying the previous result out of final_buf */
+	if (!whisper_flag_test(context, ASRFLAG_RESULT_PENDING)) {
+		if ((text = whisper_reply_copy(&context->drop_buf, in, len))) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "No result pending, dropping text: %s \n", text);
+			whisper_tap_event(context->tap, "dropped_result", text);
+		}
+		return;
+	}
+
+	if (!(text = whisper_reply_copy(&context->final_buf, in, len))) {
+		text = "";
+	}
+
+	whisper_tap_event(context->tap, "result", text);
+	context->result_text = text;
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Text: %s \n", context->result_text);
+
+	/* publishes result_text to the media thread */
+	whisper_flag_transition(context, 0, ASRFLAG_RESULT_PENDING, ASRFLAG_RESULT_READY);
+}
+
 int callback_ws_asr(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len)
 {
 	whisper_t *context = (whisper_t *)lws_wsi_user(wsi);
+	const void *msg = in;
 	
 	// switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "WebSockets CB ->. [%d]\n", reason);
     
 	switch (reason) {
+		case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+			/* the media thread queued paced frames */
+			context = (whisper_t *)lws_context_user(lws_get_context(wsi));
+			if (context && context->pace.catchup && context->wsi && whisper_atomic_get(context->wc_connected)) {
+				lws_callback_on_writable(context->wsi);
+			}
+			break;
+		case LWS_CALLBACK_TIMER:
+			lws_callback_on_writable(wsi);
+			break;
+		case LWS_CALLBACK_CLIENT_WRITEABLE:
+			whisper_pace_write_next(context);
+			break;
         case LWS_CALLBACK_CLIENT_ESTABLISHED:
 			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "WebSockets ASR client established. [%p]\n", (void *)wsi);
-			context->wc_connected = TRUE;
+			ws_client_established(wsi, context->settings->tcp_nodelay);
+			whisper_atomic_set(context->wc_connected, TRUE);
             break;
         case LWS_CALLBACK_CLIENT_RECEIVE:
 			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "WS receiving ASR data\n");
+			ws_thread_rx(context->ws_cpu);
 			if (!lws_frame_is_binary(context->wsi)) {
-				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Text: %s \n", (char *)in);
-				context->result_text = switch_safe_strdup((const char *)in); 
+				/* one reply pops one reply kind, however many fragments it came in */
+				if (ws_rx_message(&context->rx, wsi, &msg, &len, context->asr_url)) {
+					whisper_asr_receive_text(context, (const char *) msg, len);
+				}
+			} else {
+				whisper_flag_transition(context, 0, ASRFLAG_RESULT_PENDING, ASRFLAG_RESULT_READY);
 			}
 
-			switch_mutex_lock(context->mutex);
-
-			switch_set_flag(context, ASRFLAG_RESULT_READY);
-			switch_clear_flag(context, ASRFLAG_RESULT_PENDING);
-			
-			switch_mutex_unlock(context->mutex);
-			
             break;
 
         case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
 			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Websocket ASR connection error\n");
-			switch_mutex_lock(context->mutex);
-			context->wc_error = TRUE;
-			switch_mutex_unlock(context->mutex);
+			whisper_atomic_set(context->wc_error, TRUE);
 			return -1;
 		    break;        
 		case LWS_CALLBACK_CLIENT_CLOSED:	
 			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Websocket ASR client connection closed. %d\n", context->started);
-			switch_mutex_lock(context->mutex);
-			context->started = WS_STATE_DESTROY;
-			//context->wc_connected = TRUE;
-			switch_mutex_unlock(context->mutex);			
+			whisper_atomic_set(context->started, WS_STATE_DESTROY);
 			return -1;
 		    break;    
         default:
@@ -212,11 +1329,39 @@ int callback_ws_asr(struct lws *wsi, enum lws_callback_reasons reason, void *use
     return 0;
 }
 
+static void whisper_asr_local_text(void *obj, const char *text, switch_size_t len)
+{
+	whisper_asr_receive_text((whisper_t *) obj, text, len);
+}
+
+static const whisper_local_ops_t whisper_asr_local_ops = {
+	whisper_asr_local_text,
+	NULL,
+	NULL
+};
+
 switch_status_t ws_asr_setup_connection(char * asr_server_uri, whisper_t *tech_pvt, switch_memory_pool_t *pool) {
 	whisper_t *context = (whisper_t *) tech_pvt;
 	int logs = LLL_USER | LLL_ERR | LLL_WARN ;
 	const char *prot;
 
+	if (context->loopback) {
+		whisper_atomic_set(context->wc_connected, TRUE);
+		whisper_atomic_set(context->started, WS_STATE_STARTED);
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	if (whisper_local_url(asr_server_uri)) {
+		/* co-located server: control on the socket, audio through shared memory, never multiplexed */
+		context->local = whisper_local_connect(asr_server_uri, "asr", &whisper_asr_local_ops, context, context->settings, &context->started);
+		whisper_atomic_set(context->wc_connected, context->local != NULL);
+		return context->local ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_FALSE;
+	}
+
+	if (context->settings->asr_mux_connections) {
+		return whisper_mux_attach(context, asr_server_uri, context->settings->asr_mux_connections);
+	}
+
 	memset(&context->lws_info, 0, sizeof(context->lws_info));
 	memset(&context->lws_ccinfo, 0, sizeof(context->lws_ccinfo));
 	
@@ -224,14 +1369,12 @@ switch_status_t ws_asr_setup_connection(char * asr_server_uri, whisper_t *tech_p
 	context->lws_info.protocols = ws_asr_protocols;
 	context->lws_info.gid = -1;
 	context->lws_info.uid = -1;
+	context->lws_info.user = context;
+	ws_client_context_init(&context->lws_info, context->settings);
 
 	lws_set_log_level(logs, NULL);
 
-	switch_mutex_lock(context->mutex);
-
 	context->lws_context = lws_create_context(&context->lws_info);
-	
-	switch_mutex_unlock(context->mutex);
 
 	if (context->lws_context == NULL) {
 			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "Creating libwebsocket context failed\n");
@@ -247,13 +1390,8 @@ switch_status_t ws_asr_setup_connection(char * asr_server_uri, whisper_t *tech_p
 		return SWITCH_CAUSE_INVALID_URL;
 	}
 
-	if (!strcmp(prot, "ws")) {
-		context->lws_ccinfo.ssl_connection = 0;
-	} else {
-		context->lws_ccinfo.ssl_connection = 2;
-	}
-	switch_mutex_lock(context->mutex);
     context->lws_ccinfo.context = context->lws_context;
+	ws_client_connect_init(&context->lws_ccinfo, &context->lws_retry, prot, context->settings);
     context->lws_ccinfo.host = lws_canonical_hostname(context->lws_context);
     context->lws_ccinfo.origin = "origin";
 	context->lws_ccinfo.userdata = (whisper_t *) context;
@@ -261,8 +1399,6 @@ switch_status_t ws_asr_setup_connection(char * asr_server_uri, whisper_t *tech_p
 
     context->wsi = lws_client_connect_via_info(&context->lws_ccinfo);
 
-	switch_mutex_unlock(context->mutex);
-
     if (context->wsi == NULL) {
 			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "Websocket setup failed\n");
 			return SWITCH_CAUSE_DESTINATION_OUT_OF_ORDER;
@@ -270,11 +1406,7 @@ switch_status_t ws_asr_setup_connection(char * asr_server_uri, whisper_t *tech_p
 
 	ws_asr_thread_launch(context, pool);
 
-	while (!(context->wc_connected || context->wc_error)) {
-		switch_sleep(10000);
-	}	
-
-	if (context->wc_error == TRUE) {
+	if (ws_wait_connected(&context->wc_connected, &context->wc_error) != SWITCH_STATUS_SUCCESS) {
 			ws_asr_close_connection(context);
 			return SWITCH_STATUS_FALSE;
 	}
@@ -284,36 +1416,92 @@ switch_status_t ws_asr_setup_connection(char * asr_server_uri, whisper_t *tech_p
 
 void ws_asr_thread_launch(whisper_t *tech_pvt, switch_memory_pool_t *pool)
 {
-	switch_thread_t *thread;
 	switch_threadattr_t *thd_attr = NULL;
 
+	/* joined on close, the context lives in the session arena */
 	switch_threadattr_create(&thd_attr, pool);
-	switch_threadattr_detach_set(thd_attr, 1);
 	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
-	tech_pvt->started = WS_STATE_STARTED;
-	switch_thread_create(&thread, thd_attr, ws_asr_thread_run, tech_pvt, pool);
+	tech_pvt->ws_cpu = ws_thread_cpu_pick(tech_pvt->settings);
+	whisper_atomic_set(tech_pvt->started, WS_STATE_STARTED);
+	switch_thread_create(&tech_pvt->thread, thd_attr, ws_asr_thread_run, tech_pvt, pool);
 }
 
 // thread for handling websocket connection
 void *SWITCH_THREAD_FUNC ws_asr_thread_run(switch_thread_t *thread, void *obj) {
 	whisper_t *context = (whisper_t *) obj;
-	int n; 
-	while (context->started == WS_STATE_STARTED && n >= 0) {
+	int n = 0;
+
+	ws_thread_enter(context->ws_cpu);
+
+	while (whisper_atomic_get(context->started) == WS_STATE_STARTED && n >= 0) {
 		n = lws_service(context->lws_context, WS_TIMEOUT_MS);
 	}
 
-	lws_context_destroy(context->lws_context);
-	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "Exiting ASR lws_service thread!\n");
+	if (n < 0) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_ERROR, "ASR lws_service failed, dropping the connection\n");
+	}
+
+	/* the feed path and the watchdog both treat this as a lost connection */
+	whisper_atomic_set(context->started, WS_STATE_DESTROY);
+	ws_thread_exit(context->ws_cpu);
 	return NULL;
 }
 
+/* A server that accepts the socket but never finishes the handshake counts as a failed connect */
+switch_status_t ws_wait_connected(volatile int *connected, volatile int *error)
+{
+	switch_time_t deadline = switch_micro_time_now() + (switch_time_t) WS_HANDSHAKE_TIMEOUT_MS * 1000;
+
+	while (!(whisper_atomic_get(*connected) || whisper_atomic_get(*error))) {
+		if (switch_micro_time_now() >= deadline) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Websocket handshake timed out after %dms\n", WS_HANDSHAKE_TIMEOUT_MS);
+			__atomic_add_fetch(&whisper_globals.handshake_timeouts, 1, __ATOMIC_RELAXED);
+			whisper_atomic_set(*error, TRUE);
+			break;
+		}
+		switch_sleep(10000);
+	}
+
+	return whisper_atomic_get(*error) ? SWITCH_STATUS_FALSE : SWITCH_STATUS_SUCCESS;
+}
+
 void ws_asr_close_connection(whisper_t *tech_pvt) {
 	whisper_t *context = (whisper_t *) tech_pvt;
+	switch_status_t retval;
+
+	if (context->mux) {
+		whisper_mux_detach(context);
+		whisper_atomic_set(context->started, WS_STATE_DESTROY);
+		whisper_pace_flush(context);
+		return;
+	}
+
+	if (context->local) {
+		whisper_atomic_set(context->started, WS_STATE_DESTROY);
+		whisper_local_close(&context->local);
+		context->pace.epoch = 0;
+		return;
+	}
+
+	if (!context->lws_context) {
+		return;
+	}
 
-	context->started = WS_STATE_DESTROY;
+	whisper_atomic_set(context->started, WS_STATE_DESTROY);
 
 	lws_cancel_service(context->lws_context);	
-	
+
+	if (context->thread) {
+		switch_thread_join(&retval, context->thread);
+		context->thread = NULL;
+	}
+
+	ws_tls_session_save(&context->lws_ccinfo);
+	lws_context_destroy(context->lws_context);
+	context->lws_context = NULL;
+	context->wsi = NULL;
+	ws_rx_free(&context->rx);
+	whisper_pace_flush(context);
 }
 
 switch_status_t ws_send_binary(struct lws *websocket, void *data, int rlen) 
@@ -331,39 +1519,147 @@ switch_status_t ws_send_binary(struct lws *websocket, void *data, int rlen)
 	return SWITCH_STATUS_SUCCESS;
 }
 
+/* data must be preceded by LWS_PRE bytes of headroom */
+switch_status_t ws_send_binary_prepadded(struct lws *websocket, void *data, int rlen)
+{
+	if (lws_write(websocket, (unsigned char *) data, rlen, LWS_WRITE_BINARY) < 0) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "Unable to write message \n");
+		return SWITCH_STATUS_BREAK;
+	}
+	return SWITCH_STATUS_SUCCESS;
+}
+
 switch_status_t ws_send_text(struct lws *websocket, char *text) 
 {
-	unsigned char buffer[LWS_SEND_BUFFER_PRE_PADDING + strlen(text) + LWS_SEND_BUFFER_POST_PADDING];
-	unsigned char *p = &buffer[LWS_SEND_BUFFER_PRE_PADDING];
+	switch_size_t len = strlen(text);
+	unsigned char *buffer = NULL;
+	unsigned char *p;
+	switch_status_t status = SWITCH_STATUS_SUCCESS;
+
+	/* grammars can be large, keep them off the media thread stack */
+	switch_malloc(buffer, LWS_SEND_BUFFER_PRE_PADDING + len + LWS_SEND_BUFFER_POST_PADDING);
+	p = &buffer[LWS_SEND_BUFFER_PRE_PADDING];
 
-	memcpy(p, text, strlen(text));
+	memcpy(p, text, len);
 	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "text: %s\n", text);
 	
-	if (lws_write(websocket, p, strlen(text), LWS_WRITE_TEXT) < 0) {
+	if (lws_write(websocket, p, len, LWS_WRITE_TEXT) < 0) {
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "Unable to write message\n");
-		return SWITCH_STATUS_BREAK;
-	}		
-	return SWITCH_STATUS_SUCCESS;
+		status = SWITCH_STATUS_BREAK;
+	}
+
+	free(buffer);
+	return status;
 }
 
 switch_status_t ws_send_json(struct lws *websocket, ks_json_t *json_object) 
 {
 	char *request_str = NULL;
+	switch_status_t status;
 
 	request_str = ks_json_print_unformatted(json_object);
 
 	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Sending json string to websocket server %s\n", request_str);
 
-	return ws_send_text(websocket, request_str);
+	status = ws_send_text(websocket, request_str);
+	free(request_str);
+
+	return status;
+}
+
+/* Answers the request just queued with the next recorded reply */
+static switch_status_t whisper_loopback_reply(whisper_t *context)
+{
+	whisper_loopback_t *loopback = context->loopback;
+	const char *text = loopback->next < loopback->nreplies ? loopback->replies[loopback->next++] : "";
+
+	whisper_asr_receive_text(context, text, strlen(text));
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* A block just read from the audio buffer, stamped with the media time of its first sample */
+switch_status_t whisper_send_audio(whisper_t *context, uint8_t *data, int rlen)
+{
+	uint32_t ts_ms, dur_ms;
+	switch_time_t due;
+
+	if (context->loopback) {
+		context->loopback->audio_bytes += rlen;
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	ts_ms = whisper_media_ms(context, rlen);
+
+	if (context->local) {
+		/* the server reads the capture time from the record, nothing to pace */
+		return whisper_local_send_audio(context->local, ts_ms, data, rlen);
+	}
+
+	dur_ms = context->rate ? (uint32_t) (rlen / sizeof(int16_t) * 1000 / context->rate) : 0;
+	due = whisper_pace_due(&context->pace, ts_ms, dur_ms);
+
+	if (context->mux) {
+		return whisper_mux_send(context, 0, ts_ms, due, data, rlen);
+	}
+
+	if (context->pace.catchup) {
+		uint8_t header[MUX_HEADER_SIZE];
+
+		whisper_mux_header(header, 0, context->audio_seq++, 0, ts_ms);
+		return whisper_pace_queue(context, LWS_WRITE_BINARY, header, data, rlen, due);
+	}
+
+	return ws_send_binary_prepadded(context->wsi, data, rlen);
+}
+
+/* Grammars and other JSON control messages */
+switch_status_t whisper_send_text_request(whisper_t *context, char *text)
+{
+	if (context->loopback) {
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	if (context->mux) {
+		return whisper_mux_send(context, MUX_FLAG_TEXT, whisper_media_ms(context, 0), 0, text, strlen(text));
+	}
+
+	return whisper_asr_send_string(context, text);
 }
 
-switch_status_t whisper_get_final_transcription(whisper_t *context)
+/* Replies come back in request order, remember what each one is for before it goes out */
+static void whisper_expect_reply(whisper_t *context, whisper_reply_kind_t kind)
+{
+	uint32_t tx = whisper_atomic_get(context->reply_tx);
+
+	whisper_atomic_set(context->reply_kind[tx % ASR_REPLY_RING_SIZE], kind);
+	whisper_atomic_set(context->reply_tx, tx + 1);
+}
+
+switch_status_t whisper_get_final_transcription(whisper_t *context, whisper_reply_kind_t kind)
 {
 	ks_json_t *req = ks_json_create_object();
 
 	ks_json_add_string_to_object(req, "eof", "true");
 
-	if (ws_send_json(context->wsi, req) != SWITCH_STATUS_SUCCESS) {
+	whisper_expect_reply(context, kind);
+	if (kind == ASR_REPLY_FINAL) {
+		whisper_atomic_set(context->final_time, switch_micro_time_now());
+	}
+	/* the next utterance anchors the pacing clock again */
+	context->pace.epoch = 0;
+
+	if (context->loopback) {
+		ks_json_delete(&req);
+		return whisper_loopback_reply(context);
+	}
+
+	if (context->mux) {
+		ks_json_delete(&req);
+		return whisper_mux_send(context, MUX_FLAG_EOF, whisper_media_ms(context, 0), 0, NULL, 0);
+	}
+
+	if (whisper_asr_send_json(context, req) != SWITCH_STATUS_SUCCESS) {
 		ks_json_delete(&req);
 		return SWITCH_STATUS_BREAK;
 	}
@@ -372,6 +1668,85 @@ switch_status_t whisper_get_final_transcription(whisper_t *context)
 	return SWITCH_STATUS_SUCCESS;
 }
 
+/* Ask for the transcript so far without ending the utterance */
+switch_status_t whisper_get_speculative_transcription(whisper_t *context)
+{
+	ks_json_t *req = ks_json_create_object();
+	switch_status_t status;
+
+	ks_json_add_true_to_object(req, "finalize");
+
+	context->spec_slot = whisper_atomic_get(context->reply_tx) % ASR_REPLY_RING_SIZE;
+	whisper_expect_reply(context, ASR_REPLY_SPEC);
+
+	if (context->loopback) {
+		status = whisper_loopback_reply(context);
+	} else if (context->mux) {
+		status = whisper_mux_send(context, MUX_FLAG_FINALIZE, whisper_media_ms(context, 0), 0, NULL, 0);
+	} else {
+		status = whisper_asr_send_json(context, req);
+	}
+
+	ks_json_delete(&req);
+	return status;
+}
+
+switch_status_t whisper_send_speech_config(whisper_tts_t *context)
+{
+	ks_json_t *req = ks_json_create_object();
+	ks_json_t *config = ks_json_create_object();
+	switch_status_t status;
+
+	ks_json_add_number_to_object(config, "sample_rate", context->native_rate);
+	ks_json_add_string_to_object(config, "encoding", context->encoding);
+	ks_json_add_number_to_object(config, "frame_ms", context->frame_ms);
+	ks_json_add_string_to_object(config, "voice", context->voice);
+	ks_json_add_item_to_object(req, "config", config);
+
+	if (context->local) {
+		char *str = ks_json_print_unformatted(req);
+
+		status = str ? whisper_local_send_text(context->local, str, strlen(str)) : SWITCH_STATUS_MEMERR;
+		switch_safe_free(str);
+	} else {
+		status = ws_send_json(context->wsi, req);
+	}
+
+	ks_json_delete(&req);
+	return status;
+}
+
+/*
+ * Goes out ahead of any queued requests, written by the service thread like them.
+ * The server ends each cancelled request with a final fragment, or answers
+ * {"cancelled": request_id} after their last audio.
+ */
+switch_status_t whisper_cancel_speech_synthesis(whisper_tts_t *context, uint32_t request_id)
+{
+	ks_json_t *req = ks_json_create_object();
+	whisper_tts_chunk_t *chunk;
+	char *str;
+
+	ks_json_add_true_to_object(req, "cancel");
+	ks_json_add_number_to_object(req, "request_id", request_id);
+	str = ks_json_print_unformatted(req);
+	ks_json_delete(&req);
+
+	if (!str || !(chunk = whisper_tts_chunk_new(0, str, strlen(str)))) {
+		switch_safe_free(str);
+		return SWITCH_STATUS_MEMERR;
+	}
+	free(str);
+
+	switch_mutex_lock(context->mutex);
+	whisper_tts_queue(context, chunk, chunk, SWITCH_TRUE);
+	switch_mutex_unlock(context->mutex);
+
+	whisper_tts_wake(context);
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
 switch_status_t whisper_get_speech_synthesis(whisper_tts_t *context)
 {
 	int poll_result;
@@ -412,7 +1787,7 @@ void whisper_fire_event(whisper_t *context, char * event_subclass) {
 				switch_core_session_rwunlock(session);
 			}
 
-			if (switch_test_flag(context, ASRFLAG_TIMEOUT)) {
+			if (whisper_flag_test(context, ASRFLAG_TIMEOUT)) {
 				switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Stop-Reason", "timeout");
 			}
 
@@ -14,13 +14,43 @@ switch_status_t ws_asr_setup_connection(char * asr_server_uri, whisper_t *tech_p
 void *SWITCH_THREAD_FUNC ws_asr_thread_run(switch_thread_t *thread, void *obj);
 void ws_asr_thread_launch(whisper_t *tech_pvt, switch_memory_pool_t *pool);
 void ws_asr_close_connection(whisper_t *tech_pvt);
+switch_status_t ws_wait_connected(volatile int *connected, volatile int *error);
+
+void ws_client_context_init(struct lws_context_creation_info *info, whisper_settings_t *settings);
+void ws_client_connect_init(struct lws_client_connect_info *ccinfo, lws_retry_bo_t *retry, const char *prot, whisper_settings_t *settings);
+void ws_client_established(struct lws *wsi, switch_bool_t nodelay);
+void ws_tls_session_save(struct lws_client_connect_info *ccinfo);
+void ws_tls_session_flush(void);
+
+int ws_thread_cpu_current(void);
+void ws_thread_cpu_hint(int cpu);
+int ws_thread_cpu_pick(whisper_settings_t *settings);
+void ws_thread_enter(int cpu);
+void ws_thread_exit(int cpu);
+void ws_thread_rx(int cpu);
+
+switch_bool_t ws_rx_message(whisper_ws_rx_t *rx, struct lws *wsi, const void **in, size_t *len, const char *url);
+void ws_rx_free(whisper_ws_rx_t *rx);
 
 switch_status_t ws_send_binary(struct lws *websocket, void *data, int rlen); 
+switch_status_t ws_send_binary_prepadded(struct lws *websocket, void *data, int rlen);
 
 switch_status_t ws_send_text(struct lws *websocket, char *text) ;
 switch_status_t ws_send_json(struct lws *websocket, ks_json_t *json_object) ;
-switch_status_t whisper_get_final_transcription(whisper_t *context);
+switch_status_t whisper_send_audio(whisper_t *context, uint8_t *data, int rlen);
+void whisper_pace_write_next(whisper_t *context);
+switch_status_t whisper_send_text_request(whisper_t *context, char *text);
+void whisper_asr_receive_text(whisper_t *context, const char *in, size_t len);
+void whisper_reply_buffers_free(whisper_t *context);
+switch_status_t whisper_get_final_transcription(whisper_t *context, whisper_reply_kind_t kind);
+switch_status_t whisper_get_speculative_transcription(whisper_t *context);
 void whisper_fire_event(whisper_t *context, char * event_subclass);
 switch_status_t whisper_get_speech_synthesis(whisper_tts_t *context);
+switch_status_t whisper_send_speech_config(whisper_tts_t *context);
+switch_status_t whisper_cancel_speech_synthesis(whisper_tts_t *context, uint32_t request_id);
+switch_status_t whisper_send_speech_text(whisper_tts_t *context, const char *text);
+void whisper_tts_drop_queued(whisper_tts_t *context);
+void whisper_tts_wake(whisper_tts_t *context);
+void whisper_tts_queue_free(whisper_tts_chunk_t *chunk);
 
 #endif
@@ -0,0 +1,143 @@
+/*
+ * Standalone whisper bench: runs "whisper bench" without a switch, with every malloc,
+ * calloc and realloc of the process counted so the report carries allocs_per_op.
+ *
+ *   make whisper_bench
+ *   ./whisper_bench [-conf <dir>] [iterations=<n>] [rates=<hz,...>] [frames=<ms,...>]
+ *
+ * The module is linked in and loaded directly on a minimal core; the bench runs on
+ * loopback recognizers, so no ASR/TTS server is needed. lws_write and the calls that
+ * wake a service thread are stubbed below, which adds the ws_send stages: the real
+ * per-call send path with its framing, paced and not. whisper.conf is read from
+ * <dir> (default the switch conf directory) when present.
+ */
+
+#include <switch.h>
+#include <libwebsockets.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+SWITCH_MODULE_LOAD_FUNCTION(mod_whisper_load);
+SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_whisper_shutdown);
+
+/* glibc's own entry points, the wrappers below forward to them */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t bench_allocs;
+
+void *malloc(size_t size)
+{
+	__atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+/* Overrides the weak declaration in mod_whisper.c */
+uint64_t whisper_bench_allocs(void)
+{
+	return __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+}
+
+/*
+ * libwebsockets stand-ins for the ws_send stages. The module sources are linked into this program,
+ * so their calls land here and no connection is needed. lws_write frames in place like the real one:
+ * the websocket header goes into the LWS_PRE bytes before buf.
+ */
+static uint8_t bench_wsi;
+static volatile uint64_t bench_wire_bytes;
+
+struct lws *whisper_bench_wsi(void)
+{
+	return (struct lws *) &bench_wsi;
+}
+
+int lws_write(struct lws *wsi, unsigned char *buf, size_t len, enum lws_write_protocol wp)
+{
+	size_t hlen = len < 126 ? 2 : len < 65536 ? 4 : 10;
+
+	buf[-(int) hlen] = (unsigned char) (0x80 | (wp & 0x0f));
+	buf[1 - (int) hlen] = (unsigned char) (len < 126 ? len : len < 65536 ? 126 : 127);
+	bench_wire_bytes += hlen + len;
+
+	return (int) len;
+}
+
+void lws_cancel_service(struct lws_context *context)
+{
+}
+
+int lws_callback_on_writable(struct lws *wsi)
+{
+	return 1;
+}
+
+void lws_set_timer_usecs(struct lws *wsi, lws_usec_t usecs)
+{
+}
+
+int main(int argc, char *argv[])
+{
+	switch_loadable_module_interface_t *module_interface = NULL;
+	switch_api_interface_t *api;
+	switch_memory_pool_t *pool = NULL;
+	switch_stream_handle_t stream = { 0 };
+	const char *err = NULL;
+	char cmd[1024] = "bench";
+	size_t len = strlen(cmd);
+	int i, status = 1;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-conf") && i + 1 < argc) {
+			SWITCH_GLOBAL_dirs.conf_dir = strdup(argv[++i]);
+		} else if (len + strlen(argv[i]) + 2 < sizeof(cmd)) {
+			len += snprintf(cmd + len, sizeof(cmd) - len, " %s", argv[i]);
+		}
+	}
+
+	if (switch_core_init(SCF_MINIMAL, SWITCH_FALSE, &err) != SWITCH_STATUS_SUCCESS) {
+		fprintf(stderr, "Unable to start the core: %s\n", err ? err : "unknown error");
+		return 1;
+	}
+
+	if (switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS || mod_whisper_load(&module_interface, pool) != SWITCH_STATUS_SUCCESS) {
+		fprintf(stderr, "Unable to load mod_whisper\n");
+		goto end;
+	}
+
+	for (api = module_interface->api_interface; api; api = api->next) {
+		if (!strcmp(api->interface_name, "whisper")) {
+			break;
+		}
+	}
+
+	if (api) {
+		SWITCH_STANDARD_STREAM(stream);
+		api->function(cmd, NULL, &stream);
+		fputs((char *) stream.data, stdout);
+		status = strncmp((char *) stream.data, "-ERR", 4) ? 0 : 1;
+		switch_safe_free(stream.data);
+	}
+
+	mod_whisper_shutdown();
+
+  end:
+	if (pool) {
+		switch_core_destroy_memory_pool(&pool);
+	}
+	switch_core_destroy();
+
+	return status;
+}
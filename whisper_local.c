@@ -0,0 +1,431 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "mod_whisper.h"
+#include "websock_glue.h"
+#include "whisper_local.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+
+/* One direction of the shared memory, head and tail run freely and wrap at 2^32 */
+typedef struct {
+	volatile uint32_t head;        /* producer */
+	uint8_t pad1[60];
+	volatile uint32_t tail;        /* consumer */
+	volatile uint32_t waiting;     /* consumer is about to sleep on its eventfd */
+	uint8_t pad2[56];
+} whisper_local_ring_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t ring_size;
+	uint8_t pad[52];
+	whisper_local_ring_t to_server;
+	whisper_local_ring_t to_client;
+	/* to_server data, then to_client data, ring_size bytes each */
+} whisper_local_shm_t;
+
+typedef struct {
+	uint32_t len;
+	uint32_t flags;
+	uint32_t ts_ms;
+	uint32_t seq;
+} whisper_local_rec_t;
+
+struct whisper_local {
+	switch_memory_pool_t *pool;
+	switch_thread_t *thread;
+	const whisper_local_ops_t *ops;
+	void *obj;
+	volatile int *started;
+	volatile int running;
+	int sock;
+	int server_efd;                /* server sleeps on it, we write it */
+	int client_efd;                /* we sleep on it, the server and whisper_local_wake write it */
+	int ws_cpu;
+	whisper_local_shm_t *shm;
+	switch_size_t shm_size;
+	uint32_t ring_size;            /* ours, the copy in shm is the server's to overwrite */
+	uint8_t *tx_data;
+	uint8_t *rx_data;
+	uint32_t seq;
+	char *msg;                     /* LOCAL_MSG_MAX, service thread only */
+};
+
+#define LOCAL_ALIGN(len) (((len) + 15) & ~(uint32_t) 15)
+
+switch_bool_t whisper_local_url(const char *url)
+{
+	return url && !strncasecmp(url, LOCAL_URL_PREFIX, strlen(LOCAL_URL_PREFIX));
+}
+
+static void whisper_local_kick(int efd)
+{
+	uint64_t one = 1;
+
+	if (write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Unable to signal the local transport: %s\n", strerror(errno));
+	}
+}
+
+/* Producer side: room for a record of len payload bytes, padding past the end of the ring if needed */
+static uint8_t *whisper_local_reserve(whisper_local_ring_t *ring, uint8_t *data, uint32_t size, uint32_t len, uint32_t *head)
+{
+	uint32_t need = LOCAL_REC_HEADER_SIZE + LOCAL_ALIGN(len);
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	uint32_t off = *head & (size - 1), room = size - off;
+
+	if (need > room) {
+		/* the record must not wrap, skip to the start */
+		if (*head + room - tail + need > size) {
+			return NULL;
+		}
+		((whisper_local_rec_t *) (data + off))->flags = LOCAL_REC_PAD;
+		((whisper_local_rec_t *) (data + off))->len = room - LOCAL_REC_HEADER_SIZE;
+		*head += room;
+		off = 0;
+	} else if (*head - tail + need > size) {
+		return NULL;
+	}
+
+	return data + off;
+}
+
+/* Media thread, the only producer of the ASR audio ring */
+switch_status_t whisper_local_send_audio(whisper_local_t *local, uint32_t ts_ms, const void *data, switch_size_t len)
+{
+	whisper_local_ring_t *ring = &local->shm->to_server;
+	uint32_t head = ring->head;
+	whisper_local_rec_t *rec;
+
+	if (!(rec = (whisper_local_rec_t *) whisper_local_reserve(ring, local->tx_data, local->ring_size, (uint32_t) len, &head))) {
+		/* the server is behind, losing a block beats ending the call's recognition; the seq gap shows it */
+		local->seq++;
+		__atomic_add_fetch(&whisper_globals.local_ring_full, 1, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST)) {
+			whisper_local_kick(local->server_efd);
+		}
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	rec->len = (uint32_t) len;
+	rec->flags = 0;
+	rec->ts_ms = ts_ms;
+	rec->seq = local->seq++;
+	memcpy((uint8_t *) rec + LOCAL_REC_HEADER_SIZE, data, len);
+
+	__atomic_store_n(&ring->head, head + LOCAL_REC_HEADER_SIZE + LOCAL_ALIGN((uint32_t) len), __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST)) {
+		whisper_local_kick(local->server_efd);
+	}
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* Any thread, one packet per message */
+switch_status_t whisper_local_send_text(whisper_local_t *local, const char *text, switch_size_t len)
+{
+	if (send(local->sock, text, len, MSG_NOSIGNAL) != (ssize_t) len) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Unable to write local message: %s\n", strerror(errno));
+		return SWITCH_STATUS_BREAK;
+	}
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+void whisper_local_wake(whisper_local_t *local)
+{
+	if (local) {
+		whisper_local_kick(local->client_efd);
+	}
+}
+
+/* Service thread: hands TTS records to the owner, SWITCH_TRUE when it is full and has to wake us */
+static switch_bool_t whisper_local_drain(whisper_local_t *local)
+{
+	whisper_local_ring_t *ring = &local->shm->to_client;
+	uint32_t size = local->ring_size, tail = ring->tail, start = tail, head, len, off;
+	switch_bool_t blocked = SWITCH_FALSE;
+	whisper_local_rec_t *rec;
+
+	while ((head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) != tail) {
+		off = tail & (size - 1);
+		rec = (whisper_local_rec_t *) (local->rx_data + off);
+		/* the server can rewrite the record, check and use one copy */
+		len = __atomic_load_n(&rec->len, __ATOMIC_RELAXED);
+
+		if (head - tail > size || len > size || off + LOCAL_REC_HEADER_SIZE + LOCAL_ALIGN(len) > size) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Corrupt local ring, dropping the connection\n");
+			whisper_atomic_set(*local->started, WS_STATE_DESTROY);
+			return SWITCH_TRUE;
+		}
+
+		if (!(rec->flags & LOCAL_REC_PAD)) {
+			if (!local->ops->on_audio ||
+				local->ops->on_audio(local->obj, (uint8_t *) rec + LOCAL_REC_HEADER_SIZE, len, rec->flags) == SWITCH_STATUS_BREAK) {
+				blocked = SWITCH_TRUE;
+				break;
+			}
+		}
+
+		tail += LOCAL_REC_HEADER_SIZE + LOCAL_ALIGN(len);
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	if (tail != start) {
+		/* the server may be waiting for room */
+		whisper_local_kick(local->server_efd);
+	}
+
+	return blocked;
+}
+
+/* Service thread: every control message waiting on the socket */
+static switch_bool_t whisper_local_receive(whisper_local_t *local)
+{
+	ssize_t n;
+
+	while ((n = recv(local->sock, local->msg, LOCAL_MSG_MAX, MSG_DONTWAIT | MSG_TRUNC)) > 0) {
+		if (n > LOCAL_MSG_MAX) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Local message of %d bytes truncated\n", (int) n);
+			n = LOCAL_MSG_MAX;
+		}
+		ws_thread_rx(local->ws_cpu);
+		if (local->ops->on_text) {
+			local->ops->on_text(local->obj, local->msg, (switch_size_t) n);
+		}
+	}
+
+	/* 0 is the server closing the socket */
+	return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+}
+
+static void *SWITCH_THREAD_FUNC whisper_local_thread_run(switch_thread_t *thread, void *obj)
+{
+	whisper_local_t *local = (whisper_local_t *) obj;
+	whisper_local_ring_t *ring = &local->shm->to_client;
+	struct pollfd pfds[2];
+	uint64_t count;
+
+	ws_thread_enter(local->ws_cpu);
+
+	while (whisper_atomic_get(local->running) && whisper_atomic_get(*local->started) == WS_STATE_STARTED) {
+		switch_bool_t blocked = whisper_local_drain(local);
+
+		if (local->ops->on_writable) {
+			local->ops->on_writable(local->obj);
+		}
+
+		/* recheck after announcing the sleep, a record published in between kicks client_efd */
+		__atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+
+		pfds[0].fd = local->sock;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = local->client_efd;
+		pfds[1].events = POLLIN;
+		pfds[0].revents = pfds[1].revents = 0;
+
+		/* with records waiting only look at the socket */
+		poll(pfds, 2, blocked || __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == ring->tail ? WS_TIMEOUT_MS : 0);
+		__atomic_store_n(&ring->waiting, 0, __ATOMIC_SEQ_CST);
+
+		if (pfds[1].revents & POLLIN) {
+			if (read(local->client_efd, &count, sizeof(count)) < 0) {
+				/* nothing to clear */
+			}
+		}
+
+		if ((pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) && !whisper_local_receive(local)) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Local server closed the connection\n");
+			break;
+		}
+	}
+
+	whisper_atomic_set(*local->started, WS_STATE_DESTROY);
+	ws_thread_exit(local->ws_cpu);
+
+	return NULL;
+}
+
+/* Hands the shared memory and both eventfds to the server with the open request */
+static switch_status_t whisper_local_hello(whisper_local_t *local, int memfd, const char *kind)
+{
+	char hello[128];
+	int fds[3] = { memfd, local->server_efd, local->client_efd };
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov;
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	struct pollfd pfd;
+	ssize_t n;
+
+	switch_snprintf(hello, sizeof(hello), "{\"open\":\"%s\",\"version\":%d,\"ring_size\":%d}", kind, LOCAL_PROTOCOL_VERSION, LOCAL_RING_SIZE);
+
+	iov.iov_base = hello;
+	iov.iov_len = strlen(hello);
+	memset(control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(local->sock, &msg, MSG_NOSIGNAL) < 0) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Unable to send the local open request: %s\n", strerror(errno));
+		return SWITCH_STATUS_FALSE;
+	}
+
+	/* the server answers {"ready": true} once it has mapped the rings */
+	pfd.fd = local->sock;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, WS_HANDSHAKE_TIMEOUT_MS) <= 0 || (n = recv(local->sock, local->msg, LOCAL_MSG_MAX - 1, 0)) <= 0) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Local server did not accept the session within %dms\n", WS_HANDSHAKE_TIMEOUT_MS);
+		__atomic_add_fetch(&whisper_globals.handshake_timeouts, 1, __ATOMIC_RELAXED);
+		return SWITCH_STATUS_FALSE;
+	}
+	local->msg[n] = '\0';
+
+	if (!strstr(local->msg, "\"ready\"")) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Local server refused the session: %s\n", local->msg);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static void whisper_local_free(whisper_local_t *local)
+{
+	switch_memory_pool_t *pool = local->pool;
+
+	if (local->sock >= 0) {
+		close(local->sock);
+	}
+	if (local->server_efd >= 0) {
+		close(local->server_efd);
+	}
+	if (local->client_efd >= 0) {
+		close(local->client_efd);
+	}
+	if (local->shm) {
+		munmap(local->shm, local->shm_size);
+	}
+	switch_safe_free(local->msg);
+	switch_core_destroy_memory_pool(&pool);
+}
+
+/* Connects, maps the rings and starts the service thread; *started is set like a websocket's */
+whisper_local_t *whisper_local_connect(const char *url, const char *kind, const whisper_local_ops_t *ops, void *obj,
+									   whisper_settings_t *settings, volatile int *started)
+{
+	const char *path = url + strlen(LOCAL_URL_PREFIX);
+	switch_memory_pool_t *pool = NULL;
+	switch_threadattr_t *thd_attr = NULL;
+	struct sockaddr_un addr = { 0 };
+	whisper_local_t *local;
+	int memfd = -1;
+
+	if (zstr(path) || strlen(path) >= sizeof(addr.sun_path)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Invalid local server url %s\n", url);
+		return NULL;
+	}
+
+	if (switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS) {
+		return NULL;
+	}
+
+	local = switch_core_alloc(pool, sizeof(*local));
+	local->pool = pool;
+	local->ops = ops;
+	local->obj = obj;
+	local->started = started;
+	local->server_efd = local->client_efd = -1;
+	local->shm_size = sizeof(whisper_local_shm_t) + 2 * LOCAL_RING_SIZE;
+	local->msg = malloc(LOCAL_MSG_MAX);
+
+	if ((local->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0 || !local->msg) {
+		goto fail;
+	}
+
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (connect(local->sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Unable to connect to local server %s: %s\n", path, strerror(errno));
+		goto fail;
+	}
+
+	if ((memfd = memfd_create("whisper", MFD_CLOEXEC)) < 0 || ftruncate(memfd, local->shm_size) < 0 ||
+		(local->shm = mmap(NULL, local->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0)) == MAP_FAILED) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Unable to create the local rings: %s\n", strerror(errno));
+		local->shm = NULL;
+		goto fail;
+	}
+
+	local->shm->magic = LOCAL_MAGIC;
+	local->shm->version = LOCAL_PROTOCOL_VERSION;
+	local->ring_size = local->shm->ring_size = LOCAL_RING_SIZE;
+	local->tx_data = (uint8_t *) (local->shm + 1);
+	local->rx_data = local->tx_data + LOCAL_RING_SIZE;
+
+	if ((local->server_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 || (local->client_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		goto fail;
+	}
+
+	if (whisper_local_hello(local, memfd, kind) != SWITCH_STATUS_SUCCESS) {
+		goto fail;
+	}
+	/* the server holds its own mapping now */
+	close(memfd);
+	memfd = -1;
+
+	__atomic_add_fetch(&whisper_globals.local_connections, 1, __ATOMIC_RELAXED);
+
+	local->ws_cpu = ws_thread_cpu_pick(settings);
+	whisper_atomic_set(local->running, 1);
+	whisper_atomic_set(*started, WS_STATE_STARTED);
+	switch_threadattr_create(&thd_attr, pool);
+	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+
+	if (switch_thread_create(&local->thread, thd_attr, whisper_local_thread_run, local, pool) != SWITCH_STATUS_SUCCESS) {
+		whisper_atomic_set(*started, WS_STATE_DESTROY);
+		goto fail;
+	}
+
+	return local;
+
+  fail:
+	if (memfd >= 0) {
+		close(memfd);
+	}
+	whisper_local_free(local);
+	return NULL;
+}
+
+void whisper_local_close(whisper_local_t **local)
+{
+	switch_status_t retval;
+
+	if (!*local) {
+		return;
+	}
+
+	whisper_atomic_set((*local)->running, 0);
+	whisper_local_kick((*local)->client_efd);
+
+	if ((*local)->thread) {
+		switch_thread_join(&retval, (*local)->thread);
+	}
+
+	/* the server sees the socket close and unmaps its side */
+	whisper_local_free(*local);
+	*local = NULL;
+}
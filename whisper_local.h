@@ -0,0 +1,46 @@
+#ifndef __WHISPER_LOCAL_H__
+#define __WHISPER_LOCAL_H__
+
+#include "mod_whisper.h"
+
+/*
+ * 本机传输: 服务器与 FreeSWITCH 在同一台机器上时用 unix:///path/to.sock 代替 ws://.
+ * 控制消息 (与 websocket 文本帧相同的 JSON) 走 SOCK_SEQPACKET unix 域套接字, 一个包一条消息.
+ * 音频走每个会话一块共享内存 (memfd, 连接时用 SCM_RIGHTS 连同两个 eventfd 交给服务器),
+ * 其中两个单生产者单消费者环: to_server 是 ASR 音频, to_client 是 TTS PCM.
+ * 环中每条记录 16 字节头 {len, flags, ts_ms, seq} 加负载, 按 16 字节对齐, 不跨越环尾 (剩余空间不够时写一条 PAD 记录跳回开头).
+ * 消费者睡眠前置 waiting, 生产者发布记录后看到 waiting 才写对方的 eventfd.
+ * ASR 环满时丢弃音频块, seq 照样递增, 服务器据此发现缺口.
+ * 协议细节和参考服务器见 scripts/whisper_local_server.py
+ */
+#define LOCAL_URL_PREFIX "unix://"
+#define LOCAL_PROTOCOL_VERSION 1
+#define LOCAL_MAGIC 0x57484c31         // "WHL1"
+#define LOCAL_RING_SIZE (256 * 1024)   // 每个方向, 2 的幂
+#define LOCAL_MSG_MAX 65536            // 控制消息上限, 与 grammar-max-size 默认值相同
+#define LOCAL_REC_HEADER_SIZE 16
+
+typedef enum {
+	LOCAL_REC_PAD = (1 << 0),      // 跳到环的开头
+	LOCAL_REC_END = (1 << 1)       // TTS: 本请求的最后一条, 等同 websocket 的最后一个分片
+} whisper_local_rec_flag_t;
+
+typedef struct whisper_local whisper_local_t;
+
+// 回调都在连接的服务线程中执行
+typedef struct {
+	void (*on_text)(void *obj, const char *text, switch_size_t len);
+	switch_status_t (*on_audio)(void *obj, const uint8_t *data, switch_size_t len, uint32_t flags);  // SWITCH_STATUS_BREAK 表示暂时不能接收, 唤醒后重试
+	void (*on_writable)(void *obj);
+} whisper_local_ops_t;
+
+switch_bool_t whisper_local_url(const char *url);
+whisper_local_t *whisper_local_connect(const char *url, const char *kind, const whisper_local_ops_t *ops, void *obj,
+									   whisper_settings_t *settings, volatile int *started);
+void whisper_local_close(whisper_local_t **local);
+
+switch_status_t whisper_local_send_text(whisper_local_t *local, const char *text, switch_size_t len);
+switch_status_t whisper_local_send_audio(whisper_local_t *local, uint32_t ts_ms, const void *data, switch_size_t len);
+void whisper_local_wake(whisper_local_t *local);
+
+#endif
@@ -0,0 +1,739 @@
+#include "mod_whisper.h"
+#include "websock_glue.h"
+#include "whisper_mux.h"
+
+typedef struct whisper_mux_frame {
+	struct whisper_mux_frame *next;
+	switch_time_t due;              /* paced audio is held until then, 0 goes out in turn */
+	switch_size_t len;              /* header + payload, data starts LWS_PRE in */
+	uint8_t data[];
+} whisper_mux_frame_t;
+
+/* Outlives its whisper_t until the queued frames, CLOSE included, are written */
+typedef struct whisper_mux_stream {
+	uint32_t id;
+	uint32_t seq;
+	uint32_t ts_ms;                 /* media time of the last frame, stamped on CLOSE */
+	whisper_t *context;             /* NULL once detached */
+	whisper_mux_frame_t *head, *tail;
+	struct whisper_mux_stream *ready_next;
+	int ready;
+} whisper_mux_stream_t;
+
+typedef struct {
+	uint32_t id;
+	uint32_t ts_ms;
+	switch_time_t queued;
+} whisper_mux_batch_entry_t;
+
+struct whisper_mux {
+	char *url;
+	switch_memory_pool_t *pool;
+	switch_mutex_t *mutex;
+	switch_thread_t *thread;
+
+	struct lws_context *lws_context;
+	struct lws_context_creation_info lws_info;
+	struct lws_client_connect_info lws_ccinfo;
+	lws_retry_bo_t lws_retry;
+	switch_bool_t tcp_nodelay;
+	int ws_cpu;
+	struct lws *wsi;
+	volatile int wc_connected;
+	volatile int wc_error;
+	volatile int started;
+
+	whisper_mux_stream_t *streams[MUX_MAX_STREAMS];
+	uint32_t next_id;
+	uint32_t nstreams;
+	int orphan;                     /* replaced in the registry, freed by the last detach */
+
+	/* a reply split over several fragments, the header is in the first */
+	whisper_ws_rx_t rx;
+
+	/* streams with queued frames, served one frame each in turn */
+	whisper_mux_stream_t *ready_head, *ready_tail;
+
+	/* eofs waiting to share one request */
+	whisper_mux_batch_entry_t batch[MUX_BATCH_MAX];
+	uint32_t batch_count;
+	uint32_t batch_seq;
+	switch_time_t batch_due;
+};
+
+typedef struct {
+	char *url;
+	whisper_mux_t *muxes[MUX_MAX_CONNECTIONS];
+	uint32_t connecting;            /* slots reserved by an attach that is connecting */
+} whisper_mux_endpoint_t;
+
+static struct {
+	switch_memory_pool_t *pool;
+	switch_mutex_t *mutex;
+	switch_hash_t *endpoints;
+} mux_globals;
+
+static struct lws_protocols ws_mux_protocols[] = {
+	{
+		"WSBRIDGE",
+		callback_ws_mux,
+		0,
+		RX_BUFFER_SIZE,
+	},
+	{ NULL, NULL, 0, 0 } /* end */
+};
+
+static void whisper_mux_put32(uint8_t *p, uint32_t v)
+{
+	p[0] = (uint8_t) (v >> 24);
+	p[1] = (uint8_t) (v >> 16);
+	p[2] = (uint8_t) (v >> 8);
+	p[3] = (uint8_t) v;
+}
+
+static uint32_t whisper_mux_get32(const uint8_t *p)
+{
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+void whisper_mux_header(uint8_t *p, uint32_t stream_id, uint32_t seq, uint32_t flags, uint32_t ts_ms)
+{
+	whisper_mux_put32(p, stream_id);
+	whisper_mux_put32(p + 4, seq);
+	whisper_mux_put32(p + 8, flags);
+	whisper_mux_put32(p + 12, ts_ms);
+}
+
+/* mux->mutex held */
+static void whisper_mux_queue(whisper_mux_t *mux, whisper_mux_stream_t *stream, uint32_t flags, uint32_t ts_ms, switch_time_t due,
+							  const void *data, switch_size_t len)
+{
+	whisper_mux_frame_t *frame = malloc(sizeof(*frame) + LWS_PRE + MUX_HEADER_SIZE + len);
+	uint8_t *p;
+
+	switch_assert(frame);
+
+	frame->next = NULL;
+	frame->due = due;
+	frame->len = MUX_HEADER_SIZE + len;
+	stream->ts_ms = ts_ms;
+
+	p = frame->data + LWS_PRE;
+	whisper_mux_header(p, stream->id, stream->seq++, flags, ts_ms);
+	if (len) {
+		memcpy(p + MUX_HEADER_SIZE, data, len);
+	}
+
+	if (stream->tail) {
+		stream->tail->next = frame;
+	} else {
+		stream->head = frame;
+	}
+	stream->tail = frame;
+
+	if (!stream->ready) {
+		stream->ready = 1;
+		stream->ready_next = NULL;
+		if (mux->ready_tail) {
+			mux->ready_tail->ready_next = stream;
+		} else {
+			mux->ready_head = stream;
+		}
+		mux->ready_tail = stream;
+	}
+}
+
+/* mux->mutex held: the eof waits up to window_ms for others, a full batch makes it a plain eof */
+static void whisper_mux_batch_add(whisper_mux_t *mux, whisper_mux_stream_t *stream, uint32_t ts_ms, uint32_t window_ms)
+{
+	switch_time_t now = switch_micro_time_now(), due = now + (switch_time_t) window_ms * 1000;
+	whisper_mux_batch_entry_t *entry;
+
+	if (mux->batch_count == MUX_BATCH_MAX) {
+		whisper_mux_queue(mux, stream, MUX_FLAG_EOF, ts_ms, 0, NULL, 0);
+		return;
+	}
+
+	entry = &mux->batch[mux->batch_count++];
+	entry->id = stream->id;
+	entry->ts_ms = ts_ms;
+	entry->queued = now;
+	stream->ts_ms = ts_ms;
+
+	if (!mux->batch_due || due < mux->batch_due) {
+		mux->batch_due = due;
+	}
+}
+
+/*
+ * mux->mutex held: the batch frame once the window closed or it is full, and only after every
+ * member's audio went out. Members that detached meanwhile are left out. *wait gets the window end.
+ */
+static whisper_mux_frame_t *whisper_mux_batch_take(whisper_mux_t *mux, switch_time_t now, switch_time_t *wait)
+{
+	whisper_mux_frame_t *frame;
+	whisper_mux_stream_t *stream;
+	uint64_t waited, max;
+	uint32_t i, n = 0;
+	uint8_t *p;
+
+	if (!mux->batch_count) {
+		return NULL;
+	}
+
+	if (mux->batch_due > now && mux->batch_count < MUX_BATCH_MAX) {
+		if (!*wait || mux->batch_due < *wait) {
+			*wait = mux->batch_due;
+		}
+		return NULL;
+	}
+
+	for (i = 0; i < mux->batch_count; i++) {
+		stream = mux->streams[mux->batch[i].id % MUX_MAX_STREAMS];
+		if (stream && stream->id == mux->batch[i].id && stream->head) {
+			/* the writer gets to its audio first */
+			return NULL;
+		}
+	}
+
+	frame = malloc(sizeof(*frame) + LWS_PRE + MUX_HEADER_SIZE + mux->batch_count * 8);
+	switch_assert(frame);
+	frame->next = NULL;
+	frame->due = 0;
+	p = frame->data + LWS_PRE + MUX_HEADER_SIZE;
+
+	for (i = 0; i < mux->batch_count; i++) {
+		stream = mux->streams[mux->batch[i].id % MUX_MAX_STREAMS];
+		if (!stream || stream->id != mux->batch[i].id || !stream->context) {
+			continue;
+		}
+
+		whisper_mux_put32(p, mux->batch[i].id);
+		whisper_mux_put32(p + 4, mux->batch[i].ts_ms);
+		p += 8;
+		n++;
+
+		waited = now - mux->batch[i].queued;
+		__atomic_add_fetch(&whisper_globals.asr_batch_wait_us, waited, __ATOMIC_RELAXED);
+		max = whisper_atomic_get(whisper_globals.asr_batch_wait_max_us);
+		while (waited > max && !__atomic_compare_exchange_n(&whisper_globals.asr_batch_wait_max_us, &max, waited, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}
+
+	mux->batch_count = 0;
+	mux->batch_due = 0;
+
+	if (!n) {
+		free(frame);
+		return NULL;
+	}
+
+	frame->len = MUX_HEADER_SIZE + n * 8;
+	whisper_mux_header(frame->data + LWS_PRE, 0, mux->batch_seq++, MUX_FLAG_EOF | MUX_FLAG_BATCH, 0);
+
+	__atomic_add_fetch(&whisper_globals.asr_batches, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&whisper_globals.asr_batched_eofs, n, __ATOMIC_RELAXED);
+
+	return frame;
+}
+
+static void whisper_mux_stream_free(whisper_mux_stream_t *stream)
+{
+	whisper_mux_frame_t *frame, *next;
+
+	for (frame = stream->head; frame; frame = next) {
+		next = frame->next;
+		free(frame);
+	}
+
+	free(stream);
+}
+
+/*
+ * Writes one frame from the first ready stream whose next frame is due, then moves that stream to the back.
+ * Streams held back by pacing keep their place, a timer wakes the writer for the earliest of them.
+ * A closed eof batch goes ahead of everything.
+ */
+static void whisper_mux_write_next(whisper_mux_t *mux)
+{
+	whisper_mux_stream_t *stream, *prev = NULL;
+	whisper_mux_frame_t *frame = NULL;
+	switch_time_t now = switch_micro_time_now(), wait = 0;
+	int more = 0;
+
+	switch_mutex_lock(mux->mutex);
+	if ((frame = whisper_mux_batch_take(mux, now, &wait))) {
+		more = mux->ready_head != NULL;
+		switch_mutex_unlock(mux->mutex);
+		goto write;
+	}
+
+	for (stream = mux->ready_head; stream && stream->head->due > now; prev = stream, stream = stream->ready_next) {
+		if (!wait || stream->head->due < wait) {
+			wait = stream->head->due;
+		}
+	}
+
+	if (stream) {
+		if (prev) {
+			prev->ready_next = stream->ready_next;
+		} else {
+			mux->ready_head = stream->ready_next;
+		}
+		if (mux->ready_tail == stream) {
+			mux->ready_tail = prev;
+		}
+
+		frame = stream->head;
+		if (!(stream->head = frame->next)) {
+			stream->tail = NULL;
+		}
+
+		if (stream->head) {
+			stream->ready_next = NULL;
+			if (mux->ready_tail) {
+				mux->ready_tail->ready_next = stream;
+			} else {
+				mux->ready_head = stream;
+			}
+			mux->ready_tail = stream;
+		} else {
+			stream->ready = 0;
+			if (!stream->context) {
+				/* detached and drained */
+				whisper_mux_stream_free(stream);
+			}
+		}
+	}
+	/* with eofs waiting the writer comes back for them once their audio is out */
+	more = frame && (mux->ready_head != NULL || mux->batch_count);
+	switch_mutex_unlock(mux->mutex);
+
+	if (!frame && wait) {
+		lws_set_timer_usecs(mux->wsi, wait > now ? wait - now : 1);
+	}
+
+  write:
+	if (frame) {
+		if (lws_write(mux->wsi, frame->data + LWS_PRE, frame->len, LWS_WRITE_BINARY) < 0) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Unable to write mux frame to %s\n", mux->url);
+		}
+		free(frame);
+	}
+
+	if (more) {
+		lws_callback_on_writable(mux->wsi);
+	}
+}
+
+/* The connection is gone: every stream on it fails like a dropped per-call socket would */
+static void whisper_mux_fail(whisper_mux_t *mux)
+{
+	uint32_t i;
+
+	switch_mutex_lock(mux->mutex);
+	for (i = 0; i < MUX_MAX_STREAMS; i++) {
+		if (mux->streams[i] && mux->streams[i]->context) {
+			whisper_atomic_set(mux->streams[i]->context->started, WS_STATE_DESTROY);
+		}
+	}
+	switch_mutex_unlock(mux->mutex);
+}
+
+/* Collects the fragments of one reply, service thread only */
+int callback_ws_mux(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len)
+{
+	whisper_mux_t *mux = (whisper_mux_t *) lws_wsi_user(wsi);
+	const void *msg = in;
+
+	switch (reason) {
+	case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+		/* a media thread queued something */
+		mux = (whisper_mux_t *) lws_context_user(lws_get_context(wsi));
+		if (mux && mux->wsi && whisper_atomic_get(mux->wc_connected)) {
+			lws_callback_on_writable(mux->wsi);
+		}
+		break;
+	case LWS_CALLBACK_CLIENT_ESTABLISHED:
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Mux connection to %s established\n", mux->url);
+		whisper_atomic_set(mux->wc_connected, TRUE);
+		ws_client_established(wsi, mux->tcp_nodelay);
+		lws_callback_on_writable(wsi);
+		break;
+	case LWS_CALLBACK_CLIENT_WRITEABLE:
+		whisper_mux_write_next(mux);
+		break;
+	case LWS_CALLBACK_TIMER:
+		/* paced frames came due */
+		lws_callback_on_writable(wsi);
+		break;
+	case LWS_CALLBACK_CLIENT_RECEIVE:
+		ws_thread_rx(mux->ws_cpu);
+		if (ws_rx_message(&mux->rx, wsi, &msg, &len, mux->url) && len >= MUX_HEADER_SIZE) {
+			uint32_t id = whisper_mux_get32(msg);
+			whisper_mux_stream_t *stream;
+
+			/* delivered under the lock so a detaching session can't go away underneath */
+			switch_mutex_lock(mux->mutex);
+			if ((stream = mux->streams[id % MUX_MAX_STREAMS]) && stream->id == id && stream->context) {
+				whisper_asr_receive_text(stream->context, (const char *) msg + MUX_HEADER_SIZE, len - MUX_HEADER_SIZE);
+			} else {
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Mux reply for unknown stream %u\n", id);
+			}
+			switch_mutex_unlock(mux->mutex);
+		}
+		break;
+	case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Mux connection to %s failed\n", mux->url);
+		whisper_atomic_set(mux->wc_error, TRUE);
+		whisper_atomic_set(mux->started, WS_STATE_DESTROY);
+		whisper_mux_fail(mux);
+		return -1;
+	case LWS_CALLBACK_CLIENT_CLOSED:
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Mux connection to %s closed\n", mux->url);
+		whisper_atomic_set(mux->started, WS_STATE_DESTROY);
+		whisper_mux_fail(mux);
+		return -1;
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static void *SWITCH_THREAD_FUNC whisper_mux_thread_run(switch_thread_t *thread, void *obj)
+{
+	whisper_mux_t *mux = (whisper_mux_t *) obj;
+	int n = 0;
+
+	ws_thread_enter(mux->ws_cpu);
+
+	while (whisper_atomic_get(mux->started) == WS_STATE_STARTED && n >= 0) {
+		n = lws_service(mux->lws_context, WS_TIMEOUT_MS);
+	}
+
+	if (n < 0) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Mux lws_service on %s failed, dropping the connection\n", mux->url);
+		whisper_atomic_set(mux->started, WS_STATE_DESTROY);
+		whisper_mux_fail(mux);
+	}
+
+	ws_thread_exit(mux->ws_cpu);
+	return NULL;
+}
+
+static void whisper_mux_destroy(whisper_mux_t *mux)
+{
+	switch_memory_pool_t *pool = mux->pool;
+	switch_status_t retval;
+	uint32_t i;
+
+	whisper_atomic_set(mux->started, WS_STATE_DESTROY);
+
+	if (mux->lws_context) {
+		lws_cancel_service(mux->lws_context);
+		if (mux->thread) {
+			switch_thread_join(&retval, mux->thread);
+		}
+		ws_tls_session_save(&mux->lws_ccinfo);
+		lws_context_destroy(mux->lws_context);
+	}
+
+	for (i = 0; i < MUX_MAX_STREAMS; i++) {
+		if (mux->streams[i]) {
+			mux->streams[i]->context = NULL;
+		}
+	}
+
+	/* everything still queued, attached or not, hangs off the ready list or the table */
+	while (mux->ready_head) {
+		whisper_mux_stream_t *stream = mux->ready_head;
+
+		mux->ready_head = stream->ready_next;
+		for (i = 0; i < MUX_MAX_STREAMS; i++) {
+			if (mux->streams[i] == stream) {
+				mux->streams[i] = NULL;
+			}
+		}
+		whisper_mux_stream_free(stream);
+	}
+	for (i = 0; i < MUX_MAX_STREAMS; i++) {
+		if (mux->streams[i]) {
+			whisper_mux_stream_free(mux->streams[i]);
+		}
+	}
+
+	ws_rx_free(&mux->rx);
+	switch_core_destroy_memory_pool(&pool);
+}
+
+static whisper_mux_t *whisper_mux_connect(const char *url, whisper_settings_t *settings)
+{
+	switch_memory_pool_t *pool;
+	switch_threadattr_t *thd_attr = NULL;
+	whisper_mux_t *mux;
+	const char *prot;
+	char *uri;
+
+	if (switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS) {
+		return NULL;
+	}
+
+	mux = switch_core_alloc(pool, sizeof(*mux));
+	mux->pool = pool;
+	mux->url = switch_core_strdup(pool, url);
+	switch_mutex_init(&mux->mutex, SWITCH_MUTEX_NESTED, pool);
+
+	mux->lws_info.port = CONTEXT_PORT_NO_LISTEN;
+	mux->lws_info.protocols = ws_mux_protocols;
+	mux->lws_info.gid = -1;
+	mux->lws_info.uid = -1;
+	mux->lws_info.user = mux;
+	ws_client_context_init(&mux->lws_info, settings);
+	mux->tcp_nodelay = settings->tcp_nodelay;
+
+	if (!(mux->lws_context = lws_create_context(&mux->lws_info))) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "Creating libwebsocket context failed\n");
+		goto fail;
+	}
+
+	/* lws_parse_uri writes into the string */
+	uri = switch_core_strdup(pool, url);
+	if (lws_parse_uri(uri, &prot, &mux->lws_ccinfo.address, &mux->lws_ccinfo.port, &mux->lws_ccinfo.path)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Invalid mux url %s\n", url);
+		goto fail;
+	}
+
+	mux->lws_ccinfo.context = mux->lws_context;
+	ws_client_connect_init(&mux->lws_ccinfo, &mux->lws_retry, prot, settings);
+	mux->lws_ccinfo.host = lws_canonical_hostname(mux->lws_context);
+	mux->lws_ccinfo.origin = "origin";
+	mux->lws_ccinfo.userdata = mux;
+	mux->lws_ccinfo.protocol = ws_mux_protocols[0].name;
+
+	if (!(mux->wsi = lws_client_connect_via_info(&mux->lws_ccinfo))) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "Mux websocket setup failed\n");
+		goto fail;
+	}
+
+	/* shared by many calls, placed by whichever opened it */
+	mux->ws_cpu = ws_thread_cpu_pick(settings);
+	whisper_atomic_set(mux->started, WS_STATE_STARTED);
+	switch_threadattr_create(&thd_attr, pool);
+	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+	switch_thread_create(&mux->thread, thd_attr, whisper_mux_thread_run, mux, pool);
+
+	if (ws_wait_connected(&mux->wc_connected, &mux->wc_error) != SWITCH_STATUS_SUCCESS) {
+		goto fail;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Mux connection to %s up\n", url);
+	return mux;
+
+  fail:
+	whisper_mux_destroy(mux);
+	return NULL;
+}
+
+/* Picks the least loaded live connection, opening one while fewer than the configured count exist */
+switch_status_t whisper_mux_attach(whisper_t *context, const char *url, uint32_t connections)
+{
+	whisper_mux_endpoint_t *endpoint;
+	whisper_mux_stream_t *stream;
+	whisper_mux_t *mux = NULL;
+	uint32_t i, slot, id;
+	int tried = 0;
+
+	if (connections > MUX_MAX_CONNECTIONS) {
+		connections = MUX_MAX_CONNECTIONS;
+	}
+
+	switch_mutex_lock(mux_globals.mutex);
+
+	if (!(endpoint = switch_core_hash_find(mux_globals.endpoints, url))) {
+		endpoint = switch_core_alloc(mux_globals.pool, sizeof(*endpoint));
+		endpoint->url = switch_core_strdup(mux_globals.pool, url);
+		switch_core_hash_insert(mux_globals.endpoints, endpoint->url, endpoint);
+	}
+
+	for (;;) {
+		mux = NULL;
+		slot = MUX_MAX_CONNECTIONS;
+
+		for (i = 0; i < connections; i++) {
+			whisper_mux_t *m = endpoint->muxes[i];
+
+			if (m && whisper_atomic_get(m->started) != WS_STATE_STARTED) {
+				int busy;
+
+				/* dead, the last stream still on it frees it */
+				switch_mutex_lock(m->mutex);
+				if ((busy = m->nstreams > 0)) {
+					m->orphan = 1;
+				}
+				switch_mutex_unlock(m->mutex);
+
+				if (!busy) {
+					whisper_mux_destroy(m);
+				}
+				endpoint->muxes[i] = m = NULL;
+			}
+
+			if (!m) {
+				if (slot == MUX_MAX_CONNECTIONS && !(endpoint->connecting & (1 << i))) {
+					slot = i;
+				}
+			} else if (m->nstreams < MUX_MAX_STREAMS && (!mux || m->nstreams < mux->nstreams)) {
+				mux = m;
+			}
+		}
+
+		if (!tried && (!mux || mux->nstreams) && slot < MUX_MAX_CONNECTIONS) {
+			whisper_mux_t *m;
+
+			/* the handshake takes a while, other calls keep using the live connections meanwhile */
+			endpoint->connecting |= 1 << slot;
+			switch_mutex_unlock(mux_globals.mutex);
+			m = whisper_mux_connect(url, context->settings);
+			switch_mutex_lock(mux_globals.mutex);
+			endpoint->connecting &= ~(1 << slot);
+
+			if (m) {
+				endpoint->muxes[slot] = mux = m;
+				break;
+			}
+
+			/* the table may have changed while unlocked, pick again without connecting */
+			tried = 1;
+			continue;
+		}
+
+		if (mux || !endpoint->connecting) {
+			break;
+		}
+
+		/* every free slot is being connected by someone else, wait for the result */
+		switch_mutex_unlock(mux_globals.mutex);
+		switch_yield(10000);
+		switch_mutex_lock(mux_globals.mutex);
+	}
+
+	if (!mux) {
+		switch_mutex_unlock(mux_globals.mutex);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	switch_zmalloc(stream, sizeof(*stream));
+	stream->context = context;
+
+	switch_mutex_lock(mux->mutex);
+	do {
+		id = ++mux->next_id;
+	} while (mux->streams[id % MUX_MAX_STREAMS]);
+	stream->id = id;
+	mux->streams[id % MUX_MAX_STREAMS] = stream;
+	mux->nstreams++;
+	whisper_mux_queue(mux, stream, MUX_FLAG_OPEN, 0, 0, NULL, 0);
+	switch_mutex_unlock(mux->mutex);
+
+	switch_mutex_unlock(mux_globals.mutex);
+
+	context->mux = mux;
+	context->mux_stream = stream;
+	whisper_atomic_set(context->wc_connected, TRUE);
+	whisper_atomic_set(context->started, WS_STATE_STARTED);
+	lws_cancel_service(mux->lws_context);
+
+	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "ASR stream %u on %s (%u streams)\n", id, url, mux->nstreams);
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+void whisper_mux_detach(whisper_t *context)
+{
+	whisper_mux_t *mux = context->mux;
+	whisper_mux_stream_t *stream = context->mux_stream;
+	int destroy;
+
+	if (!mux) {
+		return;
+	}
+
+	switch_mutex_lock(mux_globals.mutex);
+	switch_mutex_lock(mux->mutex);
+
+	stream->context = NULL;
+	mux->streams[stream->id % MUX_MAX_STREAMS] = NULL;
+	mux->nstreams--;
+
+	if (whisper_atomic_get(mux->started) == WS_STATE_STARTED) {
+		/* the writer frees the stream after CLOSE goes out */
+		whisper_mux_queue(mux, stream, MUX_FLAG_CLOSE, stream->ts_ms, 0, NULL, 0);
+	} else if (!stream->ready) {
+		whisper_mux_stream_free(stream);
+	}
+
+	destroy = mux->orphan && !mux->nstreams;
+	switch_mutex_unlock(mux->mutex);
+	switch_mutex_unlock(mux_globals.mutex);
+
+	if (destroy) {
+		whisper_mux_destroy(mux);
+	} else {
+		lws_cancel_service(mux->lws_context);
+	}
+
+	context->mux = NULL;
+	context->mux_stream = NULL;
+}
+
+switch_status_t whisper_mux_send(whisper_t *context, uint32_t flags, uint32_t ts_ms, switch_time_t due, const void *data, switch_size_t len)
+{
+	whisper_mux_t *mux = context->mux;
+
+	if (whisper_atomic_get(mux->started) != WS_STATE_STARTED) {
+		return SWITCH_STATUS_BREAK;
+	}
+
+	switch_mutex_lock(mux->mutex);
+	if ((flags & MUX_FLAG_EOF) && context->settings->asr_batch_window_ms) {
+		whisper_mux_batch_add(mux, context->mux_stream, ts_ms, context->settings->asr_batch_window_ms);
+	} else {
+		whisper_mux_queue(mux, context->mux_stream, flags, ts_ms, due, data, len);
+	}
+	switch_mutex_unlock(mux->mutex);
+
+	lws_cancel_service(mux->lws_context);
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+void whisper_mux_init(switch_memory_pool_t *pool)
+{
+	mux_globals.pool = pool;
+	switch_mutex_init(&mux_globals.mutex, SWITCH_MUTEX_NESTED, pool);
+	switch_core_hash_init(&mux_globals.endpoints);
+}
+
+void whisper_mux_shutdown(void)
+{
+	switch_hash_index_t *hi;
+	void *val;
+	uint32_t i;
+
+	switch_mutex_lock(mux_globals.mutex);
+	for (hi = switch_core_hash_first(mux_globals.endpoints); hi; hi = switch_core_hash_next(&hi)) {
+		whisper_mux_endpoint_t *endpoint;
+
+		switch_core_hash_this(hi, NULL, NULL, &val);
+		endpoint = (whisper_mux_endpoint_t *) val;
+
+		for (i = 0; i < MUX_MAX_CONNECTIONS; i++) {
+			if (endpoint->muxes[i]) {
+				whisper_mux_destroy(endpoint->muxes[i]);
+				endpoint->muxes[i] = NULL;
+			}
+		}
+	}
+	switch_core_hash_destroy(&mux_globals.endpoints);
+	switch_mutex_unlock(mux_globals.mutex);
+}
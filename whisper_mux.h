@@ -0,0 +1,44 @@
+#ifndef __WHISPER_MUX_H__
+#define __WHISPER_MUX_H__
+
+#include "mod_whisper.h"
+
+/*
+ * 多路复用模式: 每个服务器地址最多 MUX_MAX_CONNECTIONS 条 websocket, 承载所有 ASR 会话.
+ * 双向都是二进制帧, 前 16 字节为网络字节序头部 {stream_id, seq, flags, ts_ms}, 后面是负载.
+ * 服务器回复的负载是识别结果文本, 按 stream_id 分发给对应会话.
+ * ts_ms 是会话打开以来的媒体时间 (音频块为其第一个样本), 服务器可据此区分网络延迟和静音.
+ * 每呼叫连接打开 asr-pace-catchup 时, 音频帧也带同样的头部, stream_id 为 0.
+ */
+#define MUX_HEADER_SIZE 16
+#define MUX_MAX_CONNECTIONS 16
+#define MUX_MAX_STREAMS 1024
+
+/*
+ * eof 合并: asr-batch-window-ms 大于 0 时, 各会话的 eof 不再单独发送, 在窗口内攒成一帧
+ * {stream_id 0, flags EOF|BATCH}, 负载为 N 个 8 字节 {stream_id, ts_ms}, 服务器一次推理这些句子,
+ * 结果仍按 stream_id 逐个回复. 成员的音频帧全部发出后才发送, 满 MUX_BATCH_MAX 个立即发送.
+ */
+#define MUX_BATCH_MAX 64
+#define MUX_BATCH_WINDOW_MAX_MS 200
+
+typedef enum {
+	MUX_FLAG_EOF = (1 << 0),        // 结束本句, 等同 {"eof": true}
+	MUX_FLAG_FINALIZE = (1 << 1),   // 推测性结果请求, 等同 {"finalize": true}
+	MUX_FLAG_TEXT = (1 << 2),       // 负载是 JSON 控制消息 (语法等)
+	MUX_FLAG_OPEN = (1 << 3),       // 新会话
+	MUX_FLAG_CLOSE = (1 << 4),      // 会话结束
+	MUX_FLAG_BATCH = (1 << 5)       // 与 EOF 一起: 负载是多个会话的 {stream_id, ts_ms}
+} whisper_mux_flag_t;
+
+void whisper_mux_init(switch_memory_pool_t *pool);
+void whisper_mux_shutdown(void);
+
+switch_status_t whisper_mux_attach(whisper_t *context, const char *url, uint32_t connections);
+void whisper_mux_detach(whisper_t *context);
+switch_status_t whisper_mux_send(whisper_t *context, uint32_t flags, uint32_t ts_ms, switch_time_t due, const void *data, switch_size_t len);
+void whisper_mux_header(uint8_t *p, uint32_t stream_id, uint32_t seq, uint32_t flags, uint32_t ts_ms);
+
+int callback_ws_mux(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
+
+#endif
@@ -0,0 +1,410 @@
+#include "mod_whisper.h"
+#include "whisper_stage.h"
+
+typedef enum {
+	STAGE_ITEM_PENDING,
+	STAGE_ITEM_READY,
+	STAGE_ITEM_FAILED
+} whisper_stage_item_state_t;
+
+struct whisper_stage_item {
+	struct whisper_stage_item *next;
+	char *voice;
+	char *text;
+	uint32_t rate;              /* channel rate the prompt was requested at */
+	uint32_t native_rate;       /* rate of the staged audio */
+	whisper_stage_item_state_t state;
+	uint32_t refs;              /* the prefetch thread and players */
+	switch_bool_t linked;
+	uint8_t *audio;
+	switch_size_t len;
+	switch_size_t size;
+};
+
+/* everything below the refs is protected by mutex */
+struct whisper_stage {
+	volatile uint32_t refs;     /* the channel, prefetch threads and speech handles */
+	volatile int closed;
+	struct whisper_stage *prev, *next;  /* attached to a channel, under stage_globals.mutex */
+	switch_bool_t attached;
+	char *uuid;
+	switch_memory_pool_t *pool;
+	switch_mutex_t *mutex;
+	switch_size_t max_bytes;
+	switch_size_t bytes;
+	uint32_t count;
+	whisper_stage_item_t *head;
+};
+
+static struct {
+	switch_mutex_t *mutex;      /* attaching and detaching stages from channels */
+	whisper_stage_t *head;      /* every stage still attached, freed at shutdown */
+	int started;
+} stage_globals;
+
+/* Caller holds stage_globals.mutex */
+static void whisper_stage_detach(whisper_stage_t *stage)
+{
+	if (stage->prev) {
+		stage->prev->next = stage->next;
+	} else {
+		stage_globals.head = stage->next;
+	}
+	if (stage->next) {
+		stage->next->prev = stage->prev;
+	}
+	stage->prev = stage->next = NULL;
+	stage->attached = SWITCH_FALSE;
+}
+
+static void whisper_stage_item_free(whisper_stage_item_t *item)
+{
+	switch_safe_free(item->audio);
+	switch_safe_free(item->voice);
+	switch_safe_free(item->text);
+	free(item);
+}
+
+/* Caller holds the stage mutex */
+static void whisper_stage_unlink(whisper_stage_t *stage, whisper_stage_item_t *item)
+{
+	whisper_stage_item_t **pp;
+
+	for (pp = &stage->head; *pp; pp = &(*pp)->next) {
+		if (*pp == item) {
+			*pp = item->next;
+			break;
+		}
+	}
+
+	item->linked = SWITCH_FALSE;
+	item->next = NULL;
+	stage->count--;
+	stage->bytes -= item->len;
+	__atomic_sub_fetch(&whisper_globals.tts_staged_bytes, item->len, __ATOMIC_RELAXED);
+
+	switch_safe_free(item->audio);
+	item->len = item->size = 0;
+
+	if (!item->refs) {
+		whisper_stage_item_free(item);
+	}
+}
+
+/* Drops the oldest finished prompt nobody is playing, caller holds the stage mutex */
+static switch_bool_t whisper_stage_evict(whisper_stage_t *stage, whisper_stage_item_t *keep)
+{
+	whisper_stage_item_t *item;
+
+	for (item = stage->head; item; item = item->next) {
+		if (item != keep && !item->refs && item->state == STAGE_ITEM_READY) {
+			whisper_stage_unlink(stage, item);
+			return SWITCH_TRUE;
+		}
+	}
+
+	return SWITCH_FALSE;
+}
+
+/* Caller holds the stage mutex */
+static whisper_stage_item_t *whisper_stage_lookup(whisper_stage_t *stage, const char *voice, const char *text, uint32_t rate)
+{
+	whisper_stage_item_t *item;
+
+	for (item = stage->head; item; item = item->next) {
+		if (item->rate == rate && !strcmp(item->text, text) && !strcmp(item->voice, voice)) {
+			return item;
+		}
+	}
+
+	return NULL;
+}
+
+static void whisper_stage_destroy(whisper_stage_t *stage)
+{
+	switch_memory_pool_t *pool = stage->pool;
+
+	switch_mutex_lock(stage->mutex);
+	while (stage->head) {
+		whisper_stage_unlink(stage, stage->head);
+	}
+	switch_mutex_unlock(stage->mutex);
+
+	switch_core_destroy_memory_pool(&pool);
+}
+
+static switch_status_t whisper_stage_on_destroy(switch_core_session_t *session)
+{
+	switch_channel_t *channel = switch_core_session_get_channel(session);
+	whisper_stage_t *stage;
+
+	switch_mutex_lock(stage_globals.mutex);
+	if ((stage = switch_channel_get_private(channel, STAGE_PRIVATE_KEY))) {
+		switch_channel_set_private(channel, STAGE_PRIVATE_KEY, NULL);
+		if (stage->attached) {
+			whisper_stage_detach(stage);
+		} else {
+			/* shutdown took the channel's reference already */
+			stage = NULL;
+		}
+	}
+	switch_mutex_unlock(stage_globals.mutex);
+
+	if (stage) {
+		/* prefetch threads still running see this and give up */
+		whisper_atomic_set(stage->closed, 1);
+		whisper_stage_release(&stage);
+	}
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static switch_state_handler_table_t whisper_stage_state_handlers = {
+	/*.on_init */ NULL,
+	/*.on_routing */ NULL,
+	/*.on_execute */ NULL,
+	/*.on_hangup */ NULL,
+	/*.on_exchange_media */ NULL,
+	/*.on_soft_execute */ NULL,
+	/*.on_consume_media */ NULL,
+	/*.on_hibernate */ NULL,
+	/*.on_reset */ NULL,
+	/*.on_park */ NULL,
+	/*.on_reporting */ NULL,
+	/*.on_destroy */ whisper_stage_on_destroy
+};
+
+switch_status_t whisper_stage_init(switch_memory_pool_t *pool)
+{
+	switch_mutex_init(&stage_globals.mutex, SWITCH_MUTEX_NESTED, pool);
+	switch_core_add_state_handler(&whisper_stage_state_handlers);
+	stage_globals.started = 1;
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* After the prefetch threads are gone: live channels give up their stages, the destroy hook goes with the module */
+void whisper_stage_shutdown(void)
+{
+	whisper_stage_t *stage;
+
+	if (!stage_globals.started) {
+		return;
+	}
+
+	switch_core_remove_state_handler(&whisper_stage_state_handlers);
+
+	switch_mutex_lock(stage_globals.mutex);
+	stage_globals.started = 0;
+	while ((stage = stage_globals.head)) {
+		switch_core_session_t *session;
+
+		whisper_stage_detach(stage);
+
+		if ((session = switch_core_session_locate(stage->uuid))) {
+			switch_channel_t *channel = switch_core_session_get_channel(session);
+
+			if (switch_channel_get_private(channel, STAGE_PRIVATE_KEY) == stage) {
+				switch_channel_set_private(channel, STAGE_PRIVATE_KEY, NULL);
+			}
+			switch_core_session_rwunlock(session);
+		}
+
+		whisper_atomic_set(stage->closed, 1);
+		whisper_stage_release(&stage);
+	}
+	switch_mutex_unlock(stage_globals.mutex);
+}
+
+/* Returns a reference to the channel's stage, created on first use when max_bytes is not 0 */
+whisper_stage_t *whisper_stage_get(switch_core_session_t *session, switch_size_t max_bytes)
+{
+	switch_channel_t *channel = switch_core_session_get_channel(session);
+	switch_memory_pool_t *pool = NULL;
+	whisper_stage_t *stage;
+
+	switch_mutex_lock(stage_globals.mutex);
+	if (!(stage = switch_channel_get_private(channel, STAGE_PRIVATE_KEY)) && max_bytes && stage_globals.started &&
+		switch_core_new_memory_pool(&pool) == SWITCH_STATUS_SUCCESS) {
+		stage = switch_core_alloc(pool, sizeof(*stage));
+		stage->pool = pool;
+		stage->max_bytes = max_bytes;
+		stage->refs = 1;
+		stage->uuid = switch_core_strdup(pool, switch_core_session_get_uuid(session));
+		switch_mutex_init(&stage->mutex, SWITCH_MUTEX_NESTED, pool);
+		switch_channel_set_private(channel, STAGE_PRIVATE_KEY, stage);
+
+		stage->attached = SWITCH_TRUE;
+		if ((stage->next = stage_globals.head)) {
+			stage->next->prev = stage;
+		}
+		stage_globals.head = stage;
+	}
+
+	if (stage) {
+		__atomic_add_fetch(&stage->refs, 1, __ATOMIC_ACQ_REL);
+	}
+	switch_mutex_unlock(stage_globals.mutex);
+
+	return stage;
+}
+
+void whisper_stage_release(whisper_stage_t **stage)
+{
+	if (*stage) {
+		if (!__atomic_sub_fetch(&(*stage)->refs, 1, __ATOMIC_ACQ_REL)) {
+			whisper_stage_destroy(*stage);
+		}
+		*stage = NULL;
+	}
+}
+
+switch_bool_t whisper_stage_closed(whisper_stage_t *stage)
+{
+	return whisper_atomic_get(stage->closed) ? SWITCH_TRUE : SWITCH_FALSE;
+}
+
+/* New pending prompt held by the caller, NULL when it is already staged or the stage is full */
+whisper_stage_item_t *whisper_stage_add(whisper_stage_t *stage, const char *voice, const char *text, uint32_t rate)
+{
+	whisper_stage_item_t *item, **pp;
+
+	switch_mutex_lock(stage->mutex);
+	if ((item = whisper_stage_lookup(stage, voice, text, rate))) {
+		switch_mutex_unlock(stage->mutex);
+		return NULL;
+	}
+
+	if (stage->count >= STAGE_MAX_ITEMS && !whisper_stage_evict(stage, NULL)) {
+		switch_mutex_unlock(stage->mutex);
+		return NULL;
+	}
+
+	if ((item = calloc(1, sizeof(*item)))) {
+		item->voice = strdup(voice);
+		item->text = strdup(text);
+		item->rate = item->native_rate = rate;
+		item->state = STAGE_ITEM_PENDING;
+		item->refs = 1;
+		item->linked = SWITCH_TRUE;
+
+		for (pp = &stage->head; *pp; pp = &(*pp)->next);
+		*pp = item;
+		stage->count++;
+	}
+	switch_mutex_unlock(stage->mutex);
+
+	return item;
+}
+
+/* Over max_bytes older prompts are dropped first, then this one fails */
+switch_status_t whisper_stage_append(whisper_stage_t *stage, whisper_stage_item_t *item, const void *data, switch_size_t len, uint32_t native_rate)
+{
+	switch_status_t status = SWITCH_STATUS_SUCCESS;
+
+	switch_mutex_lock(stage->mutex);
+	while (stage->bytes + len > stage->max_bytes && whisper_stage_evict(stage, item));
+
+	if (!item->linked || stage->bytes + len > stage->max_bytes) {
+		status = SWITCH_STATUS_MEMERR;
+	} else {
+		if (item->len + len > item->size) {
+			switch_size_t size = item->size ? item->size : len * 16;
+			uint8_t *audio;
+
+			while (size < item->len + len) {
+				size *= 2;
+			}
+			if (!(audio = realloc(item->audio, size))) {
+				switch_mutex_unlock(stage->mutex);
+				return SWITCH_STATUS_MEMERR;
+			}
+			item->audio = audio;
+			item->size = size;
+		}
+
+		memcpy(item->audio + item->len, data, len);
+		item->len += len;
+		item->native_rate = native_rate;
+		stage->bytes += len;
+		__atomic_add_fetch(&whisper_globals.tts_staged_bytes, len, __ATOMIC_RELAXED);
+	}
+	switch_mutex_unlock(stage->mutex);
+
+	return status;
+}
+
+/* Ends synthesis of a prompt and drops the caller's reference, failed prompts are removed */
+void whisper_stage_finish(whisper_stage_t *stage, whisper_stage_item_t **item, switch_bool_t ok)
+{
+	switch_mutex_lock(stage->mutex);
+	if (ok && (*item)->linked) {
+		(*item)->state = STAGE_ITEM_READY;
+	} else {
+		(*item)->state = STAGE_ITEM_FAILED;
+		if ((*item)->linked) {
+			whisper_stage_unlink(stage, *item);
+		}
+	}
+	switch_mutex_unlock(stage->mutex);
+
+	whisper_stage_item_release(stage, item);
+}
+
+/* A staged or still synthesizing prompt for the player, NULL on a miss */
+whisper_stage_item_t *whisper_stage_find(whisper_stage_t *stage, const char *voice, const char *text, uint32_t rate)
+{
+	whisper_stage_item_t *item;
+
+	switch_mutex_lock(stage->mutex);
+	if ((item = whisper_stage_lookup(stage, voice, text, rate))) {
+		item->refs++;
+	}
+	switch_mutex_unlock(stage->mutex);
+
+	return item;
+}
+
+/*
+ * Copies the audio after *pos. SWITCH_STATUS_BREAK when the reader caught up with
+ * a prompt still being synthesized, SWITCH_STATUS_FALSE at the end or if it failed.
+ */
+switch_status_t whisper_stage_read(whisper_stage_t *stage, whisper_stage_item_t *item, switch_size_t *pos, void *data, switch_size_t *len, uint32_t *native_rate)
+{
+	switch_status_t status = SWITCH_STATUS_FALSE;
+	switch_size_t bytes;
+
+	switch_mutex_lock(stage->mutex);
+	if (item->linked) {
+		if ((bytes = item->len - *pos) > 0) {
+			if (bytes > *len) {
+				bytes = *len;
+			}
+			/* whole samples only */
+			bytes &= ~(switch_size_t) 1;
+			memcpy(data, item->audio + *pos, bytes);
+			*pos += bytes;
+			*len = bytes;
+			*native_rate = item->native_rate;
+			status = SWITCH_STATUS_SUCCESS;
+		} else if (item->state == STAGE_ITEM_PENDING) {
+			status = SWITCH_STATUS_BREAK;
+		}
+	}
+	switch_mutex_unlock(stage->mutex);
+
+	return status;
+}
+
+void whisper_stage_item_release(whisper_stage_t *stage, whisper_stage_item_t **item)
+{
+	if (*item) {
+		switch_mutex_lock(stage->mutex);
+		if (!--(*item)->refs && !(*item)->linked) {
+			whisper_stage_item_free(*item);
+		}
+		switch_mutex_unlock(stage->mutex);
+		*item = NULL;
+	}
+}
+
@@ -0,0 +1,33 @@
+#ifndef __WHISPER_STAGE_H__
+#define __WHISPER_STAGE_H__
+
+#include "mod_whisper.h"
+
+/*
+ * TTS 预合成暂存区: 每个通道一份, 挂在通道私有数据上, 通道销毁时释放.
+ * 后台线程按 (音色, 文本, 采样率) 写入合成好的音频, 之后 speak 同样的文本直接从暂存区播放.
+ * 合成还没完成时也可以边写边读.
+ */
+#define STAGE_PRIVATE_KEY "__whisper_stage"
+#define STAGE_MAX_BYTES_DEFAULT (4 * 1024 * 1024)
+#define STAGE_MAX_ITEMS 32
+
+typedef struct whisper_stage whisper_stage_t;
+typedef struct whisper_stage_item whisper_stage_item_t;
+
+switch_status_t whisper_stage_init(switch_memory_pool_t *pool);
+void whisper_stage_shutdown(void);
+
+whisper_stage_t *whisper_stage_get(switch_core_session_t *session, switch_size_t max_bytes);
+void whisper_stage_release(whisper_stage_t **stage);
+switch_bool_t whisper_stage_closed(whisper_stage_t *stage);
+
+whisper_stage_item_t *whisper_stage_add(whisper_stage_t *stage, const char *voice, const char *text, uint32_t rate);
+switch_status_t whisper_stage_append(whisper_stage_t *stage, whisper_stage_item_t *item, const void *data, switch_size_t len, uint32_t native_rate);
+void whisper_stage_finish(whisper_stage_t *stage, whisper_stage_item_t **item, switch_bool_t ok);
+
+whisper_stage_item_t *whisper_stage_find(whisper_stage_t *stage, const char *voice, const char *text, uint32_t rate);
+switch_status_t whisper_stage_read(whisper_stage_t *stage, whisper_stage_item_t *item, switch_size_t *pos, void *data, switch_size_t *len, uint32_t *native_rate);
+void whisper_stage_item_release(whisper_stage_t *stage, whisper_stage_item_t **item);
+
+#endif
@@ -0,0 +1,308 @@
+#include "mod_whisper.h"
+#include "whisper_tap.h"
+
+typedef enum {
+	TAP_REC_AUDIO,
+	TAP_REC_EVENT,
+	TAP_REC_CLOSE
+} whisper_tap_rec_type_t;
+
+typedef struct whisper_tap_rec {
+	struct whisper_tap_rec *next;
+	whisper_tap_t *tap;
+	whisper_tap_rec_type_t type;
+	const char *event;
+	uint32_t audio_ms;
+	uint32_t wall_ms;
+	uint32_t len;
+	uint8_t data[];
+} whisper_tap_rec_t;
+
+struct whisper_tap {
+	char *path;                 /* without extension */
+	char *uuid;
+	char *profile;
+	uint32_t rate;
+	switch_time_t start;
+	volatile uint64_t samples;  /* audio fed so far, the time base for events */
+	volatile uint32_t dropped;
+
+	/* writer thread only */
+	switch_file_handle_t fh;
+	FILE *sidecar;
+	int opened;
+	int events;
+};
+
+static struct {
+	whisper_tap_rec_t *volatile head;
+	volatile switch_size_t pending;
+	volatile int running;
+	switch_thread_t *thread;
+} tap_globals;
+
+/* Lock-free push, any thread */
+static void whisper_tap_push(whisper_tap_rec_t *rec)
+{
+	whisper_tap_rec_t *head = __atomic_load_n(&tap_globals.head, __ATOMIC_ACQUIRE);
+
+	do {
+		rec->next = head;
+	} while (!__atomic_compare_exchange_n(&tap_globals.head, &head, rec, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+/* Over the byte budget the record is dropped, callers never wait on the disk */
+static whisper_tap_rec_t *whisper_tap_rec_alloc(whisper_tap_t *tap, whisper_tap_rec_type_t type, uint32_t len)
+{
+	whisper_tap_rec_t *rec;
+	switch_size_t size = sizeof(*rec) + len;
+
+	if (type != TAP_REC_CLOSE && __atomic_load_n(&tap_globals.pending, __ATOMIC_ACQUIRE) + size > TAP_QUEUE_MAX_BYTES) {
+		__atomic_add_fetch(&tap->dropped, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	if (!(rec = malloc(size))) {
+		return NULL;
+	}
+
+	__atomic_add_fetch(&tap_globals.pending, size, __ATOMIC_ACQ_REL);
+
+	rec->tap = tap;
+	rec->type = type;
+	rec->event = NULL;
+	rec->len = len;
+	rec->audio_ms = (uint32_t) (__atomic_load_n(&tap->samples, __ATOMIC_ACQUIRE) * 1000 / tap->rate);
+	rec->wall_ms = (uint32_t) ((switch_micro_time_now() - tap->start) / 1000);
+
+	return rec;
+}
+
+whisper_tap_t *whisper_tap_create(const char *dir, const char *uuid, uint32_t rate, const char *profile)
+{
+	whisper_tap_t *tap;
+
+	if (!__atomic_load_n(&tap_globals.running, __ATOMIC_ACQUIRE) || zstr(dir) || !rate) {
+		return NULL;
+	}
+
+	switch_zmalloc(tap, sizeof(*tap));
+	tap->start = switch_micro_time_now();
+	tap->rate = rate;
+	tap->uuid = strdup(zstr(uuid) ? "unknown" : uuid);
+	tap->profile = strdup(zstr(profile) ? "default" : profile);
+	tap->path = switch_mprintf("%s%s%s-%" SWITCH_TIME_T_FMT, dir, SWITCH_PATH_SEPARATOR, tap->uuid, tap->start / 1000);
+
+	return tap;
+}
+
+void whisper_tap_audio(whisper_tap_t *tap, const void *data, uint32_t len)
+{
+	whisper_tap_rec_t *rec;
+
+	if (!tap) {
+		return;
+	}
+
+	if ((rec = whisper_tap_rec_alloc(tap, TAP_REC_AUDIO, len))) {
+		memcpy(rec->data, data, len);
+		whisper_tap_push(rec);
+	}
+
+	__atomic_add_fetch(&tap->samples, len / sizeof(int16_t), __ATOMIC_ACQ_REL);
+}
+
+/* event must be a string literal, text is copied */
+void whisper_tap_event(whisper_tap_t *tap, const char *event, const char *text)
+{
+	whisper_tap_rec_t *rec;
+	uint32_t len = zstr(text) ? 0 : (uint32_t) strlen(text) + 1;
+
+	if (!tap || !(rec = whisper_tap_rec_alloc(tap, TAP_REC_EVENT, len))) {
+		return;
+	}
+
+	rec->event = event;
+	if (len) {
+		memcpy(rec->data, text, len);
+	}
+
+	whisper_tap_push(rec);
+}
+
+/* The writer finishes the files and frees the tap */
+void whisper_tap_close(whisper_tap_t **tap)
+{
+	whisper_tap_rec_t *rec;
+
+	if (!*tap) {
+		return;
+	}
+
+	if ((rec = whisper_tap_rec_alloc(*tap, TAP_REC_CLOSE, 0))) {
+		whisper_tap_push(rec);
+	}
+
+	*tap = NULL;
+}
+
+/* Writer side */
+
+static switch_bool_t whisper_tap_open_files(whisper_tap_t *tap)
+{
+	char *wav, *json, *dir, *p;
+
+	tap->opened = -1;
+
+	dir = strdup(tap->path);
+	if ((p = strrchr(dir, *SWITCH_PATH_SEPARATOR))) {
+		*p = '\0';
+		switch_dir_make_recursive(dir, SWITCH_DEFAULT_DIR_PERMS, NULL);
+	}
+	free(dir);
+
+	wav = switch_mprintf("%s.wav", tap->path);
+	json = switch_mprintf("%s.json", tap->path);
+
+	if (switch_core_file_open(&tap->fh, wav, 1, tap->rate, SWITCH_FILE_FLAG_WRITE | SWITCH_FILE_DATA_SHORT, NULL) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(tap->uuid), SWITCH_LOG_ERROR, "Unable to open tap recording %s\n", wav);
+	} else if (!(tap->sidecar = fopen(json, "w"))) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(tap->uuid), SWITCH_LOG_ERROR, "Unable to open tap sidecar %s\n", json);
+		switch_core_file_close(&tap->fh);
+	} else {
+		fprintf(tap->sidecar, "{\"uuid\":\"%s\",\"rate\":%u,\"profile\":\"%s\",\"start\":%" SWITCH_TIME_T_FMT ",\"events\":[",
+				tap->uuid, tap->rate, tap->profile, tap->start / 1000);
+		tap->opened = 1;
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(tap->uuid), SWITCH_LOG_DEBUG, "Recording ASR tap to %s\n", wav);
+	}
+
+	switch_safe_free(wav);
+	switch_safe_free(json);
+
+	return tap->opened > 0;
+}
+
+static void whisper_tap_write_event(whisper_tap_t *tap, whisper_tap_rec_t *rec)
+{
+	ks_json_t *ev = ks_json_create_object();
+	char *str;
+
+	ks_json_add_string_to_object(ev, "event", rec->event);
+	ks_json_add_number_to_object(ev, "audio_ms", rec->audio_ms);
+	ks_json_add_number_to_object(ev, "wall_ms", rec->wall_ms);
+	if (rec->len) {
+		ks_json_add_string_to_object(ev, "text", (const char *) rec->data);
+	}
+
+	if ((str = ks_json_print_unformatted(ev))) {
+		fprintf(tap->sidecar, "%s%s", tap->events++ ? "," : "", str);
+		free(str);
+	}
+
+	ks_json_delete(&ev);
+}
+
+static void whisper_tap_finish(whisper_tap_t *tap)
+{
+	if (tap->opened > 0) {
+		fprintf(tap->sidecar, "],\"audio_ms\":%u,\"dropped\":%u}\n", (uint32_t) (tap->samples * 1000 / tap->rate), tap->dropped);
+		fclose(tap->sidecar);
+		switch_core_file_close(&tap->fh);
+	}
+
+	if (tap->dropped) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(tap->uuid), SWITCH_LOG_WARNING, "ASR tap dropped %u records, the writer fell behind\n", tap->dropped);
+	}
+
+	switch_safe_free(tap->path);
+	switch_safe_free(tap->uuid);
+	switch_safe_free(tap->profile);
+	free(tap);
+}
+
+static void whisper_tap_process(whisper_tap_rec_t *rec)
+{
+	whisper_tap_t *tap = rec->tap;
+
+	if (!tap->opened && rec->type != TAP_REC_CLOSE) {
+		whisper_tap_open_files(tap);
+	}
+
+	if (rec->type == TAP_REC_AUDIO && tap->opened > 0) {
+		switch_size_t samples = rec->len / sizeof(int16_t);
+
+		switch_core_file_write(&tap->fh, rec->data, &samples);
+	} else if (rec->type == TAP_REC_EVENT && tap->opened > 0) {
+		whisper_tap_write_event(tap, rec);
+	} else if (rec->type == TAP_REC_CLOSE) {
+		whisper_tap_finish(tap);
+	}
+}
+
+/* Takes everything queued so far in one exchange and writes it in arrival order */
+static switch_bool_t whisper_tap_drain(void)
+{
+	whisper_tap_rec_t *rec = __atomic_exchange_n(&tap_globals.head, NULL, __ATOMIC_ACQ_REL), *list = NULL, *next;
+
+	if (!rec) {
+		return SWITCH_FALSE;
+	}
+
+	for (; rec; rec = next) {
+		next = rec->next;
+		rec->next = list;
+		list = rec;
+	}
+
+	for (rec = list; rec; rec = next) {
+		next = rec->next;
+		whisper_tap_process(rec);
+		__atomic_sub_fetch(&tap_globals.pending, sizeof(*rec) + rec->len, __ATOMIC_ACQ_REL);
+		free(rec);
+	}
+
+	return SWITCH_TRUE;
+}
+
+static void *SWITCH_THREAD_FUNC whisper_tap_thread_run(switch_thread_t *thread, void *obj)
+{
+	while (__atomic_load_n(&tap_globals.running, __ATOMIC_ACQUIRE)) {
+		if (!whisper_tap_drain()) {
+			switch_yield(TAP_WRITER_IDLE_MS * 1000);
+		}
+	}
+
+	while (whisper_tap_drain());
+
+	return NULL;
+}
+
+switch_status_t whisper_tap_start(switch_memory_pool_t *pool)
+{
+	switch_threadattr_t *thd_attr = NULL;
+
+	__atomic_store_n(&tap_globals.running, 1, __ATOMIC_RELEASE);
+
+	switch_threadattr_create(&thd_attr, pool);
+	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+
+	if (switch_thread_create(&tap_globals.thread, thd_attr, whisper_tap_thread_run, NULL, pool) != SWITCH_STATUS_SUCCESS) {
+		__atomic_store_n(&tap_globals.running, 0, __ATOMIC_RELEASE);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+void whisper_tap_stop(void)
+{
+	switch_status_t retval;
+
+	if (!tap_globals.thread) {
+		return;
+	}
+
+	__atomic_store_n(&tap_globals.running, 0, __ATOMIC_RELEASE);
+	switch_thread_join(&retval, tap_globals.thread);
+	tap_globals.thread = NULL;
+}
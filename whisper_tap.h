@@ -0,0 +1,18 @@
+#ifndef __WHISPER_TAP_H__
+#define __WHISPER_TAP_H__
+
+#include "mod_whisper.h"
+
+// 录音旁路: 媒体线程只拷贝数据入无锁队列, 后台线程批量写 WAV 和 JSON 事件文件
+#define TAP_QUEUE_MAX_BYTES (8 * 1024 * 1024)
+#define TAP_WRITER_IDLE_MS 20
+
+switch_status_t whisper_tap_start(switch_memory_pool_t *pool);
+void whisper_tap_stop(void);
+
+whisper_tap_t *whisper_tap_create(const char *dir, const char *uuid, uint32_t rate, const char *profile);
+void whisper_tap_audio(whisper_tap_t *tap, const void *data, uint32_t len);
+void whisper_tap_event(whisper_tap_t *tap, const char *event, const char *text);
+void whisper_tap_close(whisper_tap_t **tap);
+
+#endif